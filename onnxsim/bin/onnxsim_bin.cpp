@@ -1,31 +1,205 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
 
-#include "onnx/common/file_utils.h"
+#include "external_data.h"
 #include "onnxsim.h"
 #include "onnxsim_option.h"
+#include "onnxsim_server.h"
+#include "thread_pool.h"
 
-int main(int argc, char** argv) {
-  // force env initialization to register opset
-  InitEnv();
-  OnnxsimOption option(argc, argv);
+// `on_warning` receives the warnings of the simplification, null means they
+// are printed.
+void SimplifyFile(
+    const OnnxsimOption& option, const std::string& input_model_filename,
+    const std::string& output_model_filename,
+    std::function<void(const std::string&)> on_warning = nullptr) {
   bool no_opt = option.Get<bool>("no-opt");
   bool no_sim = option.Get<bool>("no-sim");
   bool no_shape_inference = option.Get<bool>("no-shape-inference");
-  auto input_model_filename = option.Get<std::string>("input-model");
-  auto output_model_filename = option.Get<std::string>("output-model");
+  bool save_as_external_data = option.Get<bool>("save-as-external-data");
 
-  onnx::ModelProto model;
-  onnx::LoadProtoFromPath(input_model_filename, model);
+  // without --save-as-external-data, the data stays in the model file
+  // unless the model would reach the 2GB limit of protobuf
+  ExternalDataOptions options;
+  if (!save_as_external_data) {
+    options.min_bytes = SIZE_MAX;
+  }
+  options.max_file_bytes = option.Get<size_t>("max-external-data-file-size");
+  options.alignment = option.Get<size_t>("external-data-alignment");
+  options.order_by_first_use =
+      option.Get<bool>("order-external-data-by-first-use");
 
-  model = Simplify(
-      model,
+  auto state = GetDefaultState();
+  state.on_warning = std::move(on_warning);
+  // the external data of the input model is read through SimplifyPath, and
+  // with ONNXSIM_MMAP_EXTERNAL_DATA=1 copied to the output without loading
+  SimplifyPath(
+      input_model_filename, output_model_filename,
       no_opt ? std::nullopt : std::make_optional<std::vector<std::string>>({}),
-      !no_sim, !no_shape_inference, SIZE_MAX);
+      !no_sim, !no_shape_inference, SIZE_MAX, state, options);
+}
+
+// Whether `name` matches `pattern`, in which '*' matches any string and '?'
+// any character.
+bool MatchWildcard(const std::string& pattern, const std::string& name) {
+  size_t p = 0, n = 0;
+  // the pattern position after the last '*' and the name position it is
+  // matched up to
+  size_t star = std::string::npos, star_n = 0;
+  while (n < name.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+      p++;
+      n++;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = ++p;
+      star_n = n;
+    } else if (star != std::string::npos) {
+      p = star;
+      n = ++star_n;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.size() && pattern[p] == '*') {
+    p++;
+  }
+  return p == pattern.size();
+}
+
+// The (input, output) pairs of the --batch option: the lines of a manifest
+// file, or the files matching a glob (wildcards in the file name only)
+// written to --output-dir under the same name.
+std::vector<std::pair<std::string, std::string>> GetBatch(
+    const OnnxsimOption& option) {
+  namespace fs = std::filesystem;
+  const auto batch = option.Get<std::string>("batch");
+  std::vector<std::pair<std::string, std::string>> pairs;
+  if (batch.find_first_of("*?") == std::string::npos) {
+    std::ifstream ifs(batch);
+    if (!ifs) {
+      throw std::invalid_argument("cannot open the manifest " + batch);
+    }
+    std::string line;
+    while (std::getline(ifs, line)) {
+      std::istringstream iss(line);
+      std::string input, output;
+      if (!(iss >> input) || input[0] == '#') {
+        continue;
+      }
+      if (!(iss >> output)) {
+        throw std::invalid_argument("no output model for " + input);
+      }
+      pairs.emplace_back(input, output);
+    }
+    return pairs;
+  }
+  if (!option.Count("output-dir")) {
+    throw std::invalid_argument("--output-dir is required by a --batch glob");
+  }
+  const auto output_dir = fs::path(option.Get<std::string>("output-dir"));
+  fs::create_directories(output_dir);
+  const auto pattern = fs::path(batch);
+  const auto dir =
+      pattern.has_parent_path() ? pattern.parent_path() : fs::path(".");
+  for (const auto& x : fs::directory_iterator(dir)) {
+    const auto name = x.path().filename().string();
+    if (x.is_regular_file() &&
+        MatchWildcard(pattern.filename().string(), name)) {
+      pairs.emplace_back(x.path().string(), (output_dir / name).string());
+    }
+  }
+  std::sort(pairs.begin(), pairs.end());
+  return pairs;
+}
+
+// Simplifies the models of --batch with --jobs models in flight, sharing
+// the onnxruntime environment and the session cache of the process. The
+// warnings of each model are printed under its report line rather than
+// interleaved with the other models. Returns the number of failed models.
+size_t SimplifyBatch(const OnnxsimOption& option) {
+  using Clock = std::chrono::steady_clock;
+  const auto pairs = GetBatch(option);
+  const auto start = Clock::now();
+  std::mutex mutex;
+  size_t num_failed = 0;
+  {
+    ThreadPool pool(option.Get<size_t>("jobs"));
+    for (const auto& [input, output] : pairs) {
+      pool.Submit([&, input = input, output = output]() {
+        const auto model_start = Clock::now();
+        std::vector<std::string> warnings;
+        std::string error;
+        try {
+          SimplifyFile(option, input, output,
+                       [&warnings](const std::string& x) {
+                         warnings.push_back(x);
+                       });
+        } catch (const std::exception& e) {
+          error = e.what();
+        }
+        const std::chrono::duration<double> seconds =
+            Clock::now() - model_start;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << std::fixed << std::setprecision(3);
+        if (error.empty()) {
+          std::cout << input << " -> " << output << ": " << seconds.count()
+                    << "s" << std::endl;
+        } else {
+          num_failed++;
+          std::cout << input << ": failed after " << seconds.count()
+                    << "s: " << error << std::endl;
+        }
+        for (const auto& x : warnings) {
+          std::cout << "  WARNING: " << x << std::endl;
+        }
+      });
+    }
+  }
+  const std::chrono::duration<double> seconds = Clock::now() - start;
+  std::cout << std::fixed << std::setprecision(3)
+            << pairs.size() - num_failed << " models simplified, "
+            << num_failed << " failed in " << seconds.count() << "s ("
+            << std::setprecision(2) << pairs.size() / seconds.count()
+            << " models/sec)" << std::endl;
+  return num_failed;
+}
+
+int main(int argc, char** argv) {
+  // force env initialization to register opset
+  InitEnv();
+  OnnxsimOption option(argc, argv);
+  bool print_folding_stats = option.Get<bool>("print-folding-stats");
+
+  int ret = 0;
+  if (option.Count("serve")) {
+    Serve(option.Get<std::string>("serve"), option.Get<size_t>("jobs"),
+          option.Get<size_t>("max-pending"),
+          option.Get<size_t>("serve-idle-timeout"));
+  } else if (option.Count("batch")) {
+    ret = SimplifyBatch(option) == 0 ? 0 : 1;
+  } else {
+    SimplifyFile(option, option.Get<std::string>("input-model"),
+                 option.Get<std::string>("output-model"));
+  }
 
-  std::ofstream ofs(output_model_filename,
-                    std::ios::out | std::ios::trunc | std::ios::binary);
-  if (!model.SerializeToOstream(&ofs)) {
-    throw std::invalid_argument("save model error");
+  if (print_folding_stats) {
+    // the counters add up all the models of the process
+    const bool many = option.Count("batch") || option.Count("serve");
+    const auto stats = GetFoldingStats();
+    std::cout << (many ? "total folded ops of all models: " : "folded ops: ")
+              << stats.native_folds << " native, " << stats.executor_folds
+              << " by the executor" << std::endl;
+    std::cout << (many ? "total session cache hits: " : "session cache hits: ")
+              << stats.session_cache_hits
+              << ", misses: " << stats.session_cache_misses << std::endl;
   }
-  return 0;
+  return ret;
 }
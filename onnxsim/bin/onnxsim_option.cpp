@@ -12,6 +12,17 @@ void OnnxsimOption::Parse(int argc, char** argv) {
   ("no-opt",              "No optimization",             cxxopts::value<bool>()->default_value("false"))
   ("no-sim",              "No simplification",           cxxopts::value<bool>()->default_value("false"))
   ("no-shape-inference",  "No shape inference",          cxxopts::value<bool>()->default_value("false"))
+  ("print-folding-stats", "Print constant folding statistics, the totals of all models in batch and serve mode",  cxxopts::value<bool>()->default_value("false"))
+  ("save-as-external-data", "Save the initializers of at least 1KB to <output-model>.data. Models larger than 2GB are always saved this way",  cxxopts::value<bool>()->default_value("false"))
+  ("max-external-data-file-size", "Split the external data into files of at most this many bytes, 0 means a single file",  cxxopts::value<size_t>()->default_value("0"))
+  ("external-data-alignment", "Align the offset of each tensor in the external data to this many bytes, e.g. 4096 for mmap",  cxxopts::value<size_t>()->default_value("1"))
+  ("order-external-data-by-first-use", "Write the external data in the order the nodes use it",  cxxopts::value<bool>()->default_value("false"))
+  ("batch",               "Simplify many models: a manifest file with an \"<input> <output>\" pair per line, or a glob of input models (with --output-dir)",  cxxopts::value<std::string>())
+  ("output-dir",          "Output directory of the models matched by the --batch glob",  cxxopts::value<std::string>())
+  ("j,jobs",              "Number of models simplified in parallel in batch and serve mode",  cxxopts::value<size_t>()->default_value("1"))
+  ("serve",               "Serve simplification requests on this Unix domain socket until SIGINT or SIGTERM (see onnxsim_server.h for the protocol). The clients can read and write any path the server user can access, so only give trusted users access to the socket",  cxxopts::value<std::string>())
+  ("max-pending",         "Number of accepted connections waiting for a worker in serve mode",  cxxopts::value<size_t>()->default_value("16"))
+  ("serve-idle-timeout",  "Seconds after which an idle connection is closed in serve mode, 0 means never",  cxxopts::value<size_t>()->default_value("30"))
   ;
   // clang-format on
 
@@ -27,7 +38,8 @@ void OnnxsimOption::Parse(int argc, char** argv) {
     std::cout << cxx_options.help() << std::endl;
     exit(0);
   }
-  if (!options_.count("input-model") || !options_.count("output-model")) {
+  if (!options_.count("batch") && !options_.count("serve") &&
+      (!options_.count("input-model") || !options_.count("output-model"))) {
     std::cout << cxx_options.help() << std::endl;
     exit(1);
   }
@@ -16,6 +16,8 @@ class OnnxsimOption {
     return value;
   }
 
+  size_t Count(const std::string& key) const { return options_.count(key); }
+
  private:
   cxxopts::ParseResult options_;
 };
\ No newline at end of file
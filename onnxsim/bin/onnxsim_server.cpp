@@ -0,0 +1,352 @@
+#include "onnxsim_server.h"
+
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "external_data.h"
+#include "onnxoptimizer/model_util.h"
+#include "onnxsim.h"
+#include "thread_pool.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+namespace {
+
+// frames larger than this are rejected: protobuf cannot parse a model of
+// 2GB or more anyway, and it protects from garbage sizes
+constexpr uint64_t kMaxFrameSize = INT_MAX;
+
+// written by the SIGINT and SIGTERM handler to stop the server
+int stop_pipe[2] = {-1, -1};
+
+void OnStopSignal(int) {
+  const char x = 0;
+  [[maybe_unused]] const auto n = write(stop_pipe[1], &x, 1);
+}
+
+bool ReadAll(int fd, char* data, size_t size) {
+  while (size > 0) {
+    const auto n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const auto n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// std::nullopt on EOF, on a broken frame or when the client is idle for
+// longer than the receive timeout of the socket
+std::optional<std::string> ReadFrame(int fd) {
+  uint8_t header[8];
+  if (!ReadAll(fd, reinterpret_cast<char*>(header), sizeof(header))) {
+    return std::nullopt;
+  }
+  uint64_t size = 0;
+  for (int i = 7; i >= 0; i--) {
+    size = (size << 8) | header[i];
+  }
+  if (size > kMaxFrameSize) {
+    throw std::invalid_argument("frame of " + std::to_string(size) +
+                                " bytes is too large");
+  }
+  std::string frame(size, '\0');
+  if (!ReadAll(fd, frame.data(), size)) {
+    return std::nullopt;
+  }
+  return frame;
+}
+
+bool WriteFrame(int fd, const std::string& frame) {
+  uint8_t header[8];
+  for (int i = 0; i < 8; i++) {
+    header[i] = static_cast<uint8_t>(uint64_t{frame.size()} >> (8 * i));
+  }
+  return WriteAll(fd, reinterpret_cast<const char*>(header),
+                  sizeof(header)) &&
+         WriteAll(fd, frame.data(), frame.size());
+}
+
+// Runs the request and returns the serialized model, or "" if it is written
+// to the output path. The paths go through the same loading and saving as
+// the command line, external data included.
+std::string Handle(const std::string& options, const std::string& model_bytes) {
+  std::string input, output;
+  bool no_opt = false, no_sim = false, no_shape_inference = false;
+  std::istringstream iss(options);
+  std::string line;
+  while (std::getline(iss, line)) {
+    const auto pos = line.find('=');
+    const auto key = line.substr(0, pos);
+    const auto value = pos == std::string::npos ? "" : line.substr(pos + 1);
+    if (key == "input") {
+      input = value;
+    } else if (key == "output") {
+      output = value;
+    } else if (key == "no-opt") {
+      no_opt = true;
+    } else if (key == "no-sim") {
+      no_sim = true;
+    } else if (key == "no-shape-inference") {
+      no_shape_inference = true;
+    } else if (!key.empty()) {
+      throw std::invalid_argument("unknown option " + key);
+    }
+  }
+
+  const auto skip_optimizers =
+      no_opt ? std::nullopt : std::make_optional<std::vector<std::string>>({});
+  // like the command line without --save-as-external-data
+  ExternalDataOptions save_options;
+  save_options.min_bytes = SIZE_MAX;
+  if (!input.empty() && !output.empty()) {
+    SimplifyPath(input, output, skip_optimizers, !no_sim, !no_shape_inference,
+                 SIZE_MAX, GetDefaultState(), save_options);
+    return "";
+  }
+  onnx::ModelProto model;
+  if (!input.empty()) {
+    onnx::optimization::loadModel(&model, input, true);
+  } else if (!model.ParseFromString(model_bytes)) {
+    throw std::invalid_argument("cannot parse the model");
+  }
+  model = Simplify(std::move(model), skip_optimizers, !no_sim,
+                   !no_shape_inference, SIZE_MAX);
+  if (output.empty()) {
+    if (model.ByteSizeLong() > INT_MAX) {
+      throw std::invalid_argument(
+          "the simplified model is 2GB or more, give an output path");
+    }
+    return model.SerializeAsString();
+  }
+  SaveModel(model, output, save_options);
+  return "";
+}
+
+// Serves the requests of a connection until it ends, the caller closes `fd`.
+void ServeConnection(int fd) {
+  try {
+    while (true) {
+      const auto options = ReadFrame(fd);
+      if (!options) {
+        break;
+      }
+      const auto model_bytes = ReadFrame(fd);
+      if (!model_bytes) {
+        break;
+      }
+      std::string status = "ok";
+      std::string result;
+      try {
+        result = Handle(*options, *model_bytes);
+      } catch (const std::exception& e) {
+        status = std::string("error: ") + e.what();
+      }
+      if (!WriteFrame(fd, status) || !WriteFrame(fd, result)) {
+        break;
+      }
+    }
+  } catch (const std::exception& e) {
+    // e.g. out of memory for a frame, only this connection is closed
+    std::cerr << "closing a connection: " << e.what() << std::endl;
+  }
+}
+
+// Removes the socket file left by a previous server. Anything else at
+// `path`, or the socket of a server still running, is left alone.
+void RemoveStaleSocket(const std::string& path, const sockaddr_un& addr) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    return;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    throw std::invalid_argument(path + " exists and is not a socket");
+  }
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  const bool live =
+      fd >= 0 &&
+      connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (live) {
+    throw std::invalid_argument("a server is already listening on " + path);
+  }
+  unlink(path.c_str());
+}
+
+}  // namespace
+
+void Serve(const std::string& socket_path, size_t num_workers,
+           size_t max_pending, size_t idle_timeout) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    throw std::invalid_argument("socket path too long: " + socket_path);
+  }
+  std::strcpy(addr.sun_path, socket_path.c_str());
+  RemoveStaleSocket(socket_path, addr);
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    throw std::runtime_error("cannot listen on " + socket_path + ": " +
+                             std::strerror(errno));
+  }
+  if (listen(listen_fd, SOMAXCONN) != 0 || pipe(stop_pipe) != 0) {
+    const auto error = std::string(std::strerror(errno));
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    throw std::runtime_error("cannot listen on " + socket_path + ": " +
+                             error);
+  }
+  // a client going away must not kill the server
+  std::signal(SIGPIPE, SIG_IGN);
+  struct sigaction action {};
+  action.sa_handler = OnStopSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  std::cout << "listening on " << socket_path << std::endl;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  // accepted connections not finished yet
+  std::unordered_set<int> connections;
+  bool stopped = false;
+  // declared last, so that its workers are joined before the state they
+  // use is destroyed
+  ThreadPool pool(num_workers);
+  const size_t max_connections = pool.size() + max_pending;
+  // the stop signal also ends the backpressure wait
+  std::thread stop_watcher([&]() {
+    pollfd fd = {stop_pipe[0], POLLIN, 0};
+    while (poll(&fd, 1, -1) < 0 && errno == EINTR) {
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+    cv.notify_all();
+  });
+  // waits for a free slot, then for a connection; std::nullopt once stopped
+  const auto Accept = [&]() -> std::optional<int> {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() {
+        return stopped || connections.size() < max_connections;
+      });
+      if (stopped) {
+        return std::nullopt;
+      }
+    }
+    pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+    while (poll(fds, 2, -1) < 0) {
+      if (errno != EINTR) {
+        throw std::runtime_error(std::string("poll failed: ") +
+                                 std::strerror(errno));
+      }
+    }
+    if (fds[1].revents != 0) {
+      return std::nullopt;
+    }
+    return accept(listen_fd, nullptr, nullptr);
+  };
+  // removes the socket and lets the connections end after their current
+  // request, the pool then waits for them
+  const auto Stop = [&]() {
+    OnStopSignal(0);
+    stop_watcher.join();
+    // a second signal kills the server right away
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const int fd : connections) {
+      shutdown(fd, SHUT_RD);
+    }
+  };
+
+  try {
+    while (const auto fd = Accept()) {
+      if (*fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        throw std::runtime_error(std::string("accept failed: ") +
+                                 std::strerror(errno));
+      }
+      if (idle_timeout > 0) {
+        timeval timeout{};
+        timeout.tv_sec = static_cast<time_t>(idle_timeout);
+        setsockopt(*fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        connections.insert(*fd);
+      }
+      pool.Submit([&, fd = *fd]() {
+        ServeConnection(fd);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          connections.erase(fd);
+        }
+        // only once it is untracked, accept may reuse the number right away
+        close(fd);
+        cv.notify_one();
+      });
+    }
+  } catch (...) {
+    Stop();
+    throw;
+  }
+  Stop();
+  std::cout << "stopped, finishing the running requests" << std::endl;
+}
+
+#else
+
+void Serve(const std::string& socket_path, size_t, size_t, size_t) {
+  throw std::runtime_error("--serve is not supported on Windows");
+}
+
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Serves simplification requests on the Unix domain socket `socket_path`
+// until SIGINT or SIGTERM, keeping the onnxruntime environment and the
+// session cache warm between requests. The socket file is removed on exit,
+// and a stale one is replaced at start, but never another kind of file or
+// the socket of a running server.
+//
+// The clients read and write the input and output paths with the
+// permissions of the server, i.e. they can read and write any file the
+// server user can, so the socket must only be reachable by trusted users.
+//
+// A connection carries any number of requests, one after another. Every
+// message is a sequence of frames, and a frame is its size as an 8-byte
+// little endian integer followed by that many bytes.
+// - request: an options frame, "key[=value]" lines among
+//     input=<path>, output=<path>, no-opt, no-sim, no-shape-inference
+//   then a model frame, which is empty if the model is read from `input`.
+// - response: a status frame, "ok" or "error: <message>", then a model
+//   frame, which is empty if the model is written to `output` (or on
+//   error).
+//
+// `num_workers` connections are served concurrently. At most `max_pending`
+// more are accepted and wait for a worker, the others wait in the listen
+// backlog of the socket until a worker is free. A connection that sends
+// nothing for `idle_timeout` seconds (0 means no limit) is closed to free
+// its worker.
+void Serve(const std::string& socket_path, size_t num_workers,
+           size_t max_pending, size_t idle_timeout);
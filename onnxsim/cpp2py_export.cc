@@ -16,12 +16,14 @@ struct PyModelExecutor : public ModelExecutor {
 
   std::vector<onnx::TensorProto> _Run(
       const onnx::ModelProto& model,
-      const std::vector<onnx::TensorProto>& inputs) const override {
+      const std::vector<const onnx::TensorProto*>& inputs) const override {
+    // constant folding may call the executor from its worker threads
+    py::gil_scoped_acquire acquire;
     std::vector<py::bytes> inputs_bytes;
     std::transform(inputs.begin(), inputs.end(),
                    std::back_inserter(inputs_bytes),
-                   [](const onnx::TensorProto& x) {
-                     return py::bytes(x.SerializeAsString());
+                   [](const onnx::TensorProto* x) {
+                     return py::bytes(x->SerializeAsString());
                    });
     std::string model_str = model.SerializeAsString();
     auto output_bytes = _PyRun(py::bytes(model_str), inputs_bytes);
@@ -69,10 +71,15 @@ PYBIND11_MODULE(onnxsim_cpp2py_export, m) {
           InitEnv();
           ONNX_NAMESPACE::ModelProto model;
           ParseProtoFromPyBytes(&model, model_proto_bytes);
-          auto const result = Simplify(model, skip_optimizers, constant_folding,
-                                       shape_inference, tensor_size_threshold);
           std::string out;
-          result.SerializeToString(&out);
+          {
+            // let the folding worker threads call the python executor
+            py::gil_scoped_release release;
+            auto const result =
+                Simplify(std::move(model), skip_optimizers, constant_folding,
+                         shape_inference, tensor_size_threshold);
+            result.SerializeToString(&out);
+          }
           return py::bytes(out);
         })
       .def("simplify_path",
@@ -82,6 +89,7 @@ PYBIND11_MODULE(onnxsim_cpp2py_export, m) {
               size_t tensor_size_threshold) -> bool {
              // force env initialization to register opset
              InitEnv();
+             py::gil_scoped_release release;
              SimplifyPath(in_path, out_path, skip_optimizers, constant_folding,
                           shape_inference, tensor_size_threshold);
              return true;
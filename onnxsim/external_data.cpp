@@ -0,0 +1,341 @@
+#include "external_data.h"
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+void SetExternalData(onnx::TensorProto& tensor, const std::string& location,
+                     size_t offset, size_t length) {
+  tensor.clear_raw_data();
+  tensor.clear_external_data();
+  tensor.set_data_location(onnx::TensorProto::EXTERNAL);
+  const std::pair<const char*, std::string> entries[] = {
+      {"location", location},
+      {"offset", std::to_string(offset)},
+      {"length", std::to_string(length)}};
+  for (const auto& [key, value] : entries) {
+    auto* entry = tensor.add_external_data();
+    entry->set_key(key);
+    entry->set_value(value);
+  }
+}
+
+std::string GetExternalDataEntry(const onnx::TensorProto& tensor,
+                                const std::string& key,
+                                const std::string& default_value) {
+  for (const auto& entry : tensor.external_data()) {
+    if (entry.key() == key) {
+      return entry.value();
+    }
+  }
+  return default_value;
+}
+
+std::string GetFileName(const std::string& path) {
+  const auto pos = path.find_last_of("\\/");
+  return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+std::string GetLocation(const onnx::TensorProto& tensor) {
+  auto location = GetExternalDataEntry(tensor, "location", "");
+  if (location.empty()) {
+    throw std::invalid_argument("no location for the external tensor " +
+                                tensor.name());
+  }
+  return location;
+}
+
+void AddUsedNames(const onnx::NodeProto& node,
+                  std::unordered_map<std::string, size_t>& first_use) {
+  for (const auto& x : node.input()) {
+    first_use.emplace(x, first_use.size());
+  }
+  for (const auto& attr : node.attribute()) {
+    if (attr.has_g()) {
+      for (const auto& x : attr.g().node()) {
+        AddUsedNames(x, first_use);
+      }
+    }
+    for (const auto& g : attr.graphs()) {
+      for (const auto& x : g.node()) {
+        AddUsedNames(x, first_use);
+      }
+    }
+  }
+}
+
+// Sorts the initializers by the position of their first consumer in the
+// (topologically sorted) nodes, the unused ones go last.
+void OrderByFirstUse(onnx::GraphProto& graph) {
+  std::unordered_map<std::string, size_t> first_use;
+  for (const auto& node : graph.node()) {
+    AddUsedNames(node, first_use);
+  }
+  const auto Position = [&first_use](const onnx::TensorProto& x) {
+    const auto it = first_use.find(x.name());
+    return it == first_use.end() ? first_use.size() : it->second;
+  };
+  auto* initializers = graph.mutable_initializer();
+  std::stable_sort(initializers->pointer_begin(), initializers->pointer_end(),
+                   [&Position](const auto* a, const auto* b) {
+                     return Position(*a) < Position(*b);
+                   });
+}
+
+}  // namespace
+
+ExternalDataStore::ExternalDataStore(std::string model_dir)
+    : model_dir_(std::move(model_dir)) {
+#ifdef _WIN32
+  throw std::runtime_error(
+      "memory-mapped external data is not supported on Windows");
+#endif
+}
+
+ExternalDataStore::~ExternalDataStore() {
+#ifndef _WIN32
+  for (auto& [_, file] : files_) {
+    if (file.size > 0) {
+      munmap(const_cast<char*>(file.data), file.size);
+    }
+    close(file.fd);
+  }
+#endif
+}
+
+const ExternalDataStore::File& ExternalDataStore::Open(
+    const std::string& location) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (const auto it = files_.find(location); it != files_.end()) {
+    return it->second;
+  }
+  // same restrictions as the onnx checker
+  if (location.empty() || location[0] == '/' ||
+      location.find("..") != std::string::npos) {
+    throw std::invalid_argument("invalid external data location " +
+                                location);
+  }
+  File file;
+#ifndef _WIN32
+  const auto path =
+      model_dir_.empty() ? location : model_dir_ + "/" + location;
+  file.fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (file.fd < 0 || fstat(file.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (file.fd >= 0) {
+      close(file.fd);
+    }
+    throw std::invalid_argument("cannot open external data " + path);
+  }
+  file.size = st.st_size;
+  if (file.size > 0) {
+    void* data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+    if (data == MAP_FAILED) {
+      close(file.fd);
+      throw std::runtime_error("cannot mmap external data " + path);
+    }
+    file.data = static_cast<const char*>(data);
+  }
+#endif
+  return files_.emplace(location, file).first->second;
+}
+
+ExternalDataStore::Location ExternalDataStore::Find(
+    const onnx::TensorProto& tensor) {
+  Location result;
+  result.file = &Open(GetLocation(tensor));
+  bool has_length = false;
+  for (const auto& entry : tensor.external_data()) {
+    if (entry.key() == "offset") {
+      result.offset = std::stoull(entry.value());
+    } else if (entry.key() == "length") {
+      result.length = std::stoull(entry.value());
+      has_length = true;
+    }
+  }
+  if (result.offset > result.file->size) {
+    throw std::invalid_argument("external data of " + tensor.name() +
+                                " is out of the file");
+  }
+  if (!has_length) {
+    result.length = result.file->size - result.offset;
+  }
+  if (result.length > result.file->size - result.offset) {
+    throw std::invalid_argument("external data of " + tensor.name() +
+                                " is out of the file");
+  }
+  return result;
+}
+
+void ExternalDataStore::Load(onnx::TensorProto& tensor) {
+  if (tensor.data_location() != onnx::TensorProto::EXTERNAL) {
+    return;
+  }
+  const auto data = Data(tensor);
+  tensor.set_raw_data(data.data(), data.size());
+  tensor.clear_external_data();
+  tensor.clear_data_location();
+}
+
+std::string_view ExternalDataStore::Data(const onnx::TensorProto& tensor) {
+  const auto location = Find(tensor);
+  return {location.file->data + location.offset, location.length};
+}
+
+bool ExternalDataStore::IsDataFile(const onnx::ModelProto& model,
+                                   const std::string& path) {
+#ifndef _WIN32
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+  for (const auto& tensor : model.graph().initializer()) {
+    if (tensor.data_location() == onnx::TensorProto::EXTERNAL) {
+      struct stat src;
+      if (fstat(Open(GetLocation(tensor)).fd, &src) == 0 &&
+          src.st_dev == st.st_dev && src.st_ino == st.st_ino) {
+        return true;
+      }
+    }
+  }
+#endif
+  return false;
+}
+
+size_t ExternalDataStore::Append(const onnx::TensorProto& tensor,
+                                 std::FILE* file) {
+  const auto location = Find(tensor);
+  size_t copied = 0;
+#ifdef __linux__
+  // copies in the kernel, or even shares the extents on reflink file
+  // systems
+  if (std::fflush(file) == 0) {
+    loff_t in_offset = location.offset;
+    loff_t out_offset = std::ftell(file);
+    while (copied < location.length) {
+      const auto n =
+          copy_file_range(location.file->fd, &in_offset, fileno(file),
+                          &out_offset, location.length - copied, 0);
+      if (n <= 0) {
+        break;
+      }
+      copied += n;
+    }
+    std::fseek(file, out_offset, SEEK_SET);
+  }
+#endif
+  const size_t rest = location.length - copied;
+  if (std::fwrite(location.file->data + location.offset + copied, 1, rest,
+                  file) != rest) {
+    throw std::runtime_error("cannot write the data of " + tensor.name());
+  }
+  return location.length;
+}
+
+void SaveModel(onnx::ModelProto& model, const std::string& path,
+               const ExternalDataOptions& options, ExternalDataStore* store) {
+  const auto base_name = GetFileName(path) + ".data";
+  const auto dir = path.substr(0, path.size() - GetFileName(path).size());
+  std::string data_name;
+  std::FILE* file = nullptr;
+  size_t offset = 0;
+  int num_files = 0;
+  const auto Close = [&]() {
+    if (file != nullptr && std::fclose(file) != 0) {
+      file = nullptr;
+      throw std::runtime_error("cannot write " + dir + data_name);
+    }
+    file = nullptr;
+  };
+  // starts a new data file if `length` more bytes do not fit in the current
+  // one, and pads the current one up to the alignment
+  const auto Reserve = [&](size_t length) {
+    const size_t alignment = std::max<size_t>(options.alignment, 1);
+    const size_t padding = (alignment - offset % alignment) % alignment;
+    if (file != nullptr &&
+        (options.max_file_bytes == 0 || offset == 0 ||
+         offset + padding + length <= options.max_file_bytes)) {
+      static const char kZeros[4096] = {};
+      for (size_t n = padding; n > 0;) {
+        const size_t size = std::min(n, sizeof(kZeros));
+        if (std::fwrite(kZeros, 1, size, file) != size) {
+          throw std::runtime_error("cannot write " + dir + data_name);
+        }
+        n -= size;
+      }
+      offset += padding;
+      return;
+    }
+    Close();
+    data_name = num_files == 0 ? base_name
+                               : base_name + "." + std::to_string(num_files);
+    num_files++;
+    // the data files must not be read while they are written
+    if (store != nullptr && store->IsDataFile(model, dir + data_name)) {
+      throw std::invalid_argument(dir + data_name +
+                                  " is also an input data file");
+    }
+    file = std::fopen((dir + data_name).c_str(), "wb");
+    if (file == nullptr) {
+      throw std::invalid_argument("cannot open " + dir + data_name);
+    }
+    offset = 0;
+  };
+
+  if (options.order_by_first_use) {
+    OrderByFirstUse(*model.mutable_graph());
+  }
+  // protobuf cannot serialize messages of 2GB or more
+  const size_t min_bytes = model.ByteSizeLong() > INT_MAX
+                               ? std::min<size_t>(options.min_bytes, 1024)
+                               : options.min_bytes;
+  try {
+    for (auto& tensor : *model.mutable_graph()->mutable_initializer()) {
+      size_t length = 0;
+      if (tensor.data_location() == onnx::TensorProto::EXTERNAL) {
+        if (store == nullptr) {
+          throw std::invalid_argument("the data of " + tensor.name() +
+                                      " is not loaded");
+        }
+        Reserve(std::stoull(GetExternalDataEntry(tensor, "length", "0")));
+        length = store->Append(tensor, file);
+      } else if (tensor.has_raw_data() &&
+                 tensor.raw_data().size() >= min_bytes) {
+        length = tensor.raw_data().size();
+        Reserve(length);
+        if (std::fwrite(tensor.raw_data().data(), 1, length, file) !=
+            length) {
+          throw std::runtime_error("cannot write " + dir + data_name);
+        }
+        // release the memory right away
+        std::string().swap(*tensor.mutable_raw_data());
+      } else {
+        continue;
+      }
+      SetExternalData(tensor, data_name, offset, length);
+      offset += length;
+    }
+    Close();
+  } catch (...) {
+    if (file != nullptr) {
+      std::fclose(file);
+    }
+    throw;
+  }
+
+  std::ofstream ofs(path, std::ios::out | std::ios::trunc | std::ios::binary);
+  if (!model.SerializeToOstream(&ofs)) {
+    throw std::invalid_argument("save model error");
+  }
+}
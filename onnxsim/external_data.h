@@ -0,0 +1,84 @@
+#pragma once
+
+#include <onnx/onnx_pb.h>
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Gives access to the external data of a model without reading it into
+// memory. The data files are memory-mapped when first used, so only the
+// pages of the tensors that are actually read (e.g. for constant folding)
+// are loaded, and the tensors that are still external when the model is
+// saved are copied between the files by the kernel.
+class ExternalDataStore {
+ public:
+  // `model_dir` is the directory the external data locations are relative
+  // to, i.e. the directory of the model file.
+  explicit ExternalDataStore(std::string model_dir);
+  ~ExternalDataStore();
+
+  ExternalDataStore(const ExternalDataStore&) = delete;
+  ExternalDataStore& operator=(const ExternalDataStore&) = delete;
+
+  // Moves the data of `tensor` into its raw_data if it is stored externally.
+  void Load(onnx::TensorProto& tensor);
+
+  // The data of the external `tensor`, valid as long as the store.
+  std::string_view Data(const onnx::TensorProto& tensor);
+
+  // Whether `path` is one of the files holding the data of the external
+  // initializers of `model`.
+  bool IsDataFile(const onnx::ModelProto& model, const std::string& path);
+
+  // Appends the data of the external `tensor` to `file`, returns its size.
+  size_t Append(const onnx::TensorProto& tensor, std::FILE* file);
+
+ private:
+  struct File {
+    int fd = -1;
+    const char* data = nullptr;
+    size_t size = 0;
+  };
+
+  struct Location {
+    const File* file = nullptr;
+    size_t offset = 0;
+    size_t length = 0;
+  };
+
+  Location Find(const onnx::TensorProto& tensor);
+
+  const File& Open(const std::string& location);
+
+  std::string model_dir_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, File> files_;
+};
+
+struct ExternalDataOptions {
+  // initializers with fewer bytes of raw_data stay in the model file, unless
+  // the model would reach 2GB, the limit of protobuf
+  size_t min_bytes = 1024;
+  // a new data file is started when the current one would grow beyond this
+  // size, 0 means a single file
+  size_t max_file_bytes = 0;
+  // the offset of each tensor in the data files is a multiple of this, e.g.
+  // 4096 lets the runtimes map the weights in place
+  size_t alignment = 1;
+  // writes the initializers in the order the nodes first use them, so that
+  // they can be read sequentially while the model runs
+  bool order_by_first_use = false;
+};
+
+// Saves `model` to `path` with the data of its large initializers in
+// "<path>.data" (then "<path>.data.1", ... if the files are limited in
+// size). The data is streamed to the files one initializer at a time and
+// released from `model` once written, so the memory peak is the model
+// itself and the model file only holds the graph. The initializers that
+// are still external are read from `store`.
+void SaveModel(onnx::ModelProto& model, const std::string& path,
+               const ExternalDataOptions& options,
+               ExternalDataStore* store = nullptr);
@@ -0,0 +1,1205 @@
+#include "native_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+
+#include "simd_kernels.h"
+
+namespace {
+
+using TensorProto = onnx::TensorProto;
+
+// Inputs with more elements are left to the executor, the kernels below are
+// written for the small tensors of shape computations.
+constexpr size_t kMaxElements = 1 << 16;
+
+bool IsFloatType(int32_t dtype) {
+  return dtype == TensorProto::FLOAT || dtype == TensorProto::DOUBLE;
+}
+
+bool IsIntType(int32_t dtype) {
+  switch (dtype) {
+    case TensorProto::INT64:
+    case TensorProto::INT32:
+    case TensorProto::INT16:
+    case TensorProto::INT8:
+    case TensorProto::UINT32:
+    case TensorProto::UINT16:
+    case TensorProto::UINT8:
+    case TensorProto::BOOL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool IsLittleEndian() {
+  const uint16_t x = 1;
+  return *reinterpret_cast<const uint8_t*>(&x) == 1;
+}
+
+size_t NumElements(const std::vector<int64_t>& dims) {
+  return std::accumulate(dims.begin(), dims.end(), size_t{1},
+                         std::multiplies<size_t>());
+}
+
+// A decoded tensor. Integer and bool elements are widened to int64_t and
+// floating point elements to double; they are narrowed back to `dtype` when
+// the tensor is written, which gives the wrap-around semantics of the
+// narrower integer types.
+struct Tensor {
+  int32_t dtype = TensorProto::UNDEFINED;
+  std::vector<int64_t> dims;
+  std::vector<int64_t> ints;
+  std::vector<double> floats;
+
+  bool IsFloat() const { return IsFloatType(dtype); }
+  size_t size() const { return IsFloat() ? floats.size() : ints.size(); }
+};
+
+template <typename T, typename U>
+bool ReadRawData(const std::string& raw, size_t n, std::vector<U>& out) {
+  if (raw.size() != n * sizeof(T)) {
+    return false;
+  }
+  out.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    T x;
+    std::memcpy(&x, raw.data() + i * sizeof(T), sizeof(T));
+    out[i] = static_cast<U>(x);
+  }
+  return true;
+}
+
+template <typename Field, typename U>
+bool ReadTypedData(const Field& field, size_t n, std::vector<U>& out) {
+  if (static_cast<size_t>(field.size()) != n) {
+    return false;
+  }
+  out.assign(field.begin(), field.end());
+  return true;
+}
+
+std::optional<Tensor> ReadTensor(const TensorProto* tp) {
+  if (tp == nullptr || tp->data_location() == TensorProto::EXTERNAL ||
+      !(IsFloatType(tp->data_type()) || IsIntType(tp->data_type()))) {
+    return std::nullopt;
+  }
+  Tensor t;
+  t.dtype = tp->data_type();
+  t.dims.assign(tp->dims().begin(), tp->dims().end());
+  const size_t n = NumElements(t.dims);
+  if (n > kMaxElements) {
+    return std::nullopt;
+  }
+  bool ok = false;
+  if (tp->has_raw_data()) {
+    // raw_data is always little endian
+    if (!IsLittleEndian()) {
+      return std::nullopt;
+    }
+    const auto& raw = tp->raw_data();
+    switch (t.dtype) {
+      case TensorProto::FLOAT:
+        ok = ReadRawData<float>(raw, n, t.floats);
+        break;
+      case TensorProto::DOUBLE:
+        ok = ReadRawData<double>(raw, n, t.floats);
+        break;
+      case TensorProto::INT64:
+        ok = ReadRawData<int64_t>(raw, n, t.ints);
+        break;
+      case TensorProto::INT32:
+        ok = ReadRawData<int32_t>(raw, n, t.ints);
+        break;
+      case TensorProto::INT16:
+        ok = ReadRawData<int16_t>(raw, n, t.ints);
+        break;
+      case TensorProto::INT8:
+        ok = ReadRawData<int8_t>(raw, n, t.ints);
+        break;
+      case TensorProto::UINT32:
+        ok = ReadRawData<uint32_t>(raw, n, t.ints);
+        break;
+      case TensorProto::UINT16:
+        ok = ReadRawData<uint16_t>(raw, n, t.ints);
+        break;
+      case TensorProto::UINT8:
+      case TensorProto::BOOL:
+        ok = ReadRawData<uint8_t>(raw, n, t.ints);
+        break;
+    }
+  } else {
+    switch (t.dtype) {
+      case TensorProto::FLOAT:
+        ok = ReadTypedData(tp->float_data(), n, t.floats);
+        break;
+      case TensorProto::DOUBLE:
+        ok = ReadTypedData(tp->double_data(), n, t.floats);
+        break;
+      case TensorProto::INT64:
+        ok = ReadTypedData(tp->int64_data(), n, t.ints);
+        break;
+      case TensorProto::UINT32:
+        ok = ReadTypedData(tp->uint64_data(), n, t.ints);
+        break;
+      default:
+        ok = ReadTypedData(tp->int32_data(), n, t.ints);
+        break;
+    }
+  }
+  if (!ok) {
+    return std::nullopt;
+  }
+  return t;
+}
+
+template <typename T, typename U>
+std::string WriteRawData(const std::vector<U>& data) {
+  std::string raw(data.size() * sizeof(T), '\0');
+  for (size_t i = 0; i < data.size(); i++) {
+    const T x = static_cast<T>(data[i]);
+    std::memcpy(&raw[i * sizeof(T)], &x, sizeof(T));
+  }
+  return raw;
+}
+
+TensorProto WriteTensor(const Tensor& t) {
+  TensorProto tp;
+  tp.set_data_type(t.dtype);
+  for (const auto dim : t.dims) {
+    tp.add_dims(dim);
+  }
+  switch (t.dtype) {
+    case TensorProto::FLOAT:
+      tp.set_raw_data(WriteRawData<float>(t.floats));
+      break;
+    case TensorProto::DOUBLE:
+      tp.set_raw_data(WriteRawData<double>(t.floats));
+      break;
+    case TensorProto::INT64:
+      tp.set_raw_data(WriteRawData<int64_t>(t.ints));
+      break;
+    case TensorProto::INT32:
+      tp.set_raw_data(WriteRawData<int32_t>(t.ints));
+      break;
+    case TensorProto::INT16:
+      tp.set_raw_data(WriteRawData<int16_t>(t.ints));
+      break;
+    case TensorProto::INT8:
+      tp.set_raw_data(WriteRawData<int8_t>(t.ints));
+      break;
+    case TensorProto::UINT32:
+      tp.set_raw_data(WriteRawData<uint32_t>(t.ints));
+      break;
+    case TensorProto::UINT16:
+      tp.set_raw_data(WriteRawData<uint16_t>(t.ints));
+      break;
+    case TensorProto::UINT8:
+      tp.set_raw_data(WriteRawData<uint8_t>(t.ints));
+      break;
+    case TensorProto::BOOL: {
+      std::vector<uint8_t> data(t.ints.size());
+      for (size_t i = 0; i < data.size(); i++) {
+        data[i] = t.ints[i] != 0;
+      }
+      tp.set_raw_data(WriteRawData<uint8_t>(data));
+      break;
+    }
+  }
+  return tp;
+}
+
+const onnx::AttributeProto* FindAttribute(const onnx::NodeProto& node,
+                                          const std::string& name) {
+  for (const auto& attr : node.attribute()) {
+    if (attr.name() == name) {
+      return &attr;
+    }
+  }
+  return nullptr;
+}
+
+int64_t GetIntAttribute(const onnx::NodeProto& node, const std::string& name,
+                        int64_t default_value) {
+  const auto* attr = FindAttribute(node, name);
+  return attr ? attr->i() : default_value;
+}
+
+// The int64 values of the attribute `name` if the node has it (the form of
+// the older opsets), otherwise of the input `index` (the newer opsets).
+std::optional<std::vector<int64_t>> GetIntsFromAttributeOrInput(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs, const std::string& name,
+    size_t index) {
+  if (const auto* attr = FindAttribute(node, name); attr != nullptr) {
+    return std::vector<int64_t>(attr->ints().begin(), attr->ints().end());
+  }
+  if (index >= inputs.size() || inputs[index] == nullptr) {
+    return std::vector<int64_t>();
+  }
+  auto t = ReadTensor(inputs[index]);
+  if (!t || t->IsFloat()) {
+    return std::nullopt;
+  }
+  return t->ints;
+}
+
+bool NormalizeAxis(int64_t& axis, int64_t rank) {
+  if (axis < -rank || axis >= rank) {
+    return false;
+  }
+  if (axis < 0) {
+    axis += rank;
+  }
+  return true;
+}
+
+// A tensor of `dims` shape made of the elements of `from` at `indices`.
+Tensor Take(const Tensor& from, std::vector<int64_t> dims,
+            const std::vector<size_t>& indices) {
+  Tensor t;
+  t.dtype = from.dtype;
+  t.dims = std::move(dims);
+  if (from.IsFloat()) {
+    t.floats.reserve(indices.size());
+    for (const auto i : indices) {
+      t.floats.push_back(from.floats[i]);
+    }
+  } else {
+    t.ints.reserve(indices.size());
+    for (const auto i : indices) {
+      t.ints.push_back(from.ints[i]);
+    }
+  }
+  return t;
+}
+
+std::optional<std::vector<int64_t>> BroadcastDims(
+    const std::vector<const Tensor*>& tensors) {
+  size_t rank = 0;
+  for (const auto* t : tensors) {
+    rank = std::max(rank, t->dims.size());
+  }
+  std::vector<int64_t> dims(rank, 1);
+  for (const auto* t : tensors) {
+    const size_t offset = rank - t->dims.size();
+    for (size_t i = 0; i < t->dims.size(); i++) {
+      const int64_t dim = t->dims[i];
+      if (dim == dims[offset + i] || dim == 1) {
+        continue;
+      }
+      if (dims[offset + i] != 1) {
+        return std::nullopt;
+      }
+      dims[offset + i] = dim;
+    }
+  }
+  return dims;
+}
+
+// For each element of a tensor with `out_dims` shape, the index of the
+// element of a tensor with `dims` shape it is broadcast from.
+std::vector<size_t> BroadcastIndices(const std::vector<int64_t>& dims,
+                                     const std::vector<int64_t>& out_dims) {
+  const size_t rank = out_dims.size();
+  const size_t offset = rank - dims.size();
+  std::vector<size_t> strides(rank, 0);
+  size_t stride = 1;
+  for (size_t i = dims.size(); i-- > 0;) {
+    strides[offset + i] = dims[i] == 1 ? 0 : stride;
+    stride *= dims[i];
+  }
+  std::vector<size_t> indices(NumElements(out_dims));
+  std::vector<int64_t> counter(rank, 0);
+  size_t index = 0;
+  for (auto& x : indices) {
+    x = index;
+    // increment the multi-dimensional counter
+    for (size_t i = rank; i-- > 0;) {
+      index += strides[i];
+      if (++counter[i] < out_dims[i]) {
+        break;
+      }
+      index -= strides[i] * counter[i];
+      counter[i] = 0;
+    }
+  }
+  return indices;
+}
+
+using Kernel = std::function<std::optional<std::vector<Tensor>>(
+    const onnx::NodeProto&, const std::vector<const TensorProto*>&)>;
+
+// Wraps the integer arithmetic so that overflow wraps around like in the
+// executor instead of being undefined behavior.
+int64_t WrapAdd(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) +
+                              static_cast<uint64_t>(b));
+}
+
+int64_t WrapSub(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) -
+                              static_cast<uint64_t>(b));
+}
+
+int64_t WrapMul(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) *
+                              static_cast<uint64_t>(b));
+}
+
+template <typename IntOp, typename FloatOp>
+Kernel Elementwise(IntOp int_op, FloatOp float_op, bool to_bool) {
+  return [int_op, float_op, to_bool](
+             const onnx::NodeProto& node,
+             const std::vector<const TensorProto*>& inputs)
+             -> std::optional<std::vector<Tensor>> {
+    if (inputs.size() != 2) {
+      return std::nullopt;
+    }
+    const auto a = ReadTensor(inputs[0]);
+    const auto b = ReadTensor(inputs[1]);
+    if (!a || !b || a->dtype != b->dtype) {
+      return std::nullopt;
+    }
+    const auto dims = BroadcastDims({&*a, &*b});
+    if (!dims) {
+      return std::nullopt;
+    }
+    const auto a_indices = BroadcastIndices(a->dims, *dims);
+    const auto b_indices = BroadcastIndices(b->dims, *dims);
+    Tensor t;
+    t.dtype = to_bool ? TensorProto::BOOL : a->dtype;
+    t.dims = *dims;
+    for (size_t i = 0; i < a_indices.size(); i++) {
+      if (a->IsFloat()) {
+        const double x =
+            float_op(a->floats[a_indices[i]], b->floats[b_indices[i]]);
+        if (to_bool) {
+          t.ints.push_back(x != 0);
+        } else {
+          t.floats.push_back(x);
+        }
+      } else {
+        const auto x = int_op(a->ints[a_indices[i]], b->ints[b_indices[i]]);
+        if (!x) {
+          return std::nullopt;
+        }
+        t.ints.push_back(*x);
+      }
+    }
+    return std::vector<Tensor>{std::move(t)};
+  };
+}
+
+template <typename F>
+auto IntOp(F f) {
+  return [f](int64_t a, int64_t b) -> std::optional<int64_t> {
+    return f(a, b);
+  };
+}
+
+std::optional<std::vector<Tensor>> Where(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  if (inputs.size() != 3) {
+    return std::nullopt;
+  }
+  const auto cond = ReadTensor(inputs[0]);
+  const auto x = ReadTensor(inputs[1]);
+  const auto y = ReadTensor(inputs[2]);
+  if (!cond || !x || !y || cond->dtype != TensorProto::BOOL ||
+      x->dtype != y->dtype) {
+    return std::nullopt;
+  }
+  const auto dims = BroadcastDims({&*cond, &*x, &*y});
+  if (!dims) {
+    return std::nullopt;
+  }
+  const auto cond_indices = BroadcastIndices(cond->dims, *dims);
+  const auto x_indices = BroadcastIndices(x->dims, *dims);
+  const auto y_indices = BroadcastIndices(y->dims, *dims);
+  Tensor t;
+  t.dtype = x->dtype;
+  t.dims = *dims;
+  for (size_t i = 0; i < cond_indices.size(); i++) {
+    const bool c = cond->ints[cond_indices[i]] != 0;
+    if (t.IsFloat()) {
+      t.floats.push_back(c ? x->floats[x_indices[i]]
+                           : y->floats[y_indices[i]]);
+    } else {
+      t.ints.push_back(c ? x->ints[x_indices[i]] : y->ints[y_indices[i]]);
+    }
+  }
+  return std::vector<Tensor>{std::move(t)};
+}
+
+std::optional<std::vector<Tensor>> Cast(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  if (inputs.size() != 1) {
+    return std::nullopt;
+  }
+  auto t = ReadTensor(inputs[0]);
+  const int32_t to = GetIntAttribute(node, "to", TensorProto::UNDEFINED);
+  if (!t || !(IsFloatType(to) || IsIntType(to))) {
+    return std::nullopt;
+  }
+  if (t->IsFloat() && !IsFloatType(to)) {
+    for (const auto x : t->floats) {
+      if (to == TensorProto::BOOL) {
+        t->ints.push_back(x != 0);
+        continue;
+      }
+      // out of range casts are undefined, leave them to the executor
+      if (!std::isfinite(x) || std::abs(x) >= 9.2e18) {
+        return std::nullopt;
+      }
+      t->ints.push_back(static_cast<int64_t>(x));
+    }
+    t->floats.clear();
+  } else if (!t->IsFloat() && IsFloatType(to)) {
+    for (const auto x : t->ints) {
+      // larger integers would be rounded twice on their way to float
+      if (std::abs(x) > (int64_t{1} << 53)) {
+        return std::nullopt;
+      }
+      t->floats.push_back(static_cast<double>(x));
+    }
+    t->ints.clear();
+  } else if (to == TensorProto::BOOL) {
+    for (auto& x : t->ints) {
+      x = x != 0;
+    }
+  } else if (to == TensorProto::FLOAT) {
+    for (auto& x : t->floats) {
+      x = static_cast<float>(x);
+    }
+  }
+  t->dtype = to;
+  return std::vector<Tensor>{std::move(*t)};
+}
+
+std::optional<std::vector<Tensor>> Gather(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  if (inputs.size() != 2) {
+    return std::nullopt;
+  }
+  const auto data = ReadTensor(inputs[0]);
+  const auto indices = ReadTensor(inputs[1]);
+  if (!data || !indices || indices->IsFloat()) {
+    return std::nullopt;
+  }
+  const int64_t rank = data->dims.size();
+  int64_t axis = GetIntAttribute(node, "axis", 0);
+  if (!NormalizeAxis(axis, rank)) {
+    return std::nullopt;
+  }
+  const int64_t dim = data->dims[axis];
+  const size_t outer =
+      NumElements({data->dims.begin(), data->dims.begin() + axis});
+  const size_t inner =
+      NumElements({data->dims.begin() + axis + 1, data->dims.end()});
+  std::vector<int64_t> dims(data->dims.begin(), data->dims.begin() + axis);
+  dims.insert(dims.end(), indices->dims.begin(), indices->dims.end());
+  dims.insert(dims.end(), data->dims.begin() + axis + 1, data->dims.end());
+  std::vector<size_t> src;
+  src.reserve(NumElements(dims));
+  for (size_t i = 0; i < outer; i++) {
+    for (auto index : indices->ints) {
+      if (index < -dim || index >= dim) {
+        return std::nullopt;
+      }
+      if (index < 0) {
+        index += dim;
+      }
+      for (size_t j = 0; j < inner; j++) {
+        src.push_back((i * dim + index) * inner + j);
+      }
+    }
+  }
+  return std::vector<Tensor>{Take(*data, std::move(dims), src)};
+}
+
+std::optional<std::vector<Tensor>> Concat(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  std::vector<Tensor> tensors;
+  for (const auto* x : inputs) {
+    auto t = ReadTensor(x);
+    if (!t || (!tensors.empty() &&
+               (t->dtype != tensors[0].dtype ||
+                t->dims.size() != tensors[0].dims.size()))) {
+      return std::nullopt;
+    }
+    tensors.push_back(std::move(*t));
+  }
+  if (tensors.empty()) {
+    return std::nullopt;
+  }
+  const int64_t rank = tensors[0].dims.size();
+  int64_t axis = GetIntAttribute(node, "axis", 0);
+  if (!NormalizeAxis(axis, rank)) {
+    return std::nullopt;
+  }
+  auto dims = tensors[0].dims;
+  dims[axis] = 0;
+  for (const auto& t : tensors) {
+    for (int64_t i = 0; i < rank; i++) {
+      if (i != axis && t.dims[i] != dims[i]) {
+        return std::nullopt;
+      }
+    }
+    dims[axis] += t.dims[axis];
+  }
+  const size_t outer = NumElements({dims.begin(), dims.begin() + axis});
+  Tensor out;
+  out.dtype = tensors[0].dtype;
+  for (size_t i = 0; i < outer; i++) {
+    for (const auto& t : tensors) {
+      const size_t block = t.size() / std::max<size_t>(outer, 1);
+      if (t.IsFloat()) {
+        out.floats.insert(out.floats.end(), t.floats.begin() + i * block,
+                          t.floats.begin() + (i + 1) * block);
+      } else {
+        out.ints.insert(out.ints.end(), t.ints.begin() + i * block,
+                        t.ints.begin() + (i + 1) * block);
+      }
+    }
+  }
+  out.dims = std::move(dims);
+  return std::vector<Tensor>{std::move(out)};
+}
+
+std::optional<std::vector<Tensor>> Unsqueeze(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  auto t = inputs.empty() ? std::nullopt : ReadTensor(inputs[0]);
+  auto axes = GetIntsFromAttributeOrInput(node, inputs, "axes", 1);
+  if (!t || !axes || axes->empty()) {
+    return std::nullopt;
+  }
+  const int64_t rank = t->dims.size() + axes->size();
+  std::vector<char> is_new(rank, false);
+  for (auto axis : *axes) {
+    if (!NormalizeAxis(axis, rank) || is_new[axis]) {
+      return std::nullopt;
+    }
+    is_new[axis] = true;
+  }
+  std::vector<int64_t> dims;
+  auto it = t->dims.begin();
+  for (int64_t i = 0; i < rank; i++) {
+    dims.push_back(is_new[i] ? 1 : *it++);
+  }
+  t->dims = std::move(dims);
+  return std::vector<Tensor>{std::move(*t)};
+}
+
+std::optional<std::vector<Tensor>> Squeeze(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  auto t = inputs.empty() ? std::nullopt : ReadTensor(inputs[0]);
+  auto axes = GetIntsFromAttributeOrInput(node, inputs, "axes", 1);
+  if (!t || !axes) {
+    return std::nullopt;
+  }
+  const int64_t rank = t->dims.size();
+  std::vector<char> removed(rank, false);
+  if (axes->empty()) {
+    // squeeze all the dims of size 1
+    for (int64_t i = 0; i < rank; i++) {
+      removed[i] = t->dims[i] == 1;
+    }
+  }
+  for (auto axis : *axes) {
+    if (!NormalizeAxis(axis, rank) || t->dims[axis] != 1) {
+      return std::nullopt;
+    }
+    removed[axis] = true;
+  }
+  std::vector<int64_t> dims;
+  for (int64_t i = 0; i < rank; i++) {
+    if (!removed[i]) {
+      dims.push_back(t->dims[i]);
+    }
+  }
+  t->dims = std::move(dims);
+  return std::vector<Tensor>{std::move(*t)};
+}
+
+std::optional<std::vector<Tensor>> Reshape(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  if (inputs.size() != 2) {
+    return std::nullopt;
+  }
+  auto t = ReadTensor(inputs[0]);
+  const auto shape = ReadTensor(inputs[1]);
+  if (!t || !shape || shape->dtype != TensorProto::INT64) {
+    return std::nullopt;
+  }
+  const bool allow_zero = GetIntAttribute(node, "allowzero", 0) != 0;
+  std::vector<int64_t> dims = shape->ints;
+  int64_t inferred = -1;
+  size_t known = 1;
+  for (size_t i = 0; i < dims.size(); i++) {
+    if (dims[i] == 0 && !allow_zero) {
+      if (i >= t->dims.size()) {
+        return std::nullopt;
+      }
+      dims[i] = t->dims[i];
+    }
+    if (dims[i] == -1) {
+      if (inferred != -1) {
+        return std::nullopt;
+      }
+      inferred = i;
+    } else if (dims[i] < 0) {
+      return std::nullopt;
+    } else {
+      known *= dims[i];
+    }
+  }
+  const size_t size = t->size();
+  if (inferred != -1) {
+    if (known == 0 || size % known != 0) {
+      return std::nullopt;
+    }
+    dims[inferred] = size / known;
+  } else if (known != size) {
+    return std::nullopt;
+  }
+  t->dims = std::move(dims);
+  return std::vector<Tensor>{std::move(*t)};
+}
+
+std::optional<std::vector<Tensor>> Slice(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  const auto data = inputs.empty() ? std::nullopt : ReadTensor(inputs[0]);
+  const auto starts = GetIntsFromAttributeOrInput(node, inputs, "starts", 1);
+  const auto ends = GetIntsFromAttributeOrInput(node, inputs, "ends", 2);
+  auto axes = GetIntsFromAttributeOrInput(node, inputs, "axes", 3);
+  auto steps = GetIntsFromAttributeOrInput(node, inputs, "steps", 4);
+  if (!data || !starts || !ends || !axes || !steps ||
+      starts->size() != ends->size()) {
+    return std::nullopt;
+  }
+  const int64_t rank = data->dims.size();
+  if (axes->empty()) {
+    axes->resize(starts->size());
+    std::iota(axes->begin(), axes->end(), 0);
+  }
+  if (steps->empty()) {
+    steps->assign(starts->size(), 1);
+  }
+  if (axes->size() != starts->size() || steps->size() != starts->size()) {
+    return std::nullopt;
+  }
+  std::vector<int64_t> dim_starts(rank, 0);
+  std::vector<int64_t> dim_steps(rank, 1);
+  std::vector<int64_t> dims = data->dims;
+  std::vector<char> sliced(rank, false);
+  for (size_t i = 0; i < axes->size(); i++) {
+    int64_t axis = (*axes)[i];
+    const int64_t step = (*steps)[i];
+    if (!NormalizeAxis(axis, rank) || sliced[axis] || step == 0 ||
+        step == std::numeric_limits<int64_t>::min()) {
+      return std::nullopt;
+    }
+    sliced[axis] = true;
+    const int64_t dim = data->dims[axis];
+    int64_t start = (*starts)[i];
+    int64_t end = (*ends)[i];
+    if (start < 0) {
+      start += dim;
+    }
+    if (end < 0) {
+      end += dim;
+    }
+    int64_t count = 0;
+    if (step > 0) {
+      start = std::clamp<int64_t>(start, 0, dim);
+      end = std::clamp<int64_t>(end, 0, dim);
+      count = end > start ? (end - start - 1) / step + 1 : 0;
+    } else if (dim > 0) {
+      start = std::clamp<int64_t>(start, 0, dim - 1);
+      end = std::clamp<int64_t>(end, -1, dim - 1);
+      count = start > end ? (start - end - 1) / -step + 1 : 0;
+    }
+    dim_starts[axis] = start;
+    dim_steps[axis] = step;
+    dims[axis] = count;
+  }
+  std::vector<size_t> strides(rank, 1);
+  for (int64_t i = rank - 1; i > 0; i--) {
+    strides[i - 1] = strides[i] * data->dims[i];
+  }
+  std::vector<size_t> src(NumElements(dims));
+  std::vector<int64_t> counter(rank, 0);
+  for (auto& x : src) {
+    x = 0;
+    for (int64_t i = 0; i < rank; i++) {
+      x += (dim_starts[i] + counter[i] * dim_steps[i]) * strides[i];
+    }
+    for (int64_t i = rank; i-- > 0;) {
+      if (++counter[i] < dims[i]) {
+        break;
+      }
+      counter[i] = 0;
+    }
+  }
+  return std::vector<Tensor>{Take(*data, std::move(dims), src)};
+}
+
+// Computes the elements like the executor does, in the precision of T and
+// by repeatedly adding `delta`.
+template <typename T, typename U>
+bool ComputeRange(T start, T limit, T delta, std::vector<U>& out) {
+  if (delta == 0) {
+    return false;
+  }
+  const double n = std::ceil(static_cast<double>(limit - start) / delta);
+  if (!(n < kMaxElements)) {
+    return false;
+  }
+  T x = start;
+  for (int64_t i = 0; i < n; i++) {
+    out.push_back(x);
+    x += delta;
+  }
+  return true;
+}
+
+std::optional<std::vector<Tensor>> Range(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  if (inputs.size() != 3) {
+    return std::nullopt;
+  }
+  const auto start = ReadTensor(inputs[0]);
+  const auto limit = ReadTensor(inputs[1]);
+  const auto delta = ReadTensor(inputs[2]);
+  if (!start || !limit || !delta || start->size() != 1 ||
+      limit->size() != 1 || delta->size() != 1 ||
+      start->dtype != limit->dtype || start->dtype != delta->dtype) {
+    return std::nullopt;
+  }
+  Tensor t;
+  t.dtype = start->dtype;
+  bool ok = false;
+  switch (t.dtype) {
+    case TensorProto::FLOAT:
+      ok = ComputeRange<float>(start->floats[0], limit->floats[0],
+                               delta->floats[0], t.floats);
+      break;
+    case TensorProto::DOUBLE:
+      ok = ComputeRange<double>(start->floats[0], limit->floats[0],
+                                delta->floats[0], t.floats);
+      break;
+    case TensorProto::INT64:
+    case TensorProto::INT32:
+    case TensorProto::INT16:
+      ok = ComputeRange<int64_t>(start->ints[0], limit->ints[0],
+                                 delta->ints[0], t.ints);
+      break;
+  }
+  if (!ok) {
+    return std::nullopt;
+  }
+  t.dims = {static_cast<int64_t>(t.size())};
+  return std::vector<Tensor>{std::move(t)};
+}
+
+const std::unordered_map<std::string, Kernel>& GetKernels() {
+  static const std::unordered_map<std::string, Kernel> kernels{
+      {"Add", Elementwise(IntOp(WrapAdd), std::plus<double>(), false)},
+      {"Sub", Elementwise(IntOp(WrapSub), std::minus<double>(), false)},
+      {"Mul", Elementwise(IntOp(WrapMul), std::multiplies<double>(), false)},
+      {"Div",
+       Elementwise(
+           [](int64_t a, int64_t b) -> std::optional<int64_t> {
+             if (b == 0 ||
+                 (a == std::numeric_limits<int64_t>::min() && b == -1)) {
+               return std::nullopt;
+             }
+             return a / b;
+           },
+           std::divides<double>(), false)},
+      {"Equal", Elementwise(IntOp(std::equal_to<int64_t>()),
+                            std::equal_to<double>(), true)},
+      {"Less",
+       Elementwise(IntOp(std::less<int64_t>()), std::less<double>(), true)},
+      {"Greater", Elementwise(IntOp(std::greater<int64_t>()),
+                              std::greater<double>(), true)},
+      {"Where", Where},
+      {"Cast", Cast},
+      {"Gather", Gather},
+      {"Concat", Concat},
+      {"Unsqueeze", Unsqueeze},
+      {"Squeeze", Squeeze},
+      {"Reshape", Reshape},
+      {"Slice", Slice},
+      {"Range", Range},
+  };
+  return kernels;
+}
+
+// The kernels below work on the data buffers of tensors of any size, without
+// decoding the elements. They read raw_data, or the typed field when it has
+// the same width as the dtype.
+
+size_t ElementSize(int32_t dtype) {
+  switch (dtype) {
+    case TensorProto::BOOL:
+    case TensorProto::INT8:
+    case TensorProto::UINT8:
+      return 1;
+    case TensorProto::FLOAT16:
+    case TensorProto::BFLOAT16:
+    case TensorProto::INT16:
+    case TensorProto::UINT16:
+      return 2;
+    case TensorProto::FLOAT:
+    case TensorProto::INT32:
+    case TensorProto::UINT32:
+      return 4;
+    case TensorProto::DOUBLE:
+    case TensorProto::INT64:
+    case TensorProto::UINT64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+// A pointer to the `NumElements(dims)` elements of `tp`, or nullptr if they
+// are not stored in one buffer of the dtype's width.
+const void* GetBuffer(const TensorProto* tp) {
+  if (tp == nullptr || tp->data_location() == TensorProto::EXTERNAL ||
+      !IsLittleEndian()) {
+    return nullptr;
+  }
+  const size_t elem_size = ElementSize(tp->data_type());
+  const size_t n = NumElements({tp->dims().begin(), tp->dims().end()});
+  const void* data = nullptr;
+  size_t size = 0;
+  if (tp->has_raw_data()) {
+    data = tp->raw_data().data();
+    size = tp->raw_data().size();
+  } else if (tp->data_type() == TensorProto::FLOAT) {
+    data = tp->float_data().data();
+    size = tp->float_data_size() * sizeof(float);
+  } else if (tp->data_type() == TensorProto::DOUBLE) {
+    data = tp->double_data().data();
+    size = tp->double_data_size() * sizeof(double);
+  } else if (tp->data_type() == TensorProto::INT64) {
+    data = tp->int64_data().data();
+    size = tp->int64_data_size() * sizeof(int64_t);
+  } else if (tp->data_type() == TensorProto::UINT64) {
+    data = tp->uint64_data().data();
+    size = tp->uint64_data_size() * sizeof(uint64_t);
+  }
+  if (elem_size == 0 || size != n * elem_size ||
+      reinterpret_cast<uintptr_t>(data) % elem_size != 0) {
+    return nullptr;
+  }
+  return data;
+}
+
+// Returns the raw_data buffer of a new `n` element tensor.
+template <typename T>
+T* AllocateBuffer(TensorProto& tp, size_t n) {
+  auto* raw = tp.mutable_raw_data();
+  raw->resize(n * sizeof(T));
+  return reinterpret_cast<T*>(&(*raw)[0]);
+}
+
+TensorProto NewTensor(int32_t dtype, const std::vector<int64_t>& dims) {
+  TensorProto tp;
+  tp.set_data_type(dtype);
+  for (const auto dim : dims) {
+    tp.add_dims(dim);
+  }
+  return tp;
+}
+
+// Splits the broadcasting op into runs of output elements in which each
+// input is either contiguous or a single broadcast element, e.g. a run per
+// channel for a per-channel scale.
+std::optional<TensorProto> BroadcastBinaryF32(BinaryOp op,
+                                              const TensorProto& a_tp,
+                                              const TensorProto& b_tp) {
+  const auto* a = static_cast<const float*>(GetBuffer(&a_tp));
+  const auto* b = static_cast<const float*>(GetBuffer(&b_tp));
+  if (a == nullptr || b == nullptr) {
+    return std::nullopt;
+  }
+  Tensor a_shape;
+  Tensor b_shape;
+  a_shape.dims.assign(a_tp.dims().begin(), a_tp.dims().end());
+  b_shape.dims.assign(b_tp.dims().begin(), b_tp.dims().end());
+  const auto dims = BroadcastDims({&a_shape, &b_shape});
+  if (!dims) {
+    return std::nullopt;
+  }
+  const size_t rank = dims->size();
+  auto a_dims = a_shape.dims;
+  auto b_dims = b_shape.dims;
+  a_dims.insert(a_dims.begin(), rank - a_dims.size(), 1);
+  b_dims.insert(b_dims.begin(), rank - b_dims.size(), 1);
+
+  // the trailing dims in which neither input switches between contiguous
+  // and broadcast form the inner run
+  enum { kAny, kContiguous, kBroadcast } a_kind = kAny, b_kind = kAny;
+  size_t inner = 1;
+  size_t k = rank;
+  for (; k > 0; k--) {
+    const size_t d = k - 1;
+    if ((*dims)[d] == 1) {
+      continue;
+    }
+    const auto a_dim_kind = a_dims[d] == 1 ? kBroadcast : kContiguous;
+    const auto b_dim_kind = b_dims[d] == 1 ? kBroadcast : kContiguous;
+    if ((a_kind != kAny && a_kind != a_dim_kind) ||
+        (b_kind != kAny && b_kind != b_dim_kind)) {
+      break;
+    }
+    a_kind = a_dim_kind;
+    b_kind = b_dim_kind;
+    inner *= (*dims)[d];
+  }
+
+  std::vector<size_t> a_strides(rank, 0);
+  std::vector<size_t> b_strides(rank, 0);
+  for (size_t i = rank, a_stride = 1, b_stride = 1; i-- > 0;) {
+    a_strides[i] = a_dims[i] == 1 ? 0 : a_stride;
+    b_strides[i] = b_dims[i] == 1 ? 0 : b_stride;
+    a_stride *= a_dims[i];
+    b_stride *= b_dims[i];
+  }
+  auto out_tp = NewTensor(TensorProto::FLOAT, *dims);
+  const size_t n = NumElements(*dims);
+  auto* out = AllocateBuffer<float>(out_tp, n);
+  std::vector<int64_t> counter(k, 0);
+  size_t a_offset = 0;
+  size_t b_offset = 0;
+  for (size_t done = 0; done < n; done += inner) {
+    BinaryF32(op, a + a_offset, a_kind == kBroadcast, b + b_offset,
+              b_kind == kBroadcast, out + done, inner);
+    for (size_t i = k; i-- > 0;) {
+      a_offset += a_strides[i];
+      b_offset += b_strides[i];
+      if (++counter[i] < (*dims)[i]) {
+        break;
+      }
+      a_offset -= a_strides[i] * counter[i];
+      b_offset -= b_strides[i] * counter[i];
+      counter[i] = 0;
+    }
+  }
+  return out_tp;
+}
+
+std::optional<TensorProto> RunBufferKernel(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  static const std::unordered_map<std::string, BinaryOp> binary_ops{
+      {"Add", BinaryOp::kAdd},
+      {"Sub", BinaryOp::kSub},
+      {"Mul", BinaryOp::kMul},
+      {"Div", BinaryOp::kDiv}};
+  static const std::unordered_map<std::string, UnaryOp> unary_ops{
+      {"Sqrt", UnaryOp::kSqrt}, {"Reciprocal", UnaryOp::kReciprocal}};
+  const auto& op = node.op_type();
+  if (inputs.empty() || inputs[0] == nullptr) {
+    return std::nullopt;
+  }
+  const auto& x = *inputs[0];
+  const std::vector<int64_t> dims(x.dims().begin(), x.dims().end());
+  const size_t n = NumElements(dims);
+  if (const auto it = binary_ops.find(op); it != binary_ops.end()) {
+    if (inputs.size() != 2 || inputs[1] == nullptr ||
+        x.data_type() != TensorProto::FLOAT ||
+        inputs[1]->data_type() != TensorProto::FLOAT) {
+      return std::nullopt;
+    }
+    return BroadcastBinaryF32(it->second, x, *inputs[1]);
+  }
+  if (const auto it = unary_ops.find(op); it != unary_ops.end()) {
+    const auto* data = static_cast<const float*>(GetBuffer(&x));
+    if (inputs.size() != 1 || x.data_type() != TensorProto::FLOAT ||
+        data == nullptr) {
+      return std::nullopt;
+    }
+    auto out = NewTensor(TensorProto::FLOAT, dims);
+    UnaryF32(it->second, data, AllocateBuffer<float>(out, n), n);
+    return out;
+  }
+  if (op == "Cast") {
+    const auto to = GetIntAttribute(node, "to", TensorProto::UNDEFINED);
+    const void* data = GetBuffer(&x);
+    if (data == nullptr) {
+      return std::nullopt;
+    }
+    if (x.data_type() == TensorProto::FLOAT && to == TensorProto::FLOAT16) {
+      auto out = NewTensor(TensorProto::FLOAT16, dims);
+      F32ToF16(static_cast<const float*>(data),
+               AllocateBuffer<uint16_t>(out, n), n);
+      return out;
+    }
+    if (x.data_type() == TensorProto::FLOAT16 && to == TensorProto::FLOAT) {
+      auto out = NewTensor(TensorProto::FLOAT, dims);
+      F16ToF32(static_cast<const uint16_t*>(data),
+               AllocateBuffer<float>(out, n), n);
+      return out;
+    }
+    return std::nullopt;
+  }
+  if (op == "Transpose") {
+    const void* data = GetBuffer(&x);
+    if (inputs.size() != 1 || data == nullptr) {
+      return std::nullopt;
+    }
+    const int64_t rank = dims.size();
+    std::vector<int64_t> perm(rank);
+    if (const auto* attr = FindAttribute(node, "perm"); attr != nullptr) {
+      perm.assign(attr->ints().begin(), attr->ints().end());
+    } else {
+      // reverses the dims by default
+      for (int64_t i = 0; i < rank; i++) {
+        perm[i] = rank - 1 - i;
+      }
+    }
+    std::vector<char> seen(rank, false);
+    for (const auto p : perm) {
+      if (p < 0 || p >= rank || seen[p]) {
+        return std::nullopt;
+      }
+      seen[p] = true;
+    }
+    if (static_cast<int64_t>(perm.size()) != rank) {
+      return std::nullopt;
+    }
+    std::vector<int64_t> out_dims;
+    for (const auto p : perm) {
+      out_dims.push_back(dims[p]);
+    }
+    const size_t elem_size = ElementSize(x.data_type());
+    auto out = NewTensor(x.data_type(), out_dims);
+    Transpose(data, AllocateBuffer<char>(out, n * elem_size), elem_size, dims,
+              perm);
+    return out;
+  }
+  return std::nullopt;
+}
+
+// Shape, Size, Identity and Constant do not need to decode any data, so they
+// support all dtypes.
+std::optional<std::vector<TensorProto>> RunDataFreeKernel(
+    const onnx::NodeProto& node,
+    const std::vector<const TensorProto*>& inputs) {
+  const auto& op = node.op_type();
+  if (op == "Constant") {
+    const auto* value = FindAttribute(node, "value");
+    const auto* value_int = FindAttribute(node, "value_int");
+    const auto* value_ints = FindAttribute(node, "value_ints");
+    const auto* value_float = FindAttribute(node, "value_float");
+    const auto* value_floats = FindAttribute(node, "value_floats");
+    TensorProto t;
+    if (value != nullptr) {
+      if (value->t().data_location() == TensorProto::EXTERNAL) {
+        return std::nullopt;
+      }
+      t = value->t();
+      t.clear_name();
+    } else if (value_int != nullptr) {
+      t.set_data_type(TensorProto::INT64);
+      t.add_int64_data(value_int->i());
+    } else if (value_ints != nullptr) {
+      t.set_data_type(TensorProto::INT64);
+      t.add_dims(value_ints->ints_size());
+      *t.mutable_int64_data() = value_ints->ints();
+    } else if (value_float != nullptr) {
+      t.set_data_type(TensorProto::FLOAT);
+      t.add_float_data(value_float->f());
+    } else if (value_floats != nullptr) {
+      t.set_data_type(TensorProto::FLOAT);
+      t.add_dims(value_floats->floats_size());
+      *t.mutable_float_data() = value_floats->floats();
+    } else {
+      return std::nullopt;
+    }
+    return std::vector<TensorProto>{std::move(t)};
+  }
+  if (inputs.size() != 1 || inputs[0] == nullptr) {
+    return std::nullopt;
+  }
+  const auto& x = *inputs[0];
+  if (op == "Identity") {
+    TensorProto t = x;
+    t.clear_name();
+    return std::vector<TensorProto>{std::move(t)};
+  }
+  Tensor t;
+  t.dtype = TensorProto::INT64;
+  if (op == "Shape") {
+    const int64_t rank = x.dims_size();
+    int64_t start = GetIntAttribute(node, "start", 0);
+    int64_t end = GetIntAttribute(node, "end", rank);
+    start = std::clamp<int64_t>(start < 0 ? start + rank : start, 0, rank);
+    end = std::clamp<int64_t>(end < 0 ? end + rank : end, 0, rank);
+    for (int64_t i = start; i < end; i++) {
+      t.ints.push_back(x.dims(i));
+    }
+    t.dims = {static_cast<int64_t>(t.ints.size())};
+  } else if (op == "Size") {
+    t.ints = {static_cast<int64_t>(
+        NumElements({x.dims().begin(), x.dims().end()}))};
+  } else {
+    return std::nullopt;
+  }
+  return std::vector<TensorProto>{WriteTensor(t)};
+}
+
+}  // namespace
+
+std::optional<std::vector<onnx::TensorProto>> RunNativeKernel(
+    const onnx::NodeProto& node,
+    const std::vector<const onnx::TensorProto*>& inputs) {
+  if (!node.domain().empty() && node.domain() != "ai.onnx") {
+    return std::nullopt;
+  }
+  std::optional<std::vector<TensorProto>> outputs;
+  const auto& kernels = GetKernels();
+  if (auto output = RunBufferKernel(node, inputs)) {
+    outputs.emplace();
+    outputs->push_back(std::move(*output));
+  } else if (const auto it = kernels.find(node.op_type());
+             it != kernels.end()) {
+    const auto tensors = it->second(node, inputs);
+    if (tensors) {
+      outputs.emplace();
+      for (const auto& t : *tensors) {
+        outputs->push_back(WriteTensor(t));
+      }
+    }
+  } else {
+    outputs = RunDataFreeKernel(node, inputs);
+  }
+  if (!outputs || outputs->size() != static_cast<size_t>(node.output_size())) {
+    return std::nullopt;
+  }
+  for (size_t i = 0; i < outputs->size(); i++) {
+    (*outputs)[i].set_name(node.output(i));
+  }
+  return outputs;
+}
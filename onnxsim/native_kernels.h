@@ -0,0 +1,17 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include <onnx/onnx_pb.h>
+
+// Evaluates the ops that make up the shape computations of exported models
+// (Shape, Gather, Unsqueeze, Concat, Slice, Cast, integer arithmetic, ...)
+// directly on TensorProto data, so that folding them does not need a
+// ModelExecutor. `inputs` has one element per node input, nullptr for an
+// omitted optional input. Returns std::nullopt if the op, one of its
+// attributes or an input dtype is not supported, or if the inputs are not
+// valid for the op; the caller then falls back to the executor.
+std::optional<std::vector<onnx::TensorProto>> RunNativeKernel(
+    const onnx::NodeProto& node,
+    const std::vector<const onnx::TensorProto*>& inputs);
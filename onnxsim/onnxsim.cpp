@@ -1,30 +1,74 @@
 #include "onnxsim.h"
 
 #include <google/protobuf/text_format.h>
-#include <google/protobuf/util/message_differencer.h>
 #include <onnx/onnx_pb.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <fstream>
+#include <list>
+#include <mutex>
 #include <numeric>
+#include <sstream>
+#include <string_view>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
 
 #ifndef NO_BUILTIN_ORT
 #include "../third_party/onnxruntime/include/onnxruntime/core/framework/endian.h"
 #include "../third_party/onnxruntime/include/onnxruntime/core/session/onnxruntime_cxx_api.h"
 #endif
+#include "external_data.h"
+#include "native_kernels.h"
 #include "onnx/common/file_utils.h"
 #include "onnx/shape_inference/implementation.h"
 #include "onnxoptimizer/model_util.h"
 #include "onnxoptimizer/optimize.h"
+#include "result_cache.h"
+#include "symbolic_shape.h"
+#include "thread_pool.h"
 
-struct Config {
+// Everything a simplification reads besides the model. It is created for
+// every call and passed down explicitly, so that concurrent calls never
+// share it and the worker threads of a call see the same one.
+struct SimplifyContext {
   std::vector<std::string> optimizer_passes;
   // default value is max
   size_t tensor_size_threshold = -1;
+  // fold each connected region of constant nodes in a single executor run
+  // instead of node by node
+  bool fold_constant_regions = false;
+  // runs independent constant nodes concurrently, null means sequential
+  std::shared_ptr<ThreadPool> thread_pool;
+  // the outputs of the ops folded by the model executor, null means they
+  // are not cached
+  std::shared_ptr<OpResultCache> op_result_cache;
+  // runs the ops the builtin kernels do not support, null if there is no
+  // executor
+  std::shared_ptr<const ModelExecutor> executor;
+  std::function<void(const SimplifyProgress&)> on_progress;
+  std::function<bool()> is_cancelled;
+  // null means the warnings are printed
+  std::function<void(const std::string&)> on_warning;
+  // the progress reported to on_progress, null without on_progress
+  std::shared_ptr<std::pair<std::mutex, SimplifyProgress>> progress;
+  // reruns shape inference only on the nodes changed since the previous run
+  bool incremental_shape_inference = false;
+  // folds the shape computations on dynamic dims after constant folding
+  bool fold_symbolic_shapes = false;
+  // merges the initializers with the same data after the simplification
+  bool deduplicate_initializers = false;
+  // reads the external data of the initializers on demand, null if the
+  // data is loaded into the model
+  std::shared_ptr<ExternalDataStore> external_data;
 };
 
-Config config;
-
 std::shared_ptr<const ModelExecutor> ModelExecutor::instance_ = nullptr;
 
 bool IsOfficialOp(const std::string& domain, const std::string& op) {
@@ -68,121 +112,238 @@ bool IsQDQ(const std::string& domain, const std::string& op) {
   return false;
 }
 
-auto FindInitializerByName(const onnx::ModelProto& model,
-                           const std::string& name) {
-  for (const auto& initializer : model.graph().initializer()) {
-    if (initializer.name() == name) {
-      return initializer;
-    }
+onnx::ValueInfoProto ValueInfoFromInitializer(
+    const onnx::TensorProto& initializer) {
+  onnx::ValueInfoProto vi;
+  for (const auto& dim : initializer.dims()) {
+    vi.mutable_type()
+        ->mutable_tensor_type()
+        ->mutable_shape()
+        ->add_dim()
+        ->set_dim_value(dim);
   }
-  throw std::invalid_argument("no initializer " + name);
+  vi.mutable_type()->mutable_tensor_type()->set_elem_type(
+      initializer.data_type());
+  vi.set_name(initializer.name());
+  return vi;
 }
 
-auto FindValueInfoProtoByName(const onnx::ModelProto& model,
-                              const std::string& name) {
-  for (const auto& vi : model.graph().value_info()) {
-    if (vi.name() == name) {
-      return vi;
+// Maps tensor names to the initializer / value_info / graph input protos of a
+// model, so that the folding path does not scan the whole graph for every
+// input of every folded node. Elements of protobuf repeated message fields
+// are never moved when the field grows, so the stored pointers stay valid
+// while new initializers are appended to the model.
+class TensorIndex {
+ public:
+  explicit TensorIndex(const onnx::ModelProto& model) {
+    const auto& graph = model.graph();
+    initializers_.reserve(graph.initializer_size());
+    value_infos_.reserve(graph.value_info_size());
+    // emplace keeps the first proto of a duplicated name, which matches the
+    // previous linear scan
+    for (const auto& vi : graph.value_info()) {
+      value_infos_.emplace(vi.name(), &vi);
+    }
+    for (const auto& vi : graph.input()) {
+      inputs_.emplace(vi.name(), &vi);
+    }
+    for (const auto& initializer : graph.initializer()) {
+      AddInitializer(initializer);
     }
   }
-  for (const auto& initializer : model.graph().initializer()) {
-    if (initializer.name() == name) {
-      onnx::ValueInfoProto vi;
-      for (const auto& dim : initializer.dims()) {
-        vi.mutable_type()
-            ->mutable_tensor_type()
-            ->mutable_shape()
-            ->add_dim()
-            ->set_dim_value(dim);
-      }
-      vi.mutable_type()->mutable_tensor_type()->set_elem_type(
-          initializer.data_type());
-      vi.set_name(name);
-      return vi;
+
+  // An index that sees the tensors of `base` plus the initializers added to
+  // it, without modifying `base`. It lets several threads fold nodes against
+  // the same base index.
+  explicit TensorIndex(const TensorIndex* base) : base_(base) {}
+
+  void AddInitializer(const onnx::TensorProto& initializer) {
+    initializers_.emplace(initializer.name(), &initializer);
+  }
+
+  const onnx::TensorProto& FindInitializer(const std::string& name) const {
+    const auto* initializer = FindInitializerProto(name);
+    if (initializer == nullptr) {
+      throw std::invalid_argument("no initializer " + name);
     }
+    return *initializer;
+  }
+
+  onnx::ValueInfoProto FindValueInfo(const std::string& name) const {
+    if (const auto* vi = FindValueInfoProto(name); vi != nullptr) {
+      return *vi;
+    }
+    if (const auto* initializer = FindInitializerProto(name);
+        initializer != nullptr) {
+      return ValueInfoFromInitializer(*initializer);
+    }
+    throw std::invalid_argument("no value info " + name);
   }
-  throw std::invalid_argument("no value info " + name);
-}
+
+ private:
+  const onnx::TensorProto* FindInitializerProto(const std::string& name) const {
+    if (const auto it = initializers_.find(name); it != initializers_.end()) {
+      return it->second;
+    }
+    return base_ ? base_->FindInitializerProto(name) : nullptr;
+  }
+
+  // value_info first, then graph inputs
+  const onnx::ValueInfoProto* FindValueInfoProto(
+      const std::string& name) const {
+    if (const auto it = value_infos_.find(name); it != value_infos_.end()) {
+      return it->second;
+    }
+    if (const auto it = inputs_.find(name); it != inputs_.end()) {
+      return it->second;
+    }
+    return base_ ? base_->FindValueInfoProto(name) : nullptr;
+  }
+
+  const TensorIndex* base_ = nullptr;
+  std::unordered_map<std::string, const onnx::TensorProto*> initializers_;
+  std::unordered_map<std::string, const onnx::ValueInfoProto*> value_infos_;
+  std::unordered_map<std::string, const onnx::ValueInfoProto*> inputs_;
+};
 
 #ifndef NO_BUILTIN_ORT
+// Stores the data as raw_data with a single memcpy, which is also the most
+// compact representation in the model file.
 onnx::TensorProto TensorToTensorProto(const Ort::Value& tensor) {
+  if (onnxruntime::endian::native == onnxruntime::endian::big) {
+    throw std::invalid_argument("only little endian is supported");
+  }
+  const auto type_and_shape = tensor.GetTensorTypeAndShapeInfo();
   onnx::TensorProto tensor_proto;
-  for (const auto& dim : tensor.GetTensorTypeAndShapeInfo().GetShape()) {
+  for (const auto& dim : type_and_shape.GetShape()) {
     tensor_proto.add_dims(dim);
   }
   onnx::TensorProto::DataType onnx_dtype =
-      (onnx::TensorProto::DataType)tensor.GetTensorTypeAndShapeInfo()
-          .GetElementType();
+      (onnx::TensorProto::DataType)type_and_shape.GetElementType();
   tensor_proto.set_data_type(onnx_dtype);
 
+  size_t element_size = 0;
   switch (onnx_dtype) {
-#define CASE_DTYPE(onnx_dtype, storage_dtype, cpp_type)                   \
-  case onnx::TensorProto::onnx_dtype: {                                   \
-    const auto* dptr = tensor.GetTensorData<cpp_type>();                  \
-    for (size_t i = 0;                                                    \
-         i < tensor.GetTensorTypeAndShapeInfo().GetElementCount(); i++) { \
-      tensor_proto.add_##storage_dtype##_data(dptr[i]);                   \
-    }                                                                     \
-    break;                                                                \
-  }
-
-    CASE_DTYPE(FLOAT, float, float)
-    CASE_DTYPE(DOUBLE, double, double)
-    CASE_DTYPE(INT64, int64, int64_t)
-    CASE_DTYPE(UINT64, uint64, uint64_t)
-    CASE_DTYPE(INT32, int32, int32_t)
-    CASE_DTYPE(UINT8, int32, uint8_t)
-    CASE_DTYPE(INT8, int32, int8_t)
-    CASE_DTYPE(UINT16, int32, uint16_t)
-    CASE_DTYPE(INT16, int32, int16_t)
-    CASE_DTYPE(BOOL, int32, int8_t)
+#define CASE_DTYPE(onnx_dtype, cpp_type) \
+  case onnx::TensorProto::onnx_dtype:    \
+    element_size = sizeof(cpp_type);     \
+    break;
+
+    CASE_DTYPE(FLOAT, float)
+    CASE_DTYPE(DOUBLE, double)
+    CASE_DTYPE(INT64, int64_t)
+    CASE_DTYPE(UINT64, uint64_t)
+    CASE_DTYPE(INT32, int32_t)
+    CASE_DTYPE(UINT32, uint32_t)
+    CASE_DTYPE(UINT8, uint8_t)
+    CASE_DTYPE(INT8, int8_t)
+    CASE_DTYPE(UINT16, uint16_t)
+    CASE_DTYPE(INT16, int16_t)
+    CASE_DTYPE(FLOAT16, uint16_t)
+    CASE_DTYPE(BFLOAT16, uint16_t)
+    CASE_DTYPE(BOOL, bool)
 #undef CASE_DTYPE
     default:
       throw std::invalid_argument("Unknown dtype " +
                                   std::to_string(tensor_proto.data_type()));
   }
+  tensor_proto.set_raw_data(
+      tensor.GetTensorData<void>(),
+      type_and_shape.GetElementCount() * element_size);
   return tensor_proto;
 }
 
-Ort::Value TensorProtoToTensor(const onnx::TensorProto& tensor_proto) {
-  Ort::AllocatorWithDefaultOptions allocator;
-  auto tensor = Ort::Value::CreateTensor(
-      allocator, tensor_proto.dims().data(), tensor_proto.dims_size(),
-      (ONNXTensorElementDataType)tensor_proto.data_type());
+// Converts the typed field storing `n` elements of a dtype narrower than
+// the field (e.g. int8 in int32_data) into `dst`. A plain counted loop over
+// contiguous arrays, which compilers vectorize into packed conversions.
+template <typename T, typename Storage>
+void ConvertTypedData(const google::protobuf::RepeatedField<Storage>& src,
+                      T* dst) {
+  const Storage* src_ptr = src.data();
+  const size_t n = src.size();
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = static_cast<T>(src_ptr[i]);
+  }
+}
+
+// Wraps the data of `tensor_proto` into an Ort::Value without copying it
+// whenever the in-memory layout already matches (raw_data, or a typed field
+// whose element type is the tensor's dtype). The returned value borrows the
+// proto's buffer and must not outlive it. Only dtypes stored in a wider
+// typed field (e.g. uint8 in int32_data) need an owning copy.
+Ort::Value TensorProtoToTensor(const onnx::TensorProto& tensor_proto,
+                               const OrtMemoryInfo* memory_info) {
+  const auto dtype = (ONNXTensorElementDataType)tensor_proto.data_type();
+  // ORT never writes to the input tensors of a session, so it is safe to hand
+  // it the const buffers of the proto.
+  const auto borrow = [&](const void* data, size_t byte_size) {
+    return Ort::Value::CreateTensor(
+        memory_info, const_cast<void*>(data), byte_size,
+        tensor_proto.dims().data(), tensor_proto.dims_size(), dtype);
+  };
   if (tensor_proto.has_raw_data()) {
     if (onnxruntime::endian::native == onnxruntime::endian::big) {
       throw std::invalid_argument("only little endian is supported");
     }
-    memcpy(tensor.GetTensorMutableData<void>(), tensor_proto.raw_data().data(),
-           tensor_proto.raw_data().size());
+    if (!tensor_proto.raw_data().empty()) {
+      return borrow(tensor_proto.raw_data().data(),
+                    tensor_proto.raw_data().size());
+    }
   } else {
     switch (tensor_proto.data_type()) {
-#define CASE_DTYPE(onnx_dtype, storage_dtype, cpp_type)         \
-  case onnx::TensorProto::onnx_dtype: {                         \
-    std::vector<cpp_type> vec;                                  \
-    for (const auto& x : tensor_proto.storage_dtype##_data()) { \
-      vec.push_back(x);                                         \
-    }                                                           \
-    memcpy(tensor.GetTensorMutableData<void>(), vec.data(),     \
-           vec.size() * sizeof(cpp_type));                      \
-    break;                                                      \
-  }
-      CASE_DTYPE(FLOAT, float, float)
-      CASE_DTYPE(DOUBLE, double, double)
-      CASE_DTYPE(INT64, int64, int64_t)
-      CASE_DTYPE(UINT64, uint64, uint64_t)
-      CASE_DTYPE(INT32, int32, int32_t)
-      CASE_DTYPE(UINT8, int32, uint8_t)
-      CASE_DTYPE(INT8, int32, int8_t)
-      CASE_DTYPE(UINT16, int32, uint16_t)
-      CASE_DTYPE(INT16, int32, int16_t)
-      CASE_DTYPE(BOOL, int32, int8_t)
+#define CASE_DTYPE(onnx_dtype, storage_dtype)                         \
+  case onnx::TensorProto::onnx_dtype: {                               \
+    const auto& data = tensor_proto.storage_dtype##_data();           \
+    if (!data.empty()) {                                              \
+      return borrow(data.data(), data.size() * sizeof(*data.data())); \
+    }                                                                 \
+    break;                                                            \
+  }
+      CASE_DTYPE(FLOAT, float)
+      CASE_DTYPE(DOUBLE, double)
+      CASE_DTYPE(INT64, int64)
+      CASE_DTYPE(UINT64, uint64)
+      CASE_DTYPE(INT32, int32)
 #undef CASE_DTYPE
       default:
-        throw std::invalid_argument("Unknown dtype " +
-                                    std::to_string(tensor_proto.data_type()));
+        break;
     }
   }
+
+  Ort::AllocatorWithDefaultOptions allocator;
+  auto tensor = Ort::Value::CreateTensor(
+      allocator, tensor_proto.dims().data(), tensor_proto.dims_size(), dtype);
+  if (tensor_proto.has_raw_data()) {
+    // empty raw_data, nothing to copy
+    return tensor;
+  }
+  switch (tensor_proto.data_type()) {
+#define CASE_DTYPE(onnx_dtype, storage_dtype, cpp_type)        \
+  case onnx::TensorProto::onnx_dtype:                          \
+    ConvertTypedData(tensor_proto.storage_dtype##_data(),      \
+                     tensor.GetTensorMutableData<cpp_type>()); \
+    break;
+    // the same-width dtypes only get here when they are empty
+    case onnx::TensorProto::FLOAT:
+    case onnx::TensorProto::DOUBLE:
+    case onnx::TensorProto::INT64:
+    case onnx::TensorProto::UINT64:
+    case onnx::TensorProto::INT32:
+      break;
+    CASE_DTYPE(UINT32, uint64, uint32_t)
+    CASE_DTYPE(UINT8, int32, uint8_t)
+    CASE_DTYPE(INT8, int32, int8_t)
+    CASE_DTYPE(UINT16, int32, uint16_t)
+    CASE_DTYPE(INT16, int32, int16_t)
+    // float16 and bfloat16 keep their bit patterns in int32_data
+    CASE_DTYPE(FLOAT16, int32, uint16_t)
+    CASE_DTYPE(BFLOAT16, int32, uint16_t)
+    CASE_DTYPE(BOOL, int32, int8_t)
+#undef CASE_DTYPE
+    default:
+      throw std::invalid_argument("Unknown dtype " +
+                                  std::to_string(tensor_proto.data_type()));
+  }
   return tensor;
 }
 
@@ -191,32 +352,85 @@ std::shared_ptr<Ort::Env> GetEnv() {
   return env;
 }
 
+// Returns a copy of `model` with every tensor renamed after the position of
+// its first appearance, node names and doc strings dropped and the dims of
+// the graph inputs reduced to their rank. Models that only differ in those
+// respects, e.g. the same Unsqueeze applied to different tensors, share the
+// same canonical model and therefore can share an ORT session.
+onnx::ModelProto CanonicalizeModel(const onnx::ModelProto& model) {
+  onnx::ModelProto canonical;
+  canonical.set_ir_version(model.ir_version());
+  *canonical.mutable_opset_import() = model.opset_import();
+  // "" represents the unset optional input and keeps its name
+  std::unordered_map<std::string, std::string> names{{"", ""}};
+  const auto rename = [&names](const std::string& name) {
+    return names.emplace(name, "t" + std::to_string(names.size() - 1))
+        .first->second;
+  };
+  auto* graph = canonical.mutable_graph();
+  for (const auto& x : model.graph().input()) {
+    auto* input = graph->add_input();
+    *input->mutable_type() = x.type();
+    input->set_name(rename(x.name()));
+    if (input->type().has_tensor_type()) {
+      for (auto& dim : *input->mutable_type()
+                            ->mutable_tensor_type()
+                            ->mutable_shape()
+                            ->mutable_dim()) {
+        dim.clear_value();
+        dim.clear_denotation();
+      }
+    }
+  }
+  for (const auto& x : model.graph().initializer()) {
+    auto* initializer = graph->add_initializer();
+    *initializer = x;
+    initializer->set_name(rename(x.name()));
+  }
+  for (const auto& x : model.graph().node()) {
+    auto* node = graph->add_node();
+    *node = x;
+    node->clear_name();
+    node->clear_doc_string();
+    for (auto& input : *node->mutable_input()) {
+      input = rename(input);
+    }
+    for (auto& output : *node->mutable_output()) {
+      output = rename(output);
+    }
+  }
+  for (const auto& x : model.graph().output()) {
+    graph->add_output()->set_name(rename(x.name()));
+  }
+  return canonical;
+}
+
+static std::atomic<size_t> session_cache_hits{0};
+static std::atomic<size_t> session_cache_misses{0};
+
 struct CppModelExecutor : public ModelExecutor {
   std::vector<onnx::TensorProto> _Run(
       const onnx::ModelProto& model,
-      const std::vector<onnx::TensorProto>& inputs) const override {
+      const std::vector<const onnx::TensorProto*>& inputs) const override {
+    const auto session = GetSession(CanonicalizeModel(model));
     std::vector<const char*> input_name_ptrs;
     std::vector<const char*> output_name_ptrs;
-    std::transform(
-        model.graph().input().begin(), model.graph().input().end(),
-        std::back_inserter(input_name_ptrs),
-        [](const onnx::ValueInfoProto& x) { return x.name().c_str(); });
-    std::transform(
-        model.graph().output().begin(), model.graph().output().end(),
-        std::back_inserter(output_name_ptrs),
-        [](const onnx::ValueInfoProto& x) { return x.name().c_str(); });
-    Ort::SessionOptions sess_opts;
-    sess_opts.SetLogSeverityLevel(3);
-    sess_opts.SetGraphOptimizationLevel(ORT_DISABLE_ALL);
-    std::string model_str = model.SerializeAsString();
-    Ort::Session session(*GetEnv(), model_str.data(), model_str.size(),
-                         sess_opts);
+    std::transform(session->input_names.begin(), session->input_names.end(),
+                   std::back_inserter(input_name_ptrs),
+                   [](const std::string& x) { return x.c_str(); });
+    std::transform(session->output_names.begin(),
+                   session->output_names.end(),
+                   std::back_inserter(output_name_ptrs),
+                   [](const std::string& x) { return x.c_str(); });
     Ort::RunOptions run_opts;
     run_opts.SetRunLogSeverityLevel(3);
+    const auto memory_info =
+        Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
     std::vector<Ort::Value> input_tensors;
-    std::transform(inputs.begin(), inputs.end(),
-                   std::back_inserter(input_tensors), TensorProtoToTensor);
-    auto output_tensors = session.Run(
+    for (const auto* input : inputs) {
+      input_tensors.push_back(TensorProtoToTensor(*input, memory_info));
+    }
+    auto output_tensors = session->session.Run(
         run_opts, input_name_ptrs.data(), input_tensors.data(),
         input_tensors.size(), output_name_ptrs.data(), output_name_ptrs.size());
 
@@ -225,6 +439,71 @@ struct CppModelExecutor : public ModelExecutor {
                    std::back_inserter(output_tps), TensorToTensorProto);
     return output_tps;
   }
+
+ private:
+  struct CachedSession {
+    static Ort::Session CreateSession(const std::string& model_str) {
+      Ort::SessionOptions sess_opts;
+      sess_opts.SetLogSeverityLevel(3);
+      sess_opts.SetGraphOptimizationLevel(ORT_DISABLE_ALL);
+      // folding runs independent nodes concurrently instead, and the cached
+      // sessions should not each own a thread pool
+      sess_opts.SetIntraOpNumThreads(1);
+      return Ort::Session(*GetEnv(), model_str.data(), model_str.size(),
+                          sess_opts);
+    }
+
+    CachedSession(const onnx::ModelProto& model, const std::string& model_str)
+        : session(CreateSession(model_str)) {
+      for (const auto& x : model.graph().input()) {
+        input_names.push_back(x.name());
+      }
+      for (const auto& x : model.graph().output()) {
+        output_names.push_back(x.name());
+      }
+    }
+
+    Ort::Session session;
+    std::vector<std::string> input_names;
+    std::vector<std::string> output_names;
+  };
+
+  // The canonical model is also the cache key, so ops with the same type,
+  // domain, opset, attributes and input dtypes/ranks reuse one session.
+  std::shared_ptr<CachedSession> GetSession(
+      const onnx::ModelProto& canonical) const {
+    const std::string key = canonical.SerializeAsString();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (const auto it = sessions_.find(key); it != sessions_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        session_cache_hits++;
+        return it->second->second;
+      }
+    }
+    // build the session without holding the lock, it is the expensive part
+    auto session = std::make_shared<CachedSession>(canonical, key);
+    session_cache_misses++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sessions_.find(key) == sessions_.end()) {
+      lru_.emplace_front(key, session);
+      sessions_[key] = lru_.begin();
+      if (lru_.size() > kMaxCachedSessions) {
+        sessions_.erase(lru_.back().first);
+        lru_.pop_back();
+      }
+    }
+    return session;
+  }
+
+  using LruList =
+      std::list<std::pair<std::string, std::shared_ptr<CachedSession>>>;
+
+  static constexpr size_t kMaxCachedSessions = 1024;
+  mutable std::mutex mutex_;
+  // most recently used first
+  mutable LruList lru_;
+  mutable std::unordered_map<std::string, LruList::iterator> sessions_;
 };
 
 static int __register_cpp_model_executor __attribute__((unused)) = []() {
@@ -239,39 +518,80 @@ void InitEnv() {
 }
 #endif
 
-std::vector<onnx::TensorProto> RunOp(onnx::ModelProto& model,
-                                     const onnx::NodeProto& op) {
+static std::atomic<size_t> native_folds{0};
+static std::atomic<size_t> executor_folds{0};
+
+FoldingStats GetFoldingStats() {
+  FoldingStats stats;
+#ifndef NO_BUILTIN_ORT
+  stats.session_cache_hits = session_cache_hits;
+  stats.session_cache_misses = session_cache_misses;
+#endif
+  stats.native_folds = native_folds;
+  stats.executor_folds = executor_folds;
+  return stats;
+}
+
+void ResetFoldingStats() {
+#ifndef NO_BUILTIN_ORT
+  session_cache_hits = 0;
+  session_cache_misses = 0;
+#endif
+  native_folds = 0;
+  executor_folds = 0;
+}
+
+// Runs `nodes`, which are topologically sorted and only consume initializers
+// of `model` or the outputs of each other, as one model on `executor` and
+// returns the tensors named `output_names`.
+std::vector<onnx::TensorProto> RunNodes(
+    const onnx::ModelProto& model, const TensorIndex& index,
+    const std::vector<const onnx::NodeProto*>& nodes,
+    const std::vector<std::string>& output_names,
+    const ModelExecutor* executor) {
+  if (executor == nullptr) {
+    throw std::runtime_error("empty instance");
+  }
   std::vector<std::string> input_names;
-  std::vector<onnx::TensorProto> input_tps;
+  // point to the initializers of `model` instead of copying them, large
+  // constant inputs are only read once by the executor
+  std::vector<const onnx::TensorProto*> input_tps;
   std::set<std::string> initializer_names;
+  std::set<std::string> produced_names;
 
   onnx::ModelProto op_model;
   op_model.set_ir_version(model.ir_version());
   for (const auto& x : model.opset_import()) {
     *op_model.add_opset_import() = x;
   }
-  *op_model.mutable_graph()->add_node() = op;
+  for (const auto* op : nodes) {
+    *op_model.mutable_graph()->add_node() = *op;
+  }
 
-  for (const auto& input : op.input()) {
-    if (std::find(input_names.begin(), input_names.end(), input) !=
-        input_names.end()) {
-      continue;
-    }
-    // skip "" which represents the unset optional input
-    if (input.empty()) {
-      continue;
-    }
-    if (initializer_names.find(input) != initializer_names.end()) {
-      continue;
-    }
-    auto in_tp = FindInitializerByName(model, input);
-    if (in_tp.dims().size() == 1 && in_tp.dims()[0] == 0) {
-      initializer_names.insert(input);
-      *op_model.mutable_graph()->add_initializer() = in_tp;
-      continue;
+  for (const auto* op : nodes) {
+    for (const auto& input : op->input()) {
+      if (std::find(input_names.begin(), input_names.end(), input) !=
+          input_names.end()) {
+        continue;
+      }
+      // skip "" which represents the unset optional input
+      if (input.empty()) {
+        continue;
+      }
+      if (initializer_names.find(input) != initializer_names.end() ||
+          produced_names.find(input) != produced_names.end()) {
+        continue;
+      }
+      const auto& in_tp = index.FindInitializer(input);
+      if (in_tp.dims().size() == 1 && in_tp.dims()[0] == 0) {
+        initializer_names.insert(input);
+        *op_model.mutable_graph()->add_initializer() = in_tp;
+        continue;
+      }
+      input_names.push_back(input);
+      input_tps.push_back(&in_tp);
     }
-    input_names.push_back(input);
-    input_tps.push_back(in_tp);
+    produced_names.insert(op->output().begin(), op->output().end());
   }
 
   for (const auto& x : input_names) {
@@ -279,27 +599,155 @@ std::vector<onnx::TensorProto> RunOp(onnx::ModelProto& model,
     if (x.empty()) {
       continue;
     }
-    *op_model.mutable_graph()->add_input() = FindValueInfoProtoByName(model, x);
+    *op_model.mutable_graph()->add_input() = index.FindValueInfo(x);
   }
-  for (const auto& x : op.output()) {
+  for (const auto& x : output_names) {
     onnx::ValueInfoProto vi;
     // In principle output ValueInfoProto must have type. But it is not checked.
     vi.set_name(x);
     *op_model.mutable_graph()->add_output() = vi;
   }
 
-  auto output_tps = ModelExecutor::Run(op_model, input_tps);
-  for (size_t i = 0; i < op.output_size(); i++) {
-    output_tps[i].set_name(op.output(i));
+  auto output_tps = executor->_Run(op_model, input_tps);
+  for (size_t i = 0; i < output_names.size(); i++) {
+    output_tps[i].set_name(output_names[i]);
   }
   return output_tps;
 }
 
-void RunOpAndAddInitializer(onnx::ModelProto& model,
-                            const onnx::NodeProto& op) {
-  const auto output_tps = RunOp(model, op);
-  for (const auto& output_tp : output_tps) {
-    *model.mutable_graph()->add_initializer() = output_tp;
+std::vector<onnx::TensorProto> RunOp(const onnx::ModelProto& model,
+                                     const TensorIndex& index,
+                                     const onnx::NodeProto& op,
+                                     const ModelExecutor* executor) {
+  return RunNodes(model, index, {&op},
+                  {op.output().begin(), op.output().end()}, executor);
+}
+
+// The key of `op` in an OpResultCache: the op without its names, which of
+// its outputs are set, the opsets of the model and the dtypes, dims and data
+// of the inputs. "" if an input is external data, which is not part of the
+// tensor proto.
+std::string GetOpKey(const onnx::ModelProto& model, const onnx::NodeProto& op,
+                     const std::vector<const onnx::TensorProto*>& inputs) {
+  Sha256 sha;
+  // every part is prefixed with its size so that the parts cannot be
+  // shifted into each other
+  const auto Add = [&sha](std::string_view data) {
+    const uint64_t size = data.size();
+    sha.Update({reinterpret_cast<const char*>(&size), sizeof(size)});
+    sha.Update(data);
+  };
+  onnx::NodeProto op_without_names = op;
+  op_without_names.clear_name();
+  op_without_names.clear_doc_string();
+  op_without_names.clear_input();
+  op_without_names.clear_output();
+  Add(op_without_names.SerializeAsString());
+  // the results depend on the outputs too, e.g. Split without the `split`
+  // input makes as many parts as it has outputs
+  std::string outputs(op.output_size(), '1');
+  for (int i = 0; i < op.output_size(); i++) {
+    if (op.output(i).empty()) {
+      outputs[i] = '0';
+    }
+  }
+  Add(outputs);
+  for (const auto& x : model.opset_import()) {
+    Add(x.SerializeAsString());
+  }
+  for (const auto* x : inputs) {
+    if (x == nullptr) {
+      Add("");
+      continue;
+    }
+    if (x->data_location() == onnx::TensorProto::EXTERNAL) {
+      return "";
+    }
+    if (x->has_raw_data()) {
+      onnx::TensorProto header;
+      header.set_data_type(x->data_type());
+      *header.mutable_dims() = x->dims();
+      Add(header.SerializeAsString());
+      Add(x->raw_data());
+    } else {
+      onnx::TensorProto copy = *x;
+      copy.clear_name();
+      copy.clear_doc_string();
+      Add(copy.SerializeAsString());
+    }
+  }
+  return sha.HexDigest();
+}
+
+// Evaluates `op` with the builtin kernels if they support it, and with the
+// model executor otherwise. The outputs of the executor are looked up in and
+// added to the op result cache of `ctx` if it has one.
+std::vector<onnx::TensorProto> FoldOp(const onnx::ModelProto& model,
+                                      const TensorIndex& index,
+                                      const onnx::NodeProto& op,
+                                      const SimplifyContext& ctx) {
+  auto* cache = ctx.op_result_cache.get();
+  std::vector<const onnx::TensorProto*> inputs;
+  for (const auto& x : op.input()) {
+    inputs.push_back(x.empty() ? nullptr : &index.FindInitializer(x));
+  }
+  if (auto outputs = RunNativeKernel(op, inputs)) {
+    native_folds++;
+    return std::move(*outputs);
+  }
+  const auto key = cache ? GetOpKey(model, op, inputs) : "";
+  if (!key.empty()) {
+    auto outputs = cache->Get(key);
+    if (outputs && outputs->size() == static_cast<size_t>(op.output_size())) {
+      for (int i = 0; i < op.output_size(); i++) {
+        (*outputs)[i].set_name(op.output(i));
+      }
+      return std::move(*outputs);
+    }
+  }
+  executor_folds++;
+  auto outputs = RunOp(model, index, op, ctx.executor.get());
+  if (!key.empty()) {
+    cache->Put(key, outputs);
+  }
+  return outputs;
+}
+
+// Evaluates the nodes of a constant region with the builtin kernels, returns
+// std::nullopt if one of them is not supported.
+std::optional<std::vector<onnx::TensorProto>> RunNodesNatively(
+    const TensorIndex& index, const std::vector<const onnx::NodeProto*>& nodes,
+    const std::vector<std::string>& output_names) {
+  // std::list so that the index can point to the outputs
+  std::list<onnx::TensorProto> tensors;
+  TensorIndex local_index(&index);
+  for (const auto* op : nodes) {
+    std::vector<const onnx::TensorProto*> inputs;
+    for (const auto& x : op->input()) {
+      inputs.push_back(x.empty() ? nullptr : &local_index.FindInitializer(x));
+    }
+    auto outputs = RunNativeKernel(*op, inputs);
+    if (!outputs) {
+      return std::nullopt;
+    }
+    for (auto& x : *outputs) {
+      tensors.push_back(std::move(x));
+      local_index.AddInitializer(tensors.back());
+    }
+  }
+  std::vector<onnx::TensorProto> results;
+  for (const auto& x : output_names) {
+    results.push_back(local_index.FindInitializer(x));
+  }
+  return results;
+}
+
+void AddInitializers(onnx::ModelProto& model, TensorIndex& index,
+                     std::vector<onnx::TensorProto>&& tensors) {
+  for (auto& tensor : tensors) {
+    auto* initializer = model.mutable_graph()->add_initializer();
+    *initializer = std::move(tensor);
+    index.AddInitializer(*initializer);
   }
 }
 
@@ -344,22 +792,25 @@ size_t size_of_dtype(onnx::TensorProto::DataType dtype) {
   throw std::invalid_argument("Unknown datatype " + std::to_string(dtype));
 }
 
-bool ProduceLargeTensor(const onnx::ModelProto& model,
-                        const onnx::NodeProto& node, size_t threshold) {
-  std::set<std::string> large_tensor_ops{"Tile", "ConstantOfShape", "Expand"};
+bool ProduceLargeTensor(
+    const std::unordered_map<std::string_view, const onnx::ValueInfoProto*>&
+        value_infos,
+    const onnx::NodeProto& node, size_t threshold) {
+  static const std::unordered_set<std::string> large_tensor_ops{
+      "Tile", "ConstantOfShape", "Expand"};
   if (large_tensor_ops.find(node.op_type()) == large_tensor_ops.end()) {
     return false;
   }
-  for (const auto& value_info : model.graph().value_info()) {
-    if (value_info.name() == node.output(0)) {
-      size_t size = size_of_dtype(static_cast<onnx::TensorProto::DataType>(
-          value_info.type().tensor_type().elem_type()));
-      for (const auto& dim : value_info.type().tensor_type().shape().dim()) {
-        size *= dim.dim_value();
-      }
-      if (size <= threshold) {
-        return false;
-      }
+  if (const auto it = value_infos.find(node.output(0));
+      it != value_infos.end()) {
+    const auto& value_info = *it->second;
+    size_t size = size_of_dtype(static_cast<onnx::TensorProto::DataType>(
+        value_info.type().tensor_type().elem_type()));
+    for (const auto& dim : value_info.type().tensor_type().shape().dim()) {
+      size *= dim.dim_value();
+    }
+    if (size <= threshold) {
+      return false;
     }
   }
   // If the output is not in value_info, we assume it is large.
@@ -370,128 +821,1186 @@ bool ProduceLargeTensor(const onnx::ModelProto& model,
 }
 
 std::pair<std::vector<onnx::NodeProto>, std::vector<onnx::NodeProto>>
-GetConstantNodes(const onnx::ModelProto& model) {
+GetConstantNodes(const onnx::ModelProto& model, const SimplifyContext& ctx) {
+  const auto& graph = model.graph();
   // tensor with empty name("") represents the empty value of an optional input
   // so "" should be treated as a name of a constant tensor.
-  std::vector<std::string> const_names{""};
+  // The views point into `model`, which outlives this function.
+  std::unordered_set<std::string_view> const_names{""};
+  const_names.reserve(graph.initializer_size() + graph.node_size());
+  for (const auto& x : graph.initializer()) {
+    const_names.insert(x.name());
+  }
+  std::unordered_map<std::string_view, const onnx::ValueInfoProto*>
+      value_infos;
+  value_infos.reserve(graph.value_info_size());
+  for (const auto& x : graph.value_info()) {
+    value_infos.emplace(x.name(), &x);
+  }
+  // a graph has far fewer distinct op types than nodes, so the op checks run
+  // once per (domain, op type)
+  std::unordered_map<std::string, bool> foldable_ops;
+  const auto IsFoldableOp = [&foldable_ops](const onnx::NodeProto& node) {
+    const auto key = node.domain() + ':' + node.op_type();
+    auto it = foldable_ops.find(key);
+    if (it == foldable_ops.end()) {
+      const bool foldable = IsOfficialOp(node.domain(), node.op_type()) &&
+                            IsDeterministic(node.domain(), node.op_type()) &&
+                            !IsQDQ(node.domain(), node.op_type());
+      it = foldable_ops.emplace(key, foldable).first;
+    }
+    return it->second;
+  };
   std::vector<onnx::NodeProto> const_nodes;
   std::vector<onnx::NodeProto> non_const_nodes;
-  std::transform(
-      model.graph().initializer().begin(), model.graph().initializer().end(),
-      std::back_inserter(const_names), [](const auto& x) { return x.name(); });
   // node is already topo sorted
-  for (const auto& node : model.graph().node()) {
+  for (const auto& node : graph.node()) {
     // clang-format off
-    if (IsOfficialOp(node.domain(), node.op_type()) &&
-        IsDeterministic(node.domain(), node.op_type()) &&
-        !IsQDQ(node.domain(), node.op_type()) &&
+    if (IsFoldableOp(node) &&
         !HasSubgraph(node) &&
-        !ProduceLargeTensor(model, node, config.tensor_size_threshold) &&
+        !ProduceLargeTensor(value_infos, node, ctx.tensor_size_threshold) &&
         // clang-format on
         std::all_of(node.input().begin(), node.input().end(),
                     [&const_names](const auto& x) {
-                      return std::find(const_names.begin(), const_names.end(),
-                                       x) != const_names.end();
+                      return const_names.find(x) != const_names.end();
                     })) {
-      const_names.insert(const_names.end(), node.output().begin(),
-                         node.output().end());
+      const_names.insert(node.output().begin(), node.output().end());
       const_nodes.push_back(node);
     } else {
       non_const_nodes.push_back(node);
     }
   }
-  return {const_nodes, non_const_nodes};
+  return {std::move(const_nodes), std::move(non_const_nodes)};
+}
+
+size_t HashCombine(size_t seed, size_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+}
+
+template <typename M>
+size_t HashMessage(const M& message) {
+  return std::hash<std::string>{}(message.SerializeAsString());
+}
+
+onnx::ModelProto _InferShapes(onnx::ModelProto model) {
+  onnx::shape_inference::InferShapes(model);
+  return model;
+}
+
+// Reruns shape inference only on the nodes that changed since the previous
+// run, i.e. the nodes that are new or whose input types changed, and on the
+// nodes downstream of them. The value_info of the other nodes is reused.
+// Falls back to inferring the whole model on the first run, when most of the
+// graph changed, or when a changed node has subgraphs (which may read any
+// outer scope tensor).
+class IncrementalShapeInference {
+ public:
+  onnx::ModelProto operator()(onnx::ModelProto model) {
+    const auto& graph = model.graph();
+    std::vector<const onnx::NodeProto*> dirty_nodes;
+    bool full = !initialized_ || model.functions_size() > 0;
+    if (!full) {
+      const auto type_hashes = GetTypeHashes(model);
+      std::unordered_set<std::string> changed;
+      for (const auto& node : graph.node()) {
+        bool dirty = node_hashes_.find(HashMessage(node)) == node_hashes_.end();
+        for (const auto& x : node.input()) {
+          if (dirty || x.empty()) {
+            continue;
+          }
+          const auto it1 = type_hashes.find(x);
+          const auto it2 = type_hashes_.find(x);
+          dirty = changed.find(x) != changed.end() ||
+                  (it1 == type_hashes.end()) != (it2 == type_hashes_.end()) ||
+                  (it1 != type_hashes.end() && it1->second != it2->second);
+        }
+        if (dirty) {
+          changed.insert(node.output().begin(), node.output().end());
+          dirty_nodes.push_back(&node);
+          full |= HasSubgraph(node);
+        }
+      }
+      full |= dirty_nodes.size() * 2 > static_cast<size_t>(graph.node_size());
+    }
+    if (full) {
+      onnx::shape_inference::InferShapes(model);
+    } else if (!dirty_nodes.empty()) {
+      InferDirtyNodes(model, dirty_nodes);
+    }
+    Record(model);
+    return model;
+  }
+
+ private:
+  // initializers up to this size are passed to the inference of the dirty
+  // nodes as initializers rather than as typed inputs, so that the inference
+  // can read shapes, axes etc. from them
+  static constexpr int64_t kMaxConstantInputElements = 1024;
+
+  static std::unordered_map<std::string, size_t> GetTypeHashes(
+      const onnx::ModelProto& model) {
+    const auto& graph = model.graph();
+    std::unordered_map<std::string, size_t> hashes;
+    for (const auto& x : graph.value_info()) {
+      hashes.emplace(x.name(), HashMessage(x.type()));
+    }
+    for (const auto& x : graph.input()) {
+      hashes[x.name()] = HashMessage(x.type());
+    }
+    for (const auto& x : graph.initializer()) {
+      size_t hash = HashMessage(ValueInfoFromInitializer(x).type());
+      // the inference may read the values of small initializers
+      if (NumElements(x) <= kMaxConstantInputElements) {
+        hash = HashCombine(hash, HashMessage(x));
+      }
+      hashes[x.name()] = hash;
+    }
+    return hashes;
+  }
+
+  static int64_t NumElements(const onnx::TensorProto& tensor) {
+    return std::accumulate(tensor.dims().begin(), tensor.dims().end(),
+                           int64_t{1}, std::multiplies<int64_t>());
+  }
+
+  void Record(const onnx::ModelProto& model) {
+    node_hashes_.clear();
+    for (const auto& node : model.graph().node()) {
+      node_hashes_.insert(HashMessage(node));
+    }
+    type_hashes_ = GetTypeHashes(model);
+    initialized_ = true;
+  }
+
+  static void InferDirtyNodes(
+      onnx::ModelProto& model,
+      const std::vector<const onnx::NodeProto*>& dirty_nodes) {
+    auto* graph = model.mutable_graph();
+    TensorIndex index(model);
+    std::unordered_map<std::string, const onnx::NodeProto*> producers;
+    for (const auto& node : graph->node()) {
+      for (const auto& x : node.output()) {
+        producers.emplace(x, &node);
+      }
+    }
+    std::unordered_set<std::string> dirty_outputs;
+    for (const auto* node : dirty_nodes) {
+      dirty_outputs.insert(node->output().begin(), node->output().end());
+    }
+
+    onnx::ModelProto sub_model;
+    sub_model.set_ir_version(model.ir_version());
+    *sub_model.mutable_opset_import() = model.opset_import();
+    auto* sub_graph = sub_model.mutable_graph();
+    std::unordered_set<std::string> added;
+    for (const auto* node : dirty_nodes) {
+      for (const auto& x : node->input()) {
+        if (x.empty() || dirty_outputs.find(x) != dirty_outputs.end() ||
+            !added.insert(x).second) {
+          continue;
+        }
+        const auto it = producers.find(x);
+        if (it != producers.end() && it->second->op_type() == "Constant") {
+          *sub_graph->add_node() = *it->second;
+          continue;
+        }
+        try {
+          const auto& initializer = index.FindInitializer(x);
+          if (NumElements(initializer) <= kMaxConstantInputElements) {
+            *sub_graph->add_initializer() = initializer;
+            continue;
+          }
+        } catch (const std::invalid_argument&) {
+        }
+        try {
+          *sub_graph->add_input() = index.FindValueInfo(x);
+        } catch (const std::invalid_argument&) {
+          // no type is known, the inference treats it as unknown
+        }
+      }
+      *sub_graph->add_node() = *node;
+    }
+    onnx::shape_inference::InferShapes(sub_model);
+
+    // drop the stale value_info of the dirty outputs and merge in the new one
+    auto* value_infos = graph->mutable_value_info();
+    value_infos->erase(
+        std::remove_if(value_infos->begin(), value_infos->end(),
+                       [&dirty_outputs](const auto& x) {
+                         return dirty_outputs.find(x.name()) !=
+                                dirty_outputs.end();
+                       }),
+        value_infos->end());
+    std::unordered_map<std::string, onnx::ValueInfoProto*> outputs;
+    for (auto& x : *graph->mutable_output()) {
+      outputs.emplace(x.name(), &x);
+    }
+    for (auto& vi : *sub_graph->mutable_value_info()) {
+      if (dirty_outputs.find(vi.name()) == dirty_outputs.end()) {
+        continue;
+      }
+      if (const auto it = outputs.find(vi.name()); it != outputs.end()) {
+        // like the full inference, fills in the dims the output does not
+        // declare and keeps the ones it does, also when they conflict
+        auto* type = it->second->mutable_type();
+        if (type->has_tensor_type() && vi.type().has_tensor_type()) {
+          auto merged = type->tensor_type();
+          try {
+            onnx::mergeInShapeInfo(vi.type().tensor_type(), merged);
+            *type->mutable_tensor_type() = std::move(merged);
+          } catch (const onnx::InferenceError&) {
+          }
+        } else if (!type->has_tensor_type()) {
+          *type = std::move(*vi.mutable_type());
+        }
+        continue;
+      }
+      *graph->add_value_info() = std::move(vi);
+    }
+  }
+
+  bool initialized_ = false;
+  std::unordered_set<size_t> node_hashes_;
+  std::unordered_map<std::string, size_t> type_hashes_;
+};
+
+// Collects the names of the tensors read by `node`, including the outer
+// scope tensors read by the nodes of its subgraphs.
+void AddConsumedNames(const onnx::NodeProto& node,
+                      std::unordered_set<std::string>& names) {
+  names.insert(node.input().begin(), node.input().end());
+  for (const auto& attr : node.attribute()) {
+    if (attr.has_g()) {
+      for (const auto& x : attr.g().node()) {
+        AddConsumedNames(x, names);
+      }
+    }
+    for (const auto& g : attr.graphs()) {
+      for (const auto& x : g.node()) {
+        AddConsumedNames(x, names);
+      }
+    }
+  }
+}
+
+// Splits `const_nodes` into connected regions, i.e. the groups of nodes
+// linked by the tensors they produce and consume. Each region keeps the
+// topological order of `const_nodes`.
+std::vector<std::vector<const onnx::NodeProto*>> GetConstantRegions(
+    const std::vector<onnx::NodeProto>& const_nodes) {
+  std::vector<size_t> parent(const_nodes.size());
+  std::iota(parent.begin(), parent.end(), 0);
+  const auto find = [&parent](size_t i) {
+    while (parent[i] != i) {
+      i = parent[i] = parent[parent[i]];
+    }
+    return i;
+  };
+  std::unordered_map<std::string, size_t> producers;
+  for (size_t i = 0; i < const_nodes.size(); i++) {
+    for (const auto& input : const_nodes[i].input()) {
+      if (const auto it = producers.find(input); it != producers.end()) {
+        parent[find(it->second)] = find(i);
+      }
+    }
+    for (const auto& output : const_nodes[i].output()) {
+      producers[output] = i;
+    }
+  }
+  std::vector<std::vector<const onnx::NodeProto*>> regions;
+  std::unordered_map<size_t, size_t> region_of_root;
+  for (size_t i = 0; i < const_nodes.size(); i++) {
+    const auto [it, inserted] =
+        region_of_root.emplace(find(i), regions.size());
+    if (inserted) {
+      regions.emplace_back();
+    }
+    regions[it->second].push_back(&const_nodes[i]);
+  }
+  return regions;
+}
+
+struct TaskGraphState {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<size_t> pending_deps;
+  std::vector<std::vector<size_t>> dependents;
+  size_t num_done = 0;
+  std::exception_ptr error;
+};
+
+void SubmitTask(ThreadPool& pool, const std::function<void(size_t)>& task,
+                const std::shared_ptr<TaskGraphState>& state, size_t i) {
+  pool.Submit([&pool, &task, state, i]() {
+    try {
+      task(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (!state->error) {
+        state->error = std::current_exception();
+      }
+    }
+    std::vector<size_t> ready;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      for (const auto j : state->dependents[i]) {
+        if (--state->pending_deps[j] == 0) {
+          ready.push_back(j);
+        }
+      }
+      if (++state->num_done == state->pending_deps.size()) {
+        state->cv.notify_all();
+      }
+    }
+    for (const auto j : ready) {
+      SubmitTask(pool, task, state, j);
+    }
+  });
+}
+
+// Runs task(i) for every i in [0, deps.size()), where deps[i] lists the tasks
+// that have to finish before task i starts and only refers to tasks before i.
+// The tasks run on `pool` as soon as they are ready, or in order on the
+// calling thread if `pool` is null. Blocks until all tasks are done and
+// rethrows the first exception thrown by a task.
+void RunTaskGraph(ThreadPool* pool,
+                  const std::vector<std::vector<size_t>>& deps,
+                  const std::function<void(size_t)>& task) {
+  if (pool == nullptr) {
+    for (size_t i = 0; i < deps.size(); i++) {
+      task(i);
+    }
+    return;
+  }
+  if (deps.empty()) {
+    return;
+  }
+  auto state = std::make_shared<TaskGraphState>();
+  state->dependents.resize(deps.size());
+  for (size_t i = 0; i < deps.size(); i++) {
+    state->pending_deps.push_back(deps[i].size());
+    for (const auto j : deps[i]) {
+      state->dependents[j].push_back(i);
+    }
+  }
+  // collect the initially ready tasks first, a submitted task may already
+  // decrement pending_deps of the others
+  std::vector<size_t> ready;
+  for (size_t i = 0; i < deps.size(); i++) {
+    if (deps[i].empty()) {
+      ready.push_back(i);
+    }
+  }
+  for (const auto i : ready) {
+    SubmitTask(*pool, task, state, i);
+  }
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->cv.wait(lock, [&state, &deps]() {
+    return state->num_done == deps.size();
+  });
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+}
+
+void ThrowIfCancelled(const SimplifyContext& ctx) {
+  if (ctx.is_cancelled && ctx.is_cancelled()) {
+    throw SimplifyCancelled();
+  }
+}
+
+// Adds to the progress of the call and reports it.
+void ReportProgress(const SimplifyContext& ctx, size_t iterations,
+                    size_t nodes,
+                    const std::vector<onnx::TensorProto>& tensors) {
+  if (!ctx.on_progress) {
+    return;
+  }
+  size_t bytes = 0;
+  for (const auto& x : tensors) {
+    bytes += x.ByteSizeLong();
+  }
+  auto& [mutex, progress] = *ctx.progress;
+  std::lock_guard<std::mutex> lock(mutex);
+  progress.iteration += iterations;
+  progress.nodes_folded += nodes;
+  progress.bytes_folded += bytes;
+  ctx.on_progress(progress);
+}
+
+// Gives `message` to the on_warning of `ctx`, or prints it to `os`.
+void Warn(const SimplifyContext& ctx, std::ostream& os,
+          const std::string& message) {
+  if (ctx.on_warning) {
+    ctx.on_warning(message);
+  } else {
+    os << "WARNING: " << message << std::endl;
+  }
+}
+
+void WarnFailedNode(const SimplifyContext& ctx, const onnx::NodeProto& node) {
+  Warn(ctx, std::cerr,
+       "failed to run \"" + node.op_type() + "\" op (name is \"" +
+           node.name() + "\"), skip...");
+}
+
+// Runs the constant nodes and adds all their outputs to the initializers.
+// With the thread pool of `ctx`, every node runs as soon as the nodes
+// producing its inputs are done, and nodes of independent chains run
+// concurrently. The outputs are added in the order of `const_nodes` after
+// all nodes ran, so the result does not depend on the scheduling. The nodes
+// that cannot be run are appended to `failed_nodes`.
+void FoldNodes(onnx::ModelProto& model, TensorIndex& index,
+               const std::vector<const onnx::NodeProto*>& const_nodes,
+               std::vector<onnx::NodeProto>& failed_nodes,
+               const SimplifyContext& ctx) {
+  std::unordered_map<std::string, size_t> producers;
+  std::vector<std::vector<size_t>> deps(const_nodes.size());
+  for (size_t i = 0; i < const_nodes.size(); i++) {
+    for (const auto& input : const_nodes[i]->input()) {
+      if (const auto it = producers.find(input); it != producers.end()) {
+        deps[i].push_back(it->second);
+      }
+    }
+    std::sort(deps[i].begin(), deps[i].end());
+    deps[i].erase(std::unique(deps[i].begin(), deps[i].end()), deps[i].end());
+    for (const auto& output : const_nodes[i]->output()) {
+      producers[output] = i;
+    }
+  }
+
+  std::vector<std::vector<onnx::TensorProto>> results(const_nodes.size());
+  // not std::vector<bool>, whose elements cannot be written concurrently
+  std::vector<char> failed(const_nodes.size(), false);
+  RunTaskGraph(ctx.thread_pool.get(), deps, [&](size_t i) {
+    // `index` is only read while the nodes run, the outputs of the nodes
+    // this one depends on are seen through a local overlay
+    TensorIndex local_index(&index);
+    for (const auto j : deps[i]) {
+      for (const auto& x : results[j]) {
+        local_index.AddInitializer(x);
+      }
+    }
+    ThrowIfCancelled(ctx);
+    try {
+      results[i] = FoldOp(model, local_index, *const_nodes[i], ctx);
+    } catch (const std::exception& e) {
+      failed[i] = true;
+      return;
+    }
+    ReportProgress(ctx, 0, 1, results[i]);
+  });
+  for (size_t i = 0; i < const_nodes.size(); i++) {
+    if (failed[i]) {
+      WarnFailedNode(ctx, *const_nodes[i]);
+      failed_nodes.push_back(*const_nodes[i]);
+    } else {
+      AddInitializers(model, index, std::move(results[i]));
+    }
+  }
 }
 
-onnx::ModelProto _InferShapes(const onnx::ModelProto& model) {
-  onnx::ModelProto result;
-  result.CopyFrom(model);
-  onnx::shape_inference::InferShapes(result);
-  return result;
+// Runs each connected region of constant nodes as a single model and only
+// adds the outputs read by non-constant nodes or graph outputs to the
+// initializers, the intermediate tensors of a region are never
+// materialized. Regions are independent, so with the thread pool of `ctx`
+// they all run concurrently.
+void FoldConstantRegions(onnx::ModelProto& model, TensorIndex& index,
+                         const std::vector<onnx::NodeProto>& const_nodes,
+                         const std::vector<onnx::NodeProto>& non_const_nodes,
+                         std::vector<onnx::NodeProto>& failed_nodes,
+                         const SimplifyContext& ctx) {
+  std::unordered_set<std::string> consumed_names;
+  for (const auto& x : non_const_nodes) {
+    AddConsumedNames(x, consumed_names);
+  }
+  for (const auto& x : model.graph().output()) {
+    consumed_names.insert(x.name());
+  }
+  std::vector<std::vector<const onnx::NodeProto*>> regions;
+  std::vector<std::vector<std::string>> region_output_names;
+  for (auto& region : GetConstantRegions(const_nodes)) {
+    std::vector<std::string> output_names;
+    for (const auto* x : region) {
+      for (const auto& output : x->output()) {
+        if (consumed_names.find(output) != consumed_names.end()) {
+          output_names.push_back(output);
+        }
+      }
+    }
+    // nothing outside of the region reads it
+    if (output_names.empty()) {
+      continue;
+    }
+    regions.push_back(std::move(region));
+    region_output_names.push_back(std::move(output_names));
+  }
+
+  std::vector<std::vector<onnx::TensorProto>> results(regions.size());
+  std::vector<char> failed(regions.size(), false);
+  RunTaskGraph(ctx.thread_pool.get(),
+               std::vector<std::vector<size_t>>(regions.size()),
+               [&](size_t i) {
+                 ThrowIfCancelled(ctx);
+                 try {
+                   if (auto outputs = RunNodesNatively(
+                           index, regions[i], region_output_names[i])) {
+                     native_folds += regions[i].size();
+                     results[i] = std::move(*outputs);
+                   } else {
+                     results[i] = RunNodes(model, index, regions[i],
+                                           region_output_names[i],
+                                           ctx.executor.get());
+                     executor_folds += regions[i].size();
+                   }
+                 } catch (const std::exception& e) {
+                   failed[i] = true;
+                   return;
+                 }
+                 ReportProgress(ctx, 0, regions[i].size(), results[i]);
+               });
+  for (size_t i = 0; i < regions.size(); i++) {
+    if (failed[i]) {
+      // fold the region node by node so that only the failing nodes are kept
+      FoldNodes(model, index, regions[i], failed_nodes, ctx);
+    } else {
+      AddInitializers(model, index, std::move(results[i]));
+    }
+  }
 }
 
-onnx::ModelProto _FoldConstant(const onnx::ModelProto& model) {
-  const auto& tmp = model;
+onnx::ModelProto _FoldConstant(onnx::ModelProto model,
+                               const SimplifyContext& ctx, bool* changed) {
   {
-    onnx::ModelProto model;
-    model.CopyFrom(tmp);
-    auto [const_nodes, non_const_nodes] = GetConstantNodes(model);
-    for (const auto& x : const_nodes) {
-      try {
-        RunOpAndAddInitializer(model, x);
-      } catch (const std::exception& e) {
-        std::cerr << "WARNING: failed to run \"" << x.op_type() <<
-          "\" op (name is \"" << x.name() << "\"), skip..." << std::endl;
-        non_const_nodes.push_back(x);
-      }
-    }
-    model.mutable_graph()->clear_node();
+    auto [const_nodes, non_const_nodes] = GetConstantNodes(model, ctx);
+    if (ctx.external_data) {
+      // only the data of the initializers being folded is read
+      std::unordered_set<std::string> consumed_names;
+      for (const auto& x : const_nodes) {
+        AddConsumedNames(x, consumed_names);
+      }
+      for (auto& x : *model.mutable_graph()->mutable_initializer()) {
+        if (consumed_names.count(x.name()) > 0) {
+          ctx.external_data->Load(x);
+        }
+      }
+    }
+    TensorIndex index(model);
+    std::vector<onnx::NodeProto> failed_nodes;
+    if (ctx.fold_constant_regions) {
+      FoldConstantRegions(model, index, const_nodes, non_const_nodes,
+                          failed_nodes, ctx);
+    } else {
+      std::vector<const onnx::NodeProto*> nodes;
+      for (const auto& x : const_nodes) {
+        nodes.push_back(&x);
+      }
+      FoldNodes(model, index, nodes, failed_nodes, ctx);
+    }
+    google::protobuf::RepeatedPtrField<onnx::NodeProto> old_nodes;
+    old_nodes.Swap(model.mutable_graph()->mutable_node());
+    // the failed nodes only depend on initializers and on each other, so
+    // putting them first keeps the graph topologically sorted
+    for (const auto& x : failed_nodes) {
+      *model.mutable_graph()->add_node() = x;
+    }
     for (const auto& x : non_const_nodes) {
       *model.mutable_graph()->add_node() = x;
     }
+    // with nothing folded, the model only changed if the failed nodes
+    // were not first already
+    const auto& nodes = model.graph().node();
+    *changed |= nodes.size() != old_nodes.size() ||
+                !std::equal(nodes.begin(), nodes.end(), old_nodes.begin(),
+                            [](const auto& a, const auto& b) {
+                              return a.SerializeAsString() ==
+                                     b.SerializeAsString();
+                            });
     return model;
   }
 }
 
-onnx::ModelProto Optimize(const onnx::ModelProto& model) {
-  return onnx::optimization::OptimizeFixed(model, config.optimizer_passes);
+// Removes the nodes whose outputs are neither graph outputs nor consumed by
+// other nodes, in reverse topological order so that whole dead chains go.
+void RemoveDeadNodes(onnx::ModelProto& model) {
+  auto* graph = model.mutable_graph();
+  std::unordered_set<std::string> consumed_names;
+  for (const auto& x : graph->output()) {
+    consumed_names.insert(x.name());
+  }
+  std::vector<bool> alive(graph->node_size());
+  for (int i = graph->node_size() - 1; i >= 0; i--) {
+    const auto& node = graph->node(i);
+    alive[i] = !IsDeterministic(node.domain(), node.op_type()) ||
+               std::any_of(node.output().begin(), node.output().end(),
+                           [&consumed_names](const auto& x) {
+                             return consumed_names.count(x) > 0;
+                           });
+    if (alive[i]) {
+      AddConsumedNames(node, consumed_names);
+    }
+  }
+  google::protobuf::RepeatedPtrField<onnx::NodeProto> nodes;
+  for (int i = 0; i < graph->node_size(); i++) {
+    if (alive[i]) {
+      *nodes.Add() = std::move(*graph->mutable_node(i));
+    }
+  }
+  graph->mutable_node()->Swap(&nodes);
+}
+
+onnx::ModelProto _FoldSymbolicShapes(onnx::ModelProto model, bool* changed) {
+  if (FoldSymbolicShapes(model)) {
+    RemoveDeadNodes(model);
+    *changed = true;
+  }
+  return model;
+}
+
+// Calls `f` with each name that `graph` defines itself: its inputs,
+// initializers and node outputs. In a subgraph they shadow the names of the
+// outer graphs.
+template <typename F>
+void ForEachLocalName(const onnx::GraphProto& graph, F f) {
+  for (const auto& x : graph.input()) {
+    f(x.name());
+  }
+  for (const auto& x : graph.initializer()) {
+    f(x.name());
+  }
+  for (const auto& x : graph.sparse_initializer()) {
+    f(x.values().name());
+  }
+  for (const auto& node : graph.node()) {
+    for (const auto& x : node.output()) {
+      f(x);
+    }
+  }
+}
+
+// Adds the local names of all the subgraphs of `node`, at any depth.
+void AddSubgraphNames(const onnx::NodeProto& node,
+                      std::unordered_set<std::string>& names) {
+  const auto AddNames = [&names](const onnx::GraphProto& graph) {
+    ForEachLocalName(graph, [&names](const auto& x) { names.insert(x); });
+    for (const auto& x : graph.node()) {
+      AddSubgraphNames(x, names);
+    }
+  };
+  for (const auto& attr : node.attribute()) {
+    if (attr.has_g()) {
+      AddNames(attr.g());
+    }
+    for (const auto& g : attr.graphs()) {
+      AddNames(g);
+    }
+  }
 }
 
+void RenameInputs(onnx::NodeProto& node,
+                  const std::unordered_map<std::string, std::string>& names);
+
+// Renames the inputs of the nodes of a subgraph, except the names the
+// subgraph defines itself.
+void RenameInputs(onnx::GraphProto& graph,
+                  const std::unordered_map<std::string, std::string>& names) {
+  std::optional<std::unordered_map<std::string, std::string>> outer_names;
+  ForEachLocalName(graph, [&](const auto& x) {
+    if (names.count(x) > 0) {
+      if (!outer_names) {
+        outer_names = names;
+      }
+      outer_names->erase(x);
+    }
+  });
+  for (auto& x : *graph.mutable_node()) {
+    RenameInputs(x, outer_names ? *outer_names : names);
+  }
+}
+
+// Replaces the inputs of `node` and of the nodes in its subgraphs according
+// to `names`.
+void RenameInputs(onnx::NodeProto& node,
+                  const std::unordered_map<std::string, std::string>& names) {
+  for (auto& x : *node.mutable_input()) {
+    if (const auto it = names.find(x); it != names.end()) {
+      x = it->second;
+    }
+  }
+  for (auto& attr : *node.mutable_attribute()) {
+    if (attr.has_g()) {
+      RenameInputs(*attr.mutable_g(), names);
+    }
+    for (auto& g : *attr.mutable_graphs()) {
+      RenameInputs(g, names);
+    }
+  }
+}
+
+// Merges the initializers with the same dtype, dims and data, e.g. the many
+// [0] or [-1] tensors produced by constant folding, and points the
+// consumers of the removed ones to the kept one. The data of each
+// initializer is hashed once and only compared byte by byte with the
+// initializers of the same hash, so this is linear in the total size.
+// Initializers that are also graph inputs or outputs keep their names, and
+// no consumer is pointed to a name that a subgraph shadows.
+void DeduplicateInitializers(onnx::ModelProto& model) {
+  auto* graph = model.mutable_graph();
+  std::unordered_set<std::string_view> io_names;
+  for (const auto& x : graph->input()) {
+    io_names.insert(x.name());
+  }
+  for (const auto& x : graph->output()) {
+    io_names.insert(x.name());
+  }
+  std::unordered_set<std::string> subgraph_names;
+  for (const auto& x : graph->node()) {
+    AddSubgraphNames(x, subgraph_names);
+  }
+  // the data of the typed (not raw) initializers, serialized
+  std::vector<std::string> typed_data(graph->initializer_size());
+  const auto GetData = [&](int i) -> std::string_view {
+    const auto& tensor = graph->initializer(i);
+    if (tensor.has_raw_data()) {
+      return tensor.raw_data();
+    }
+    if (typed_data[i].empty()) {
+      onnx::TensorProto copy = tensor;
+      copy.clear_name();
+      copy.clear_doc_string();
+      typed_data[i] = copy.SerializeAsString();
+    }
+    return typed_data[i];
+  };
+  const auto IsSame = [&](int i, int j) {
+    const auto& a = graph->initializer(i);
+    const auto& b = graph->initializer(j);
+    return a.data_type() == b.data_type() &&
+           a.has_raw_data() == b.has_raw_data() &&
+           std::equal(a.dims().begin(), a.dims().end(), b.dims().begin(),
+                      b.dims().end()) &&
+           GetData(i) == GetData(j);
+  };
+
+  // the initializers named like graph inputs or outputs go first so that
+  // they are the ones kept
+  std::vector<int> order(graph->initializer_size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_partition(order.begin(), order.end(), [&](int i) {
+    return io_names.count(graph->initializer(i).name()) > 0;
+  });
+  std::unordered_map<size_t, std::vector<int>> kept;
+  std::unordered_map<std::string, std::string> renamed;
+  std::vector<bool> removed(graph->initializer_size());
+  for (const int i : order) {
+    const auto& tensor = graph->initializer(i);
+    if (tensor.data_location() == onnx::TensorProto::EXTERNAL) {
+      continue;
+    }
+    size_t hash = std::hash<std::string_view>{}(GetData(i));
+    hash = HashCombine(hash, tensor.data_type());
+    for (const auto dim : tensor.dims()) {
+      hash = HashCombine(hash, dim);
+    }
+    auto& candidates = kept[hash];
+    const auto it = std::find_if(candidates.begin(), candidates.end(),
+                                 [&](int j) { return IsSame(i, j); });
+    if (it == candidates.end()) {
+      candidates.push_back(i);
+    } else if (io_names.count(tensor.name()) == 0 &&
+               subgraph_names.count(graph->initializer(*it).name()) == 0) {
+      renamed[tensor.name()] = graph->initializer(*it).name();
+      removed[i] = true;
+    }
+  }
+  if (renamed.empty()) {
+    return;
+  }
+
+  for (auto& node : *graph->mutable_node()) {
+    RenameInputs(node, renamed);
+  }
+  google::protobuf::RepeatedPtrField<onnx::TensorProto> initializers;
+  for (int i = 0; i < graph->initializer_size(); i++) {
+    if (!removed[i]) {
+      *initializers.Add() = std::move(*graph->mutable_initializer(i));
+    }
+  }
+  graph->mutable_initializer()->Swap(&initializers);
+  auto* value_info = graph->mutable_value_info();
+  value_info->erase(
+      std::remove_if(value_info->begin(), value_info->end(),
+                     [&renamed](const auto& x) {
+                       return renamed.count(x.name()) > 0;
+                     }),
+      value_info->end());
+}
+
+// The serialized model without its initializers. Swapping them out costs
+// nothing, so this is proportional to the size of the graph, not of the
+// weights.
+std::string SerializeWithoutInitializers(onnx::ModelProto& model) {
+  google::protobuf::RepeatedPtrField<onnx::TensorProto> initializers;
+  initializers.Swap(model.mutable_graph()->mutable_initializer());
+  auto bytes = model.SerializeAsString();
+  initializers.Swap(model.mutable_graph()->mutable_initializer());
+  return bytes;
+}
+
+// Whether two tensors are equal, comparing the raw data in place.
+bool SameTensor(onnx::TensorProto& a, onnx::TensorProto& b) {
+  if (a.has_raw_data() != b.has_raw_data()) {
+    return false;
+  }
+  if (!a.has_raw_data()) {
+    return a.SerializeAsString() == b.SerializeAsString();
+  }
+  if (a.raw_data() != b.raw_data()) {
+    return false;
+  }
+  std::string a_data, b_data;
+  a.mutable_raw_data()->swap(a_data);
+  b.mutable_raw_data()->swap(b_data);
+  const bool same = a.SerializeAsString() == b.SerializeAsString();
+  a.mutable_raw_data()->swap(a_data);
+  b.mutable_raw_data()->swap(b_data);
+  return same;
+}
+
+bool SameModel(onnx::ModelProto& a, onnx::ModelProto& b) {
+  auto& a_initializers = *a.mutable_graph()->mutable_initializer();
+  auto& b_initializers = *b.mutable_graph()->mutable_initializer();
+  if (a_initializers.size() != b_initializers.size() ||
+      SerializeWithoutInitializers(a) != SerializeWithoutInitializers(b)) {
+    return false;
+  }
+  for (int i = 0; i < a_initializers.size(); i++) {
+    if (!SameTensor(a_initializers[i], b_initializers[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Moves the initializers whose data is still in the external files out of
+// `model` and declares them as graph inputs instead, so that the optimizer
+// passes computing on the weights (e.g. fuse_bn_into_conv) leave them alone
+// rather than reading them as empty tensors.
+std::vector<onnx::TensorProto> HideExternalInitializers(
+    onnx::ModelProto& model) {
+  auto* graph = model.mutable_graph();
+  std::unordered_set<std::string> input_names;
+  for (const auto& x : graph->input()) {
+    input_names.insert(x.name());
+  }
+  std::vector<onnx::TensorProto> hidden;
+  auto* initializers = graph->mutable_initializer();
+  int num_kept = 0;
+  for (int i = 0; i < initializers->size(); i++) {
+    auto* x = initializers->Mutable(i);
+    if (x->data_location() != onnx::TensorProto::EXTERNAL) {
+      initializers->SwapElements(num_kept++, i);
+      continue;
+    }
+    // the initializers that are graph inputs too are declared already
+    if (input_names.count(x->name()) == 0) {
+      auto* input = graph->add_input();
+      *input = ValueInfoFromInitializer(*x);
+      input->set_name(x->name());
+    }
+    hidden.push_back(std::move(*x));
+  }
+  initializers->DeleteSubrange(num_kept, initializers->size() - num_kept);
+  return hidden;
+}
+
+// Undoes HideExternalInitializers on the optimized model, whose first
+// `num_inputs` inputs are the original ones. The initializers the optimizer
+// made unused are dropped.
+void RestoreExternalInitializers(onnx::ModelProto& model,
+                                 std::vector<onnx::TensorProto>&& hidden,
+                                 int num_inputs) {
+  auto* graph = model.mutable_graph();
+  graph->mutable_input()->DeleteSubrange(
+      num_inputs, graph->input_size() - num_inputs);
+  std::unordered_set<std::string> used_names;
+  for (const auto& x : graph->node()) {
+    AddConsumedNames(x, used_names);
+  }
+  for (const auto& x : graph->input()) {
+    used_names.insert(x.name());
+  }
+  for (const auto& x : graph->output()) {
+    used_names.insert(x.name());
+  }
+  for (auto& x : hidden) {
+    if (used_names.count(x.name()) > 0) {
+      *graph->add_initializer() = std::move(x);
+    }
+  }
+}
+
+// The optimizer builds a new model, so whether it changed anything is only
+// known by comparing the two. This is the only pass that may change the data
+// of existing initializers.
+onnx::ModelProto Optimize(onnx::ModelProto model, const SimplifyContext& ctx,
+                          bool* changed) {
+  std::vector<onnx::TensorProto> hidden;
+  const int num_inputs = model.graph().input_size();
+  if (ctx.external_data) {
+    hidden = HideExternalInitializers(model);
+  }
+  auto optimized =
+      onnx::optimization::OptimizeFixed(model, ctx.optimizer_passes);
+  *changed |= !SameModel(model, optimized);
+  if (!hidden.empty()) {
+    RestoreExternalInitializers(optimized, std::move(hidden), num_inputs);
+  }
+  return optimized;
+}
+
+// Makes a pass that never touches the initializers, like shape inference,
+// tell whether it changed the rest of the model.
+std::function<onnx::ModelProto(onnx::ModelProto, bool*)> ReportingChanges(
+    std::function<onnx::ModelProto(onnx::ModelProto)> f) {
+  return [f](onnx::ModelProto model, bool* changed) {
+    const auto before = SerializeWithoutInitializers(model);
+    model = f(std::move(model));
+    *changed |= SerializeWithoutInitializers(model) != before;
+    return model;
+  };
+}
+
+// The passes take and return the model by value, so each step moves the
+// single live model through the passes instead of copying it. Each pass sets
+// its flag when it changed the model, and the iteration stops at the first
+// step that changed nothing, so no previous model has to be kept around.
+// The returned function sets its flag if any of the steps changed the model.
 template <typename T>
-std::function<T(const T&)> FixedPointFn(const std::function<T(const T&)>& f1,
-                                        const std::function<T(const T&)>& f2,
+std::function<T(T, bool*)> FixedPointFn(const std::function<T(T, bool*)>& f1,
+                                        const std::function<T(T, bool*)>& f2,
                                         size_t max_iters, bool* converged) {
-  return [f1, f2, max_iters, converged](const T& x) {
+  return [f1, f2, max_iters, converged](T x, bool* changed) {
     size_t _max_iters = max_iters;
-    T tmp1 = f1(x);
-    T tmp2 = f2(tmp1);
-    T& y1 = tmp1;
-    T& y2 = tmp2;
+    bool step_changed = false;
+    const auto Step = [&x, &step_changed, changed](const auto& f) {
+      step_changed = false;
+      x = f(std::move(x), &step_changed);
+      *changed |= step_changed;
+    };
+    Step(f1);
+    Step(f2);
     while (_max_iters-- > 0) {
-      if (google::protobuf::util::MessageDifferencer::Equals(y1, y2)) {
+      if (!step_changed) {
         if (converged) {
           *converged = true;
         }
-        return y2;
+        return x;
       }
-      y1 = f1(y2);
-      if (google::protobuf::util::MessageDifferencer::Equals(y1, y2)) {
+      Step(f1);
+      if (!step_changed) {
         if (converged) {
           *converged = true;
         }
-        return y1;
+        return x;
       }
-      y2 = f2(y1);
+      Step(f2);
     }
 
     if (converged) {
       *converged = false;
     }
-    return y2;
+    return x;
   };
 }
 
 template <typename T>
-std::function<T(const T&)> FixedPointFn(const std::function<T(const T&)>& f1,
-                                        const std::function<T(const T&)>& f2,
+std::function<T(T, bool*)> FixedPointFn(const std::function<T(T, bool*)>& f1,
+                                        const std::function<T(T, bool*)>& f2,
                                         size_t max_iters) {
   return FixedPointFn(f1, f2, max_iters, nullptr);
 }
 
-onnx::ModelProto Identity(const onnx::ModelProto& model) { return model; }
+onnx::ModelProto Identity(onnx::ModelProto model, bool*) { return model; }
 
-void Check(const onnx::ModelProto& model) { onnx::checker::check_model(model); }
+// The checker looks for external data files relative to the working
+// directory, so the initializers left in the files by the memory-mapped
+// loading are checked as empty tensors. Their data is validated by the
+// store when it is read.
+void Check(onnx::ModelProto& model, const SimplifyContext& ctx) {
+  if (ctx.external_data == nullptr) {
+    onnx::checker::check_model(model);
+    return;
+  }
+  // the dims and external_data of the external initializers
+  std::vector<std::pair<onnx::TensorProto*, onnx::TensorProto>> stashed;
+  for (auto& x : *model.mutable_graph()->mutable_initializer()) {
+    if (x.data_location() == onnx::TensorProto::EXTERNAL) {
+      onnx::TensorProto meta;
+      meta.mutable_dims()->Swap(x.mutable_dims());
+      meta.mutable_external_data()->Swap(x.mutable_external_data());
+      x.clear_data_location();
+      x.add_dims(0);
+      stashed.emplace_back(&x, std::move(meta));
+    }
+  }
+  const auto Restore = [&stashed]() {
+    for (auto& [x, meta] : stashed) {
+      x->mutable_dims()->Swap(meta.mutable_dims());
+      x->mutable_external_data()->Swap(meta.mutable_external_data());
+      x->set_data_location(onnx::TensorProto::EXTERNAL);
+    }
+  };
+  try {
+    onnx::checker::check_model(model);
+  } catch (...) {
+    Restore();
+    throw;
+  }
+  Restore();
+}
 
-onnx::ModelProto Simplify(
-    const onnx::ModelProto& model,
-    std::optional<std::vector<std::string>> skip_optimizers,
-    bool constant_folding, bool shape_inference, size_t tensor_size_threshold) {
-  Check(model);
+#ifndef ONNXSIM_VERSION
+#define ONNXSIM_VERSION "unknown"
+#endif
+
+// the versions of onnx and onnx-optimizer, set by cmake
+#ifndef ONNXSIM_DEPS_VERSION
+#define ONNXSIM_DEPS_VERSION "unknown"
+#endif
+
+// The environment variables that change the simplified model.
+constexpr std::array kResultEnvVars{
+    "ONNXSIM_FIXED_POINT_ITERS", "ONNXSIM_FOLD_CONSTANT_REGIONS",
+    "ONNXSIM_FOLD_SYMBOLIC_SHAPES", "ONNXSIM_INCREMENTAL_SHAPE_INFERENCE",
+    "ONNXSIM_DEDUPLICATE_INITIALIZERS"};
+
+// The cache of the simplified models in ONNXSIM_CACHE_DIR, limited to
+// ONNXSIM_CACHE_SIZE_MB (10GB by default). Null if the variable is unset or
+// the cache cannot be used, which only costs the caching.
+std::optional<ResultCache> GetResultCache(const SimplifyContext& ctx) {
+  const char* dir = std::getenv("ONNXSIM_CACHE_DIR");
+  if (dir == nullptr || *dir == '\0') {
+    return std::nullopt;
+  }
+  size_t max_bytes = size_t{10240} << 20;
+  if (const char* size_mb = std::getenv("ONNXSIM_CACHE_SIZE_MB")) {
+    char* end = nullptr;
+    errno = 0;
+    const long long value = std::strtoll(size_mb, &end, 10);
+    if (end == size_mb || *end != '\0' || value < 0) {
+      Warn(ctx, std::cerr,
+           "the result cache is disabled, ONNXSIM_CACHE_SIZE_MB=" +
+               std::string(size_mb) + " is not a size in MB");
+      return std::nullopt;
+    }
+    max_bytes = errno == ERANGE || static_cast<unsigned long long>(value) >
+                                       (SIZE_MAX >> 20)
+                    ? SIZE_MAX
+                    : static_cast<size_t>(value) << 20;
+  }
+  try {
+    return ResultCache(dir, max_bytes);
+  } catch (const std::exception& e) {
+    Warn(ctx, std::cerr,
+         std::string("the result cache is disabled: ") + e.what());
+    return std::nullopt;
+  }
+}
+
+// SHA-256 of the model together with everything else that determines the
+// result: the options, the versions of onnxsim and of the libraries doing
+// the work, and the executor. The graph is hashed with the initializers
+// swapped out and each initializer on its own, so the weights are never
+// copied; the data left in the external files is read through the store.
+// "" if the model cannot be cached, i.e. its data is external without a
+// store.
+std::string GetCacheKey(
+    onnx::ModelProto& model,
+    const std::optional<std::vector<std::string>>& skip_optimizers,
+    bool constant_folding, bool shape_inference,
+    const SimplifyContext& ctx) {
+  std::ostringstream options;
+  options << ONNXSIM_VERSION << ";" << ONNXSIM_DEPS_VERSION << ";";
+#ifndef NO_BUILTIN_ORT
+  options << "onnxruntime=" << OrtGetApiBase()->GetVersionString() << ";";
+#endif
+  // a custom executor may fold the ops differently
+  options << (ctx.executor ? typeid(*ctx.executor).name() : "no executor")
+          << ";" << constant_folding << ";" << shape_inference << ";"
+          << ctx.tensor_size_threshold << ";";
+  if (skip_optimizers) {
+    for (const auto& x : *skip_optimizers) {
+      options << x << ",";
+    }
+  } else {
+    options << "no optimizers";
+  }
+  for (const auto* x : kResultEnvVars) {
+    options << ";" << x << "=" << (std::getenv(x) ? std::getenv(x) : "");
+  }
+  Sha256 sha;
+  // the sizes keep the concatenation unambiguous
+  const auto Update = [&sha](std::string_view data) {
+    sha.Update(std::to_string(data.size()) + ":");
+    sha.Update(data);
+  };
+  Update(options.str());
+  Update(SerializeWithoutInitializers(model));
+  for (auto& x : *model.mutable_graph()->mutable_initializer()) {
+    if (x.data_location() == onnx::TensorProto::EXTERNAL) {
+      if (ctx.external_data == nullptr) {
+        return "";
+      }
+      Update(x.SerializeAsString());
+      Update(ctx.external_data->Data(x));
+    } else if (x.has_raw_data()) {
+      std::string data;
+      x.mutable_raw_data()->swap(data);
+      Update(x.SerializeAsString());
+      x.mutable_raw_data()->swap(data);
+      Update(x.raw_data());
+    } else {
+      Update(x.SerializeAsString());
+    }
+  }
+  return sha.HexDigest();
+}
 
-  config.tensor_size_threshold = tensor_size_threshold;
-  config.optimizer_passes.clear();
+SimplifyState GetDefaultState() {
+  SimplifyState state;
+  const int num_threads = std::getenv("ONNXSIM_NUM_THREADS")
+                              ? std::atoi(std::getenv("ONNXSIM_NUM_THREADS"))
+                              : 1;
+  if (num_threads > 1) {
+    state.thread_pool = std::make_shared<ThreadPool>(num_threads);
+  }
+  return state;
+}
+
+SimplifyContext MakeContext(
+    const std::optional<std::vector<std::string>>& skip_optimizers,
+    size_t tensor_size_threshold, const SimplifyState& state) {
+  SimplifyContext ctx;
+  ctx.tensor_size_threshold = tensor_size_threshold;
+  ctx.fold_constant_regions =
+      std::getenv("ONNXSIM_FOLD_CONSTANT_REGIONS")
+          ? std::atoi(std::getenv("ONNXSIM_FOLD_CONSTANT_REGIONS")) != 0
+          : false;
+  ctx.thread_pool = state.thread_pool;
+  ctx.op_result_cache = state.op_result_cache;
+  // taken once, so that the whole call runs on the same executor even if
+  // the instance is replaced meanwhile
+  ctx.executor = state.executor ? state.executor : ModelExecutor::instance();
+  ctx.on_progress = state.on_progress;
+  ctx.is_cancelled = state.is_cancelled;
+  ctx.on_warning = state.on_warning;
+  if (ctx.on_progress) {
+    ctx.progress =
+        std::make_shared<std::pair<std::mutex, SimplifyProgress>>();
+  }
   // skip_optimizers == nullopt means skiping all optimizers, so
-  // config.optimizer_passes is empty
+  // ctx.optimizer_passes is empty
   if (skip_optimizers) {
     std::vector<std::string> passes;
     const auto all_passes = onnx::optimization::GetFuseAndEliminationPass();
@@ -501,44 +2010,195 @@ onnx::ModelProto Simplify(
         passes.push_back(pass);
       }
     }
-    config.optimizer_passes = passes;
+    ctx.optimizer_passes = passes;
+  }
+  ctx.fold_symbolic_shapes =
+      std::getenv("ONNXSIM_FOLD_SYMBOLIC_SHAPES")
+          ? std::atoi(std::getenv("ONNXSIM_FOLD_SYMBOLIC_SHAPES")) != 0
+          : false;
+  ctx.incremental_shape_inference =
+      std::getenv("ONNXSIM_INCREMENTAL_SHAPE_INFERENCE")
+          ? std::atoi(std::getenv("ONNXSIM_INCREMENTAL_SHAPE_INFERENCE")) != 0
+          : false;
+  ctx.deduplicate_initializers =
+      std::getenv("ONNXSIM_DEDUPLICATE_INITIALIZERS")
+          ? std::atoi(std::getenv("ONNXSIM_DEDUPLICATE_INITIALIZERS")) != 0
+          : false;
+  return ctx;
+}
+
+onnx::ModelProto SimplifyWithContext(
+    onnx::ModelProto model,
+    const std::optional<std::vector<std::string>>& skip_optimizers,
+    bool constant_folding, bool shape_inference, const SimplifyContext& ctx) {
+  const auto cache = GetResultCache(ctx);
+  std::string cache_key;
+  if (cache) {
+    try {
+      cache_key = GetCacheKey(model, skip_optimizers, constant_folding,
+                              shape_inference, ctx);
+    } catch (const std::exception& e) {
+      Warn(ctx, std::cerr,
+           std::string("the model is not cached: ") + e.what());
+    }
+  }
+  if (!cache_key.empty()) {
+    onnx::ModelProto cached_model;
+    if (const auto value = cache->Get(cache_key);
+        value && cached_model.ParseFromString(*value)) {
+      return cached_model;
+    }
   }
 
-  auto FoldConstant = constant_folding ? _FoldConstant : Identity;
-  auto InferShapes = shape_inference ? _InferShapes : Identity;
+  Check(model, ctx);
+
+  using ModelPass = std::function<onnx::ModelProto(onnx::ModelProto, bool*)>;
+  ModelPass FoldConstant = Identity;
+  if (constant_folding && ctx.fold_symbolic_shapes) {
+    FoldConstant = [&ctx](onnx::ModelProto model, bool* changed) {
+      return _FoldSymbolicShapes(_FoldConstant(std::move(model), ctx, changed),
+                                 changed);
+    };
+  } else if (constant_folding) {
+    FoldConstant = [&ctx](onnx::ModelProto model, bool* changed) {
+      return _FoldConstant(std::move(model), ctx, changed);
+    };
+  }
+  ModelPass InferShapes = Identity;
+  if (shape_inference && ctx.incremental_shape_inference) {
+    // the state is shared by the copies of the function made by FixedPointFn
+    auto inference = std::make_shared<IncrementalShapeInference>();
+    InferShapes = ReportingChanges([inference](onnx::ModelProto model) {
+      return (*inference)(std::move(model));
+    });
+  } else if (shape_inference) {
+    InferShapes = ReportingChanges(_InferShapes);
+  }
+  // every pass checks for cancellation first, and every fixed point
+  // iteration ends with the constant folding
+  const auto Pass = [&ctx](ModelPass f) {
+    return ModelPass([&ctx, f](onnx::ModelProto model, bool* changed) {
+      ThrowIfCancelled(ctx);
+      return f(std::move(model), changed);
+    });
+  };
+  const auto Opt = Pass([&ctx](onnx::ModelProto model, bool* changed) {
+    return Optimize(std::move(model), ctx, changed);
+  });
+  const auto Fold =
+      Pass([&ctx, FoldConstant](onnx::ModelProto model, bool* changed) {
+        model = FoldConstant(std::move(model), changed);
+        ReportProgress(ctx, 1, 0, {});
+        return model;
+      });
 
   int fixed_point_iters =
       std::getenv("ONNXSIM_FIXED_POINT_ITERS")
           ? std::atoi(std::getenv("ONNXSIM_FIXED_POINT_ITERS"))
           : 50;
 
-  auto OptAndShape = FixedPointFn(std::function{InferShapes},
-                                  std::function{Optimize}, fixed_point_iters);
+  auto OptAndShape =
+      FixedPointFn(Pass(InferShapes), Opt, fixed_point_iters);
   bool converged = false;
-  auto OptAndShapeAndFold =
-      FixedPointFn(std::function{OptAndShape}, std::function{FoldConstant},
-                   fixed_point_iters, &converged);
-  auto sim_model = OptAndShapeAndFold(model);
-  Check(sim_model);
+  auto OptAndShapeAndFold = FixedPointFn(std::function{OptAndShape}, Fold,
+                                         fixed_point_iters, &converged);
+  bool changed = false;
+  auto sim_model = OptAndShapeAndFold(std::move(model), &changed);
+  if (ctx.deduplicate_initializers) {
+    DeduplicateInitializers(sim_model);
+  }
+  Check(sim_model, ctx);
   if (!converged) {
-    std::cout << "WARNING: the simplification stopped because of timeout. "
-                 "Please set environment variable `ONNXSIM_FIXED_POINT_ITERS` "
-                 "to a number higher than "
-              << fixed_point_iters << "if you want further simplification."
-              << std::endl;
+    Warn(ctx, std::cout,
+         "the simplification stopped because of timeout. Please set "
+         "environment variable `ONNXSIM_FIXED_POINT_ITERS` to a number "
+         "higher than " +
+             std::to_string(fixed_point_iters) +
+             " if you want further simplification.");
+  }
+  if (!cache_key.empty() && sim_model.ByteSizeLong() <= INT_MAX) {
+    cache->Put(cache_key, sim_model.SerializeAsString());
   }
   return sim_model;
 }
 
+onnx::ModelProto Simplify(
+    onnx::ModelProto model,
+    std::optional<std::vector<std::string>> skip_optimizers,
+    bool constant_folding, bool shape_inference, size_t tensor_size_threshold) {
+  return Simplify(std::move(model), std::move(skip_optimizers),
+                  constant_folding, shape_inference, tensor_size_threshold,
+                  GetDefaultState());
+}
+
+onnx::ModelProto Simplify(
+    onnx::ModelProto model,
+    std::optional<std::vector<std::string>> skip_optimizers,
+    bool constant_folding, bool shape_inference, size_t tensor_size_threshold,
+    const SimplifyState& state) {
+  const auto ctx = MakeContext(skip_optimizers, tensor_size_threshold, state);
+  return SimplifyWithContext(std::move(model), skip_optimizers,
+                             constant_folding, shape_inference, ctx);
+}
+
+ExternalDataOptions GetExternalDataOptions() {
+  ExternalDataOptions options;
+  options.alignment =
+      std::getenv("ONNXSIM_EXTERNAL_DATA_ALIGNMENT")
+          ? std::atoi(std::getenv("ONNXSIM_EXTERNAL_DATA_ALIGNMENT"))
+          : 1;
+  options.order_by_first_use =
+      std::getenv("ONNXSIM_ORDER_EXTERNAL_DATA")
+          ? std::atoi(std::getenv("ONNXSIM_ORDER_EXTERNAL_DATA")) != 0
+          : false;
+  return options;
+}
+
 void SimplifyPath(const std::string& in_path, const std::string& out_path,
                   std::optional<std::vector<std::string>> skip_optimizers,
                   bool constant_folding, bool shape_inference,
                   size_t tensor_size_threshold) {
+  SimplifyPath(in_path, out_path, std::move(skip_optimizers),
+               constant_folding, shape_inference, tensor_size_threshold,
+               GetDefaultState());
+}
+
+void SimplifyPath(const std::string& in_path, const std::string& out_path,
+                  std::optional<std::vector<std::string>> skip_optimizers,
+                  bool constant_folding, bool shape_inference,
+                  size_t tensor_size_threshold, const SimplifyState& state) {
+  SimplifyPath(in_path, out_path, std::move(skip_optimizers),
+               constant_folding, shape_inference, tensor_size_threshold,
+               state, GetExternalDataOptions());
+}
+
+void SimplifyPath(const std::string& in_path, const std::string& out_path,
+                  std::optional<std::vector<std::string>> skip_optimizers,
+                  bool constant_folding, bool shape_inference,
+                  size_t tensor_size_threshold, const SimplifyState& state,
+                  const ExternalDataOptions& save_options) {
   onnx::ModelProto model;
-  onnx::optimization::loadModel(&model, in_path, true);
+  const bool mmap_external_data =
+      std::getenv("ONNXSIM_MMAP_EXTERNAL_DATA")
+          ? std::atoi(std::getenv("ONNXSIM_MMAP_EXTERNAL_DATA")) != 0
+          : false;
+  auto ctx = MakeContext(skip_optimizers, tensor_size_threshold, state);
+  if (!mmap_external_data) {
+    onnx::optimization::loadModel(&model, in_path, true);
+
+    model = SimplifyWithContext(std::move(model), skip_optimizers,
+                                constant_folding, shape_inference, ctx);
 
-  model = Simplify(model, skip_optimizers, constant_folding, shape_inference,
-                   tensor_size_threshold);
+    SaveModel(model, out_path, save_options);
+    return;
+  }
 
-  onnx::optimization::saveModel(&model, out_path, true, "");
+  // the external data stays in the files until it is needed
+  onnx::LoadProtoFromPath(in_path, model);
+  const auto pos = in_path.find_last_of("\\/");
+  ctx.external_data = std::make_shared<ExternalDataStore>(
+      pos == std::string::npos ? "" : in_path.substr(0, pos));
+  model = SimplifyWithContext(std::move(model), skip_optimizers,
+                              constant_folding, shape_inference, ctx);
+  SaveModel(model, out_path, save_options, ctx.external_data.get());
 }
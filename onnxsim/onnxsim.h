@@ -1,7 +1,10 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <optional>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include <onnx/onnx_pb.h>
@@ -9,21 +12,29 @@
 struct ModelExecutor {
   virtual ~ModelExecutor() = default;
   static void set_instance(std::shared_ptr<const ModelExecutor> instance) {
-    instance_ = std::move(instance);
+    std::atomic_store(&instance_, std::move(instance));
   }
+  // the executor of the simplifications without their own, may be null
+  static std::shared_ptr<const ModelExecutor> instance() {
+    return std::atomic_load(&instance_);
+  }
+  // `inputs` point to tensors owned by the caller, which stay alive during
+  // the call, so that large constant tensors are never copied on their way
+  // to the executor.
   static std::vector<onnx::TensorProto> Run(
       const onnx::ModelProto& model,
-      const std::vector<onnx::TensorProto>& inputs) {
-    if (instance_ == nullptr) {
+      const std::vector<const onnx::TensorProto*>& inputs) {
+    const auto executor = instance();
+    if (executor == nullptr) {
       throw std::runtime_error("empty instance");
     }
-    return instance_->_Run(model, inputs);
+    return executor->_Run(model, inputs);
   }
 
   // public it for pybind11
   virtual std::vector<onnx::TensorProto> _Run(
       const onnx::ModelProto& model,
-      const std::vector<onnx::TensorProto>& inputs) const = 0;
+      const std::vector<const onnx::TensorProto*>& inputs) const = 0;
 
  private:
   static std::shared_ptr<const ModelExecutor> instance_;
@@ -31,12 +42,96 @@ struct ModelExecutor {
 
 void InitEnv();
 
+// Counters of the constant folding, accumulated over all simplifications in
+// the process.
+struct FoldingStats {
+  // folded ops that reused a cached session / needed a new one in the
+  // builtin onnxruntime executor
+  size_t session_cache_hits = 0;
+  size_t session_cache_misses = 0;
+  // folded ops evaluated by the builtin kernels / by the model executor
+  size_t native_folds = 0;
+  size_t executor_folds = 0;
+};
+
+FoldingStats GetFoldingStats();
+
+void ResetFoldingStats();
+
+class OpResultCache;
+class ThreadPool;
+
+// Where a simplification is. The counters only grow during a call.
+struct SimplifyProgress {
+  // fixed point iterations of optimization and constant folding done
+  size_t iteration = 0;
+  // constant nodes folded and the bytes of the tensors they produced
+  size_t nodes_folded = 0;
+  size_t bytes_folded = 0;
+};
+
+// Thrown by a simplification whose SimplifyState::is_cancelled returned
+// true.
+class SimplifyCancelled : public std::runtime_error {
+ public:
+  SimplifyCancelled() : std::runtime_error("simplification cancelled") {}
+};
+
+// The state kept across simplifications by a long-lived caller, e.g. an FFI
+// handle, instead of being created by every call. It can be shared by
+// concurrent calls: everything else a call reads is private to it.
+struct SimplifyState {
+  // runs independent constant nodes concurrently, null means sequential
+  std::shared_ptr<ThreadPool> thread_pool;
+  // the outputs of the ops folded by the model executor, null means they
+  // are not cached
+  std::shared_ptr<OpResultCache> op_result_cache;
+  // runs the ops the builtin kernels do not support, null means
+  // ModelExecutor::instance()
+  std::shared_ptr<const ModelExecutor> executor;
+  // called after every folded op and every fixed point iteration, from the
+  // folding threads too but never concurrently
+  std::function<void(const SimplifyProgress&)> on_progress;
+  // polled between the passes and between the folded ops, also by several
+  // folding threads at once; the call throws SimplifyCancelled once it
+  // returns true
+  std::function<bool()> is_cancelled;
+  // receives the warnings, e.g. the ops that failed to fold, on the thread
+  // of the call; null means they are printed
+  std::function<void(const std::string&)> on_warning;
+};
+
+// The state of a call without a caller-provided one: ONNXSIM_NUM_THREADS
+// threads and no op result cache.
+SimplifyState GetDefaultState();
+
 onnx::ModelProto Simplify(
-    const onnx::ModelProto& model,
+    onnx::ModelProto model,
     std::optional<std::vector<std::string>> skip_optimizers,
     bool constant_folding, bool shape_inference, size_t tensor_size_threshold);
 
+onnx::ModelProto Simplify(
+    onnx::ModelProto model,
+    std::optional<std::vector<std::string>> skip_optimizers,
+    bool constant_folding, bool shape_inference, size_t tensor_size_threshold,
+    const SimplifyState& state);
+
 void SimplifyPath(const std::string& in_path, const std::string& out_path,
                   std::optional<std::vector<std::string>> skip_optimizers,
                   bool constant_folding, bool shape_inference,
                   size_t tensor_size_threshold);
+
+void SimplifyPath(const std::string& in_path, const std::string& out_path,
+                  std::optional<std::vector<std::string>> skip_optimizers,
+                  bool constant_folding, bool shape_inference,
+                  size_t tensor_size_threshold, const SimplifyState& state);
+
+struct ExternalDataOptions;
+
+// Writes the data of the initializers as `save_options` says instead of as
+// the ONNXSIM_EXTERNAL_DATA_* variables say.
+void SimplifyPath(const std::string& in_path, const std::string& out_path,
+                  std::optional<std::vector<std::string>> skip_optimizers,
+                  bool constant_folding, bool shape_inference,
+                  size_t tensor_size_threshold, const SimplifyState& state,
+                  const ExternalDataOptions& save_options);
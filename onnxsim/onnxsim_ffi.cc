@@ -4,12 +4,22 @@
 
 #include "onnxsim_ffi.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "onnxsim.h"
+#include "result_cache.h"
+#include "thread_pool.h"
 
 namespace {
 // Thread-local storage for last error message
@@ -22,6 +32,9 @@ void set_last_error(const std::string& error) {
 onnxsim_error_t handle_exception() {
   try {
     throw;  // Re-throw the caught exception
+  } catch (const SimplifyCancelled& e) {
+    set_last_error(e.what());
+    return ONNXSIM_ERROR_CANCELLED;
   } catch (const std::exception& e) {
     set_last_error(e.what());
     return ONNXSIM_ERROR_INTERNAL;
@@ -30,8 +43,101 @@ onnxsim_error_t handle_exception() {
     return ONNXSIM_ERROR_INTERNAL;
   }
 }
+
+std::optional<std::vector<std::string>> to_skip_optimizers(
+    const char** skip_optimizers, size_t skip_optimizers_len) {
+  if (skip_optimizers == nullptr || skip_optimizers_len == 0) {
+    return std::nullopt;
+  }
+  std::vector<std::string> opts;
+  for (size_t i = 0; i < skip_optimizers_len; ++i) {
+    if (skip_optimizers[i] != nullptr) {
+      opts.push_back(std::string(skip_optimizers[i]));
+    }
+  }
+  return opts;
+}
+
+// Parses the model in place, without copying the bytes
+onnxsim_error_t parse_from_bytes(const uint8_t* model_bytes,
+                                 size_t model_bytes_len,
+                                 onnx::ModelProto& model) {
+  // protobuf cannot parse messages of 2GB or more
+  if (model_bytes_len > INT_MAX) {
+    set_last_error("Model protobuf is 2GB or more");
+    return ONNXSIM_ERROR_PARSE_FAILED;
+  }
+  if (!model.ParseFromArray(model_bytes, static_cast<int>(model_bytes_len))) {
+    set_last_error("Failed to parse model protobuf");
+    return ONNXSIM_ERROR_PARSE_FAILED;
+  }
+  return ONNXSIM_SUCCESS;
+}
+
+// Serializes `model` into `buffer`, which holds model.ByteSizeLong() bytes
+onnxsim_error_t serialize_to_array(const onnx::ModelProto& model,
+                                   uint8_t* buffer, size_t size) {
+  if (size > INT_MAX ||
+      !model.SerializeToArray(buffer, static_cast<int>(size))) {
+    set_last_error("Failed to serialize simplified model");
+    return ONNXSIM_ERROR_SERIALIZE_FAILED;
+  }
+  return ONNXSIM_SUCCESS;
+}
+
+// Serializes `model` into a single buffer allocated with malloc
+onnxsim_error_t serialize_to_bytes(const onnx::ModelProto& model,
+                                   uint8_t** out_bytes, size_t* out_bytes_len) {
+  const size_t size = model.ByteSizeLong();
+  if (size > INT_MAX) {
+    set_last_error("Simplified model is 2GB or more, save it to a file");
+    return ONNXSIM_ERROR_SERIALIZE_FAILED;
+  }
+  // malloc(0) may return NULL
+  auto* buffer =
+      static_cast<uint8_t*>(std::malloc(std::max<size_t>(size, 1)));
+  if (buffer == nullptr) {
+    set_last_error("Failed to allocate memory for output");
+    return ONNXSIM_ERROR_INTERNAL;
+  }
+  if (const auto error = serialize_to_array(model, buffer, size);
+      error != ONNXSIM_SUCCESS) {
+    std::free(buffer);
+    return error;
+  }
+  *out_bytes = buffer;
+  *out_bytes_len = size;
+  return ONNXSIM_SUCCESS;
+}
 }  // namespace
 
+// The object behind onnxsim_handle_t
+struct onnxsim_handle {
+  std::optional<std::vector<std::string>> skip_optimizers;
+  bool constant_folding;
+  bool shape_inference;
+  size_t tensor_size_threshold;
+  SimplifyState state;
+};
+
+// The object behind onnxsim_result_t
+struct onnxsim_result {
+  onnx::ModelProto model;
+  size_t size;
+};
+
+// The object behind onnxsim_job_t
+struct onnxsim_job {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done = false;
+  onnxsim_error_t error = ONNXSIM_SUCCESS;
+  std::string error_message;
+  std::unique_ptr<onnxsim_result> result;
+  std::atomic<bool> cancelled{false};
+  std::thread worker;
+};
+
 void onnxsim_init_env(void) {
   InitEnv();
 }
@@ -59,47 +165,22 @@ onnxsim_error_t onnxsim_simplify_bytes(
 
     // Parse model from bytes
     onnx::ModelProto model;
-    const std::string model_str(reinterpret_cast<const char*>(model_bytes),
-                                model_bytes_len);
-    if (!model.ParseFromString(model_str)) {
-      set_last_error("Failed to parse model protobuf");
-      return ONNXSIM_ERROR_PARSE_FAILED;
+    if (const auto error =
+            parse_from_bytes(model_bytes, model_bytes_len, model);
+        error != ONNXSIM_SUCCESS) {
+      return error;
     }
 
     // Prepare skip optimizers
-    std::optional<std::vector<std::string>> skip_opts;
-    if (skip_optimizers != nullptr && skip_optimizers_len > 0) {
-      std::vector<std::string> opts;
-      for (size_t i = 0; i < skip_optimizers_len; ++i) {
-        if (skip_optimizers[i] != nullptr) {
-          opts.push_back(std::string(skip_optimizers[i]));
-        }
-      }
-      skip_opts = std::move(opts);
-    }
+    auto skip_opts = to_skip_optimizers(skip_optimizers, skip_optimizers_len);
 
     // Simplify model
-    auto simplified_model = Simplify(
-        model, skip_opts, constant_folding != 0, shape_inference != 0,
-        tensor_size_threshold);
+    auto simplified_model =
+        Simplify(std::move(model), skip_opts, constant_folding != 0,
+                 shape_inference != 0, tensor_size_threshold);
 
     // Serialize output
-    std::string output;
-    if (!simplified_model.SerializeToString(&output)) {
-      set_last_error("Failed to serialize simplified model");
-      return ONNXSIM_ERROR_SERIALIZE_FAILED;
-    }
-
-    // Allocate and copy output
-    *out_bytes_len = output.size();
-    *out_bytes = static_cast<uint8_t*>(std::malloc(*out_bytes_len));
-    if (*out_bytes == nullptr) {
-      set_last_error("Failed to allocate memory for output");
-      return ONNXSIM_ERROR_INTERNAL;
-    }
-    std::memcpy(*out_bytes, output.data(), *out_bytes_len);
-
-    return ONNXSIM_SUCCESS;
+    return serialize_to_bytes(simplified_model, out_bytes, out_bytes_len);
   } catch (...) {
     return handle_exception();
   }
@@ -121,16 +202,7 @@ onnxsim_error_t onnxsim_simplify_file(
     }
 
     // Prepare skip optimizers
-    std::optional<std::vector<std::string>> skip_opts;
-    if (skip_optimizers != nullptr && skip_optimizers_len > 0) {
-      std::vector<std::string> opts;
-      for (size_t i = 0; i < skip_optimizers_len; ++i) {
-        if (skip_optimizers[i] != nullptr) {
-          opts.push_back(std::string(skip_optimizers[i]));
-        }
-      }
-      skip_opts = std::move(opts);
-    }
+    auto skip_opts = to_skip_optimizers(skip_optimizers, skip_optimizers_len);
 
     // Simplify file
     SimplifyPath(std::string(in_path), std::string(out_path), skip_opts,
@@ -143,6 +215,366 @@ onnxsim_error_t onnxsim_simplify_file(
   }
 }
 
+void onnxsim_options_init(onnxsim_options_t* options) {
+  if (options == nullptr) {
+    return;
+  }
+  options->optimization = 1;
+  options->skip_optimizers = nullptr;
+  options->skip_optimizers_len = 0;
+  options->constant_folding = 1;
+  options->shape_inference = 1;
+  options->tensor_size_threshold = SIZE_MAX;
+  options->num_threads = 1;
+  options->op_result_cache_bytes = size_t{256} << 20;
+}
+
+onnxsim_error_t onnxsim_create(const onnxsim_options_t* options,
+                               onnxsim_handle_t* out_handle) {
+  try {
+    if (options == nullptr || out_handle == nullptr) {
+      set_last_error("options and out_handle cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    auto handle = std::make_unique<onnxsim_handle>();
+    if (options->optimization != 0) {
+      handle->skip_optimizers =
+          to_skip_optimizers(options->skip_optimizers,
+                             options->skip_optimizers_len)
+              .value_or(std::vector<std::string>{});
+    }
+    handle->constant_folding = options->constant_folding != 0;
+    handle->shape_inference = options->shape_inference != 0;
+    handle->tensor_size_threshold = options->tensor_size_threshold;
+    if (options->num_threads > 1) {
+      handle->state.thread_pool =
+          std::make_shared<ThreadPool>(options->num_threads);
+    }
+    if (options->op_result_cache_bytes > 0) {
+      handle->state.op_result_cache =
+          std::make_shared<OpResultCache>(options->op_result_cache_bytes);
+    }
+    *out_handle = handle.release();
+    return ONNXSIM_SUCCESS;
+  } catch (...) {
+    return handle_exception();
+  }
+}
+
+void onnxsim_destroy(onnxsim_handle_t handle) {
+  delete static_cast<onnxsim_handle*>(handle);
+}
+
+onnxsim_error_t onnxsim_handle_simplify_bytes(
+    onnxsim_handle_t handle,
+    const uint8_t* model_bytes,
+    size_t model_bytes_len,
+    uint8_t** out_bytes,
+    size_t* out_bytes_len) {
+  try {
+    if (handle == nullptr || model_bytes == nullptr) {
+      set_last_error("handle and model_bytes cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    if (out_bytes == nullptr || out_bytes_len == nullptr) {
+      set_last_error("out_bytes or out_bytes_len cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    const auto& h = *static_cast<const onnxsim_handle*>(handle);
+
+    onnx::ModelProto model;
+    if (const auto error =
+            parse_from_bytes(model_bytes, model_bytes_len, model);
+        error != ONNXSIM_SUCCESS) {
+      return error;
+    }
+
+    auto simplified_model =
+        Simplify(std::move(model), h.skip_optimizers, h.constant_folding,
+                 h.shape_inference, h.tensor_size_threshold, h.state);
+
+    return serialize_to_bytes(simplified_model, out_bytes, out_bytes_len);
+  } catch (...) {
+    return handle_exception();
+  }
+}
+
+onnxsim_error_t onnxsim_handle_simplify_file(
+    onnxsim_handle_t handle,
+    const char* in_path,
+    const char* out_path) {
+  try {
+    if (handle == nullptr || in_path == nullptr || out_path == nullptr) {
+      set_last_error("handle, in_path and out_path cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    const auto& h = *static_cast<const onnxsim_handle*>(handle);
+
+    SimplifyPath(std::string(in_path), std::string(out_path),
+                 h.skip_optimizers, h.constant_folding, h.shape_inference,
+                 h.tensor_size_threshold, h.state);
+
+    return ONNXSIM_SUCCESS;
+  } catch (...) {
+    return handle_exception();
+  }
+}
+
+onnxsim_error_t onnxsim_handle_simplify(
+    onnxsim_handle_t handle,
+    const uint8_t* model_bytes,
+    size_t model_bytes_len,
+    onnxsim_result_t* out_result) {
+  try {
+    if (handle == nullptr || model_bytes == nullptr || out_result == nullptr) {
+      set_last_error("handle, model_bytes and out_result cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    const auto& h = *static_cast<const onnxsim_handle*>(handle);
+
+    onnx::ModelProto model;
+    if (const auto error =
+            parse_from_bytes(model_bytes, model_bytes_len, model);
+        error != ONNXSIM_SUCCESS) {
+      return error;
+    }
+
+    auto result = std::make_unique<onnxsim_result>();
+    result->model =
+        Simplify(std::move(model), h.skip_optimizers, h.constant_folding,
+                 h.shape_inference, h.tensor_size_threshold, h.state);
+    // also caches the sizes of the submessages for the serialization
+    result->size = result->model.ByteSizeLong();
+    if (result->size > INT_MAX) {
+      set_last_error("Simplified model is 2GB or more, save it to a file");
+      return ONNXSIM_ERROR_SERIALIZE_FAILED;
+    }
+    *out_result = result.release();
+    return ONNXSIM_SUCCESS;
+  } catch (...) {
+    return handle_exception();
+  }
+}
+
+size_t onnxsim_result_size(onnxsim_result_t result) {
+  return result == nullptr ? 0 : static_cast<onnxsim_result*>(result)->size;
+}
+
+onnxsim_error_t onnxsim_result_write(
+    onnxsim_result_t result,
+    uint8_t* buffer,
+    size_t buffer_len) {
+  try {
+    if (result == nullptr || buffer == nullptr) {
+      set_last_error("result and buffer cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    const auto& r = *static_cast<const onnxsim_result*>(result);
+    if (buffer_len < r.size) {
+      set_last_error("Buffer of " + std::to_string(buffer_len) +
+                     " bytes is too small for " + std::to_string(r.size) +
+                     " bytes");
+      return ONNXSIM_ERROR_BUFFER_TOO_SMALL;
+    }
+    return serialize_to_array(r.model, buffer, r.size);
+  } catch (...) {
+    return handle_exception();
+  }
+}
+
+void onnxsim_result_free(onnxsim_result_t result) {
+  delete static_cast<onnxsim_result*>(result);
+}
+
+onnxsim_error_t onnxsim_handle_simplify_async(
+    onnxsim_handle_t handle,
+    const uint8_t* model_bytes,
+    size_t model_bytes_len,
+    onnxsim_progress_fn progress_fn,
+    onnxsim_cancel_fn cancel_fn,
+    void* user_data,
+    onnxsim_job_t* out_job) {
+  try {
+    if (handle == nullptr || model_bytes == nullptr || out_job == nullptr) {
+      set_last_error("handle, model_bytes and out_job cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    // the job keeps its own copy of the options, the handle may go away
+    const auto h = *static_cast<const onnxsim_handle*>(handle);
+
+    auto model = std::make_shared<onnx::ModelProto>();
+    if (const auto error =
+            parse_from_bytes(model_bytes, model_bytes_len, *model);
+        error != ONNXSIM_SUCCESS) {
+      return error;
+    }
+
+    auto job = std::make_unique<onnxsim_job>();
+    auto* j = job.get();
+    SimplifyState state = h.state;
+    if (progress_fn != nullptr) {
+      state.on_progress = [progress_fn, user_data](const SimplifyProgress& p) {
+        const onnxsim_progress_t progress{p.iteration, p.nodes_folded,
+                                          p.bytes_folded};
+        progress_fn(&progress, user_data);
+      };
+    }
+    state.is_cancelled = [j, cancel_fn, user_data]() {
+      return j->cancelled || (cancel_fn != nullptr && cancel_fn(user_data));
+    };
+    j->worker = std::thread([j, h, state, model]() {
+      onnxsim_error_t error = ONNXSIM_SUCCESS;
+      std::unique_ptr<onnxsim_result> result;
+      try {
+        result = std::make_unique<onnxsim_result>();
+        result->model =
+            Simplify(std::move(*model), h.skip_optimizers, h.constant_folding,
+                     h.shape_inference, h.tensor_size_threshold, state);
+        result->size = result->model.ByteSizeLong();
+        if (result->size > INT_MAX) {
+          set_last_error("Simplified model is 2GB or more, save it to a file");
+          error = ONNXSIM_ERROR_SERIALIZE_FAILED;
+        }
+      } catch (...) {
+        error = handle_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(j->mutex);
+        j->done = true;
+        j->error = error;
+        if (error == ONNXSIM_SUCCESS) {
+          j->result = std::move(result);
+        } else {
+          j->error_message = g_last_error;
+        }
+      }
+      j->cv.notify_all();
+    });
+    *out_job = job.release();
+    return ONNXSIM_SUCCESS;
+  } catch (...) {
+    return handle_exception();
+  }
+}
+
+int onnxsim_job_poll(onnxsim_job_t job) {
+  if (job == nullptr) {
+    return 1;
+  }
+  auto* j = static_cast<onnxsim_job*>(job);
+  std::lock_guard<std::mutex> lock(j->mutex);
+  return j->done ? 1 : 0;
+}
+
+onnxsim_error_t onnxsim_job_wait(onnxsim_job_t job,
+                                 onnxsim_result_t* out_result) {
+  if (job == nullptr) {
+    set_last_error("job cannot be NULL");
+    return ONNXSIM_ERROR_INVALID_ARGUMENT;
+  }
+  auto* j = static_cast<onnxsim_job*>(job);
+  std::unique_lock<std::mutex> lock(j->mutex);
+  j->cv.wait(lock, [j]() { return j->done; });
+  if (j->error != ONNXSIM_SUCCESS) {
+    set_last_error(j->error_message);
+    return j->error;
+  }
+  if (out_result != nullptr) {
+    if (j->result == nullptr) {
+      set_last_error("The result of the job was already taken");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    *out_result = j->result.release();
+  }
+  return ONNXSIM_SUCCESS;
+}
+
+void onnxsim_job_cancel(onnxsim_job_t job) {
+  if (job != nullptr) {
+    static_cast<onnxsim_job*>(job)->cancelled = true;
+  }
+}
+
+void onnxsim_job_free(onnxsim_job_t job) {
+  if (job == nullptr) {
+    return;
+  }
+  auto* j = static_cast<onnxsim_job*>(job);
+  j->cancelled = true;
+  j->worker.join();
+  delete j;
+}
+
+onnxsim_error_t onnxsim_simplify_many(
+    const uint8_t* const* model_bytes,
+    const size_t* model_bytes_lens,
+    size_t num_models,
+    const onnxsim_options_t* options,
+    size_t max_parallel,
+    uint8_t** out_bytes,
+    size_t* out_bytes_lens,
+    onnxsim_error_t* out_errors,
+    char** out_error_messages) {
+  try {
+    if (num_models > 0 &&
+        (model_bytes == nullptr || model_bytes_lens == nullptr ||
+         out_bytes == nullptr || out_bytes_lens == nullptr ||
+         out_errors == nullptr)) {
+      set_last_error(
+          "model_bytes, model_bytes_lens, out_bytes, out_bytes_lens and "
+          "out_errors cannot be NULL");
+      return ONNXSIM_ERROR_INVALID_ARGUMENT;
+    }
+    onnxsim_handle_t handle = nullptr;
+    if (const auto error = onnxsim_create(options, &handle);
+        error != ONNXSIM_SUCCESS) {
+      return error;
+    }
+    std::unique_ptr<onnxsim_handle> owner(static_cast<onnxsim_handle*>(handle));
+
+    if (max_parallel == 0) {
+      max_parallel = std::thread::hardware_concurrency();
+    }
+    std::atomic<size_t> num_failed{0};
+    {
+      ThreadPool pool(std::min(max_parallel, num_models));
+      for (size_t i = 0; i < num_models; i++) {
+        out_bytes[i] = nullptr;
+        out_bytes_lens[i] = 0;
+        if (out_error_messages != nullptr) {
+          out_error_messages[i] = nullptr;
+        }
+        pool.Submit([=, &num_failed]() {
+          // the error of the model is left in g_last_error of this thread
+          out_errors[i] = onnxsim_handle_simplify_bytes(
+              handle, model_bytes[i], model_bytes_lens[i], &out_bytes[i],
+              &out_bytes_lens[i]);
+          if (out_errors[i] == ONNXSIM_SUCCESS) {
+            return;
+          }
+          num_failed++;
+          if (out_error_messages != nullptr) {
+            out_error_messages[i] = static_cast<char*>(
+                std::malloc(g_last_error.size() + 1));
+            if (out_error_messages[i] != nullptr) {
+              std::memcpy(out_error_messages[i], g_last_error.c_str(),
+                          g_last_error.size() + 1);
+            }
+          }
+        });
+      }
+    }
+    if (num_failed > 0) {
+      set_last_error(std::to_string(num_failed) + " of " +
+                     std::to_string(num_models) + " models failed");
+      return ONNXSIM_ERROR_SIMPLIFICATION_FAILED;
+    }
+    return ONNXSIM_SUCCESS;
+  } catch (...) {
+    return handle_exception();
+  }
+}
+
 void onnxsim_free_string(void* ptr) {
   std::free(ptr);
 }
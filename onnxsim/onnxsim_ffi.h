@@ -18,12 +18,34 @@ typedef enum {
   ONNXSIM_ERROR_PARSE_FAILED = 2,
   ONNXSIM_ERROR_SERIALIZE_FAILED = 3,
   ONNXSIM_ERROR_SIMPLIFICATION_FAILED = 4,
-  ONNXSIM_ERROR_INTERNAL = 5
+  ONNXSIM_ERROR_INTERNAL = 5,
+  ONNXSIM_ERROR_BUFFER_TOO_SMALL = 6,
+  ONNXSIM_ERROR_CANCELLED = 7
 } onnxsim_error_t;
 
 // Handle type for opaque objects
 typedef void* onnxsim_handle_t;
 
+// A simplified model, serialized only when the caller provides the buffer
+typedef void* onnxsim_result_t;
+
+// A simplification running in the background
+typedef void* onnxsim_job_t;
+
+// Progress of a job
+typedef struct {
+  size_t iteration;     // fixed point iterations done
+  size_t nodes_folded;  // constant nodes folded so far
+  size_t bytes_folded;  // bytes of the tensors produced by the folded nodes
+} onnxsim_progress_t;
+
+// Called with the progress of a job, never concurrently for the same job
+typedef void (*onnxsim_progress_fn)(const onnxsim_progress_t* progress,
+                                    void* user_data);
+
+// Returns nonzero to cancel a job, may be called by several threads at once
+typedef int (*onnxsim_cancel_fn)(void* user_data);
+
 /**
  * Initialize the ONNX environment.
  * Must be called before any other onnxsim functions.
@@ -76,6 +98,211 @@ onnxsim_error_t onnxsim_simplify_file(
     int shape_inference,
     size_t tensor_size_threshold);
 
+// Options of a handle
+typedef struct {
+  int optimization;                // 0 skips all optimizers
+  const char** skip_optimizers;    // optimizers to skip if optimization is 1
+  size_t skip_optimizers_len;
+  int constant_folding;
+  int shape_inference;
+  size_t tensor_size_threshold;
+  size_t num_threads;              // 0 or 1 folds constants sequentially
+  size_t op_result_cache_bytes;    // 0 disables the op result cache
+} onnxsim_options_t;
+
+/**
+ * Fill the options with the defaults: all optimizers, constant folding and
+ * shape inference enabled, no tensor size threshold, sequential constant
+ * folding and a 256MB op result cache.
+ *
+ * @param options Options to fill
+ */
+void onnxsim_options_init(onnxsim_options_t* options);
+
+/**
+ * Create a handle owning a copy of the options, a thread pool and an op
+ * result cache, which are reused by all simplifications through the handle.
+ * A handle can be used by several threads at once. The options, thread pool
+ * and op result cache are per handle, but all handles share the process-wide
+ * model executor (ModelExecutor::instance(), with the session cache of the
+ * builtin onnxruntime), and every simplification reads the ONNXSIM_*
+ * environment variables again when it starts.
+ *
+ * @param options Options of the handle
+ * @param out_handle Pointer to receive the handle (must be destroyed with onnxsim_destroy)
+ * @return Error code (ONNXSIM_SUCCESS on success)
+ */
+onnxsim_error_t onnxsim_create(const onnxsim_options_t* options,
+                               onnxsim_handle_t* out_handle);
+
+/**
+ * Destroy a handle. No call may be using it.
+ *
+ * @param handle Handle to destroy (NULL is ignored)
+ */
+void onnxsim_destroy(onnxsim_handle_t handle);
+
+/**
+ * Simplify an ONNX model from bytes with the options and state of a handle.
+ *
+ * @param handle Handle created by onnxsim_create
+ * @param model_bytes Pointer to the serialized model protobuf bytes
+ * @param model_bytes_len Length of the model bytes
+ * @param out_bytes Pointer to receive output bytes (must be freed with onnxsim_free_string)
+ * @param out_bytes_len Pointer to receive output bytes length
+ * @return Error code (ONNXSIM_SUCCESS on success)
+ */
+onnxsim_error_t onnxsim_handle_simplify_bytes(
+    onnxsim_handle_t handle,
+    const uint8_t* model_bytes,
+    size_t model_bytes_len,
+    uint8_t** out_bytes,
+    size_t* out_bytes_len);
+
+/**
+ * Simplify an ONNX model from file path with the options and state of a
+ * handle.
+ *
+ * @param handle Handle created by onnxsim_create
+ * @param in_path Path to the input ONNX model file
+ * @param out_path Path to save the simplified ONNX model
+ * @return Error code (ONNXSIM_SUCCESS on success)
+ */
+onnxsim_error_t onnxsim_handle_simplify_file(
+    onnxsim_handle_t handle,
+    const char* in_path,
+    const char* out_path);
+
+/**
+ * Simplify an ONNX model from bytes with the options and state of a handle,
+ * keeping the result unserialized. The model is parsed in place from
+ * model_bytes, which can be freed when the call returns. Query the size of
+ * the result with onnxsim_result_size, then serialize it straight into a
+ * buffer of the caller with onnxsim_result_write.
+ *
+ * @param handle Handle created by onnxsim_create
+ * @param model_bytes Pointer to the serialized model protobuf bytes
+ * @param model_bytes_len Length of the model bytes
+ * @param out_result Pointer to receive the result (must be freed with onnxsim_result_free)
+ * @return Error code (ONNXSIM_SUCCESS on success)
+ */
+onnxsim_error_t onnxsim_handle_simplify(
+    onnxsim_handle_t handle,
+    const uint8_t* model_bytes,
+    size_t model_bytes_len,
+    onnxsim_result_t* out_result);
+
+/**
+ * Get the size of the serialized result.
+ *
+ * @param result Result of onnxsim_handle_simplify
+ * @return Size in bytes
+ */
+size_t onnxsim_result_size(onnxsim_result_t result);
+
+/**
+ * Serialize the result into a buffer provided by the caller.
+ *
+ * @param result Result of onnxsim_handle_simplify
+ * @param buffer Buffer to write the serialized model to
+ * @param buffer_len Length of the buffer, at least onnxsim_result_size(result)
+ * @return Error code (ONNXSIM_ERROR_BUFFER_TOO_SMALL if buffer_len is too small)
+ */
+onnxsim_error_t onnxsim_result_write(
+    onnxsim_result_t result,
+    uint8_t* buffer,
+    size_t buffer_len);
+
+/**
+ * Free a result.
+ *
+ * @param result Result to free (NULL is ignored)
+ */
+void onnxsim_result_free(onnxsim_result_t result);
+
+/**
+ * Start simplifying an ONNX model from bytes with the options and state of a
+ * handle on a background thread. The model is parsed before the call
+ * returns, so model_bytes can be freed afterwards; the handle can be
+ * destroyed while the job runs.
+ *
+ * @param handle Handle created by onnxsim_create
+ * @param model_bytes Pointer to the serialized model protobuf bytes
+ * @param model_bytes_len Length of the model bytes
+ * @param progress_fn Called after every folded node and fixed point iteration, from the job thread or the folding threads of the handle but never concurrently (NULL for none)
+ * @param cancel_fn Polled between the passes and between the folded nodes, possibly by several folding threads at once (NULL for none)
+ * @param user_data Passed to progress_fn and cancel_fn
+ * @param out_job Pointer to receive the job (must be freed with onnxsim_job_free)
+ * @return Error code (ONNXSIM_SUCCESS on success)
+ */
+onnxsim_error_t onnxsim_handle_simplify_async(
+    onnxsim_handle_t handle,
+    const uint8_t* model_bytes,
+    size_t model_bytes_len,
+    onnxsim_progress_fn progress_fn,
+    onnxsim_cancel_fn cancel_fn,
+    void* user_data,
+    onnxsim_job_t* out_job);
+
+/**
+ * Check whether a job has finished, without blocking.
+ *
+ * @param job Job of onnxsim_handle_simplify_async
+ * @return 1 if the job has finished, 0 if it is running
+ */
+int onnxsim_job_poll(onnxsim_job_t job);
+
+/**
+ * Wait for a job to finish and take its result.
+ *
+ * @param job Job of onnxsim_handle_simplify_async
+ * @param out_result Pointer to receive the result (must be freed with onnxsim_result_free), NULL to only wait
+ * @return Error code of the job (ONNXSIM_ERROR_CANCELLED if it was cancelled)
+ */
+onnxsim_error_t onnxsim_job_wait(onnxsim_job_t job,
+                                 onnxsim_result_t* out_result);
+
+/**
+ * Ask a job to stop at its next cancellation point.
+ *
+ * @param job Job of onnxsim_handle_simplify_async
+ */
+void onnxsim_job_cancel(onnxsim_job_t job);
+
+/**
+ * Free a job, cancelling it and waiting for it if it is still running.
+ *
+ * @param job Job to free (NULL is ignored)
+ */
+void onnxsim_job_free(onnxsim_job_t job);
+
+/**
+ * Simplify several ONNX models from bytes concurrently with the same
+ * options. The models share one op result cache, and at most max_parallel
+ * of them are simplified at once on an internal thread pool.
+ *
+ * @param model_bytes Array of pointers to the serialized model protobuf bytes
+ * @param model_bytes_lens Array of the lengths of the model bytes
+ * @param num_models Number of models
+ * @param options Options of the simplifications
+ * @param max_parallel Maximum number of models simplified at once (0 for the number of cores)
+ * @param out_bytes Array receiving the output bytes of every model, NULL for failed models (each must be freed with onnxsim_free_string)
+ * @param out_bytes_lens Array receiving the output bytes length of every model
+ * @param out_errors Array receiving the error code of every model
+ * @param out_error_messages Array receiving the error message of every model, NULL for successful models (each must be freed with onnxsim_free_string), or NULL
+ * @return Error code (ONNXSIM_SUCCESS if all models were simplified)
+ */
+onnxsim_error_t onnxsim_simplify_many(
+    const uint8_t* const* model_bytes,
+    const size_t* model_bytes_lens,
+    size_t num_models,
+    const onnxsim_options_t* options,
+    size_t max_parallel,
+    uint8_t** out_bytes,
+    size_t* out_bytes_lens,
+    onnxsim_error_t* out_errors,
+    char** out_error_messages);
+
 /**
  * Free a string/bytes allocated by onnxsim functions.
  *
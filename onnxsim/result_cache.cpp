@@ -0,0 +1,256 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t RotateRight(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+}  // namespace
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+             0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+void Sha256::Transform(const uint8_t* block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t{block[4 * i]} << 24) | (uint32_t{block[4 * i + 1]} << 16) |
+           (uint32_t{block[4 * i + 2]} << 8) | uint32_t{block[4 * i + 3]};
+  }
+  for (int i = 16; i < 64; i++) {
+    const uint32_t s0 = RotateRight(w[i - 15], 7) ^
+                        RotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    const uint32_t s1 = RotateRight(w[i - 2], 17) ^
+                        RotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3],
+           e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+  for (int i = 0; i < 64; i++) {
+    const uint32_t s1 =
+        RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+    const uint32_t ch = (e & f) ^ (~e & g);
+    const uint32_t t1 = h + s1 + ch + kRoundConstants[i] + w[i];
+    const uint32_t s0 =
+        RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+    const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    const uint32_t t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state_[0] += a;
+  state_[1] += b;
+  state_[2] += c;
+  state_[3] += d;
+  state_[4] += e;
+  state_[5] += f;
+  state_[6] += g;
+  state_[7] += h;
+}
+
+void Sha256::Update(std::string_view data) {
+  total_size_ += data.size();
+  const auto* p = reinterpret_cast<const uint8_t*>(data.data());
+  size_t n = data.size();
+  if (buffer_size_ > 0) {
+    const size_t size = std::min(n, sizeof(buffer_) - buffer_size_);
+    std::memcpy(buffer_ + buffer_size_, p, size);
+    buffer_size_ += size;
+    p += size;
+    n -= size;
+    if (buffer_size_ < sizeof(buffer_)) {
+      return;
+    }
+    Transform(buffer_);
+    buffer_size_ = 0;
+  }
+  for (; n >= sizeof(buffer_); p += sizeof(buffer_), n -= sizeof(buffer_)) {
+    Transform(p);
+  }
+  std::memcpy(buffer_, p, n);
+  buffer_size_ = n;
+}
+
+std::string Sha256::HexDigest() {
+  const uint64_t bits = total_size_ * 8;
+  // 0x80, zeros up to 56 mod 64, then the big endian bit length
+  std::string padding(1, '\x80');
+  padding.resize((119 - total_size_ % 64) % 64 + 1, '\0');
+  for (int i = 7; i >= 0; i--) {
+    padding.push_back(static_cast<char>(bits >> (8 * i)));
+  }
+  Update(padding);
+  std::string digest;
+  constexpr char kHex[] = "0123456789abcdef";
+  for (const auto x : state_) {
+    for (int i = 28; i >= 0; i -= 4) {
+      digest.push_back(kHex[(x >> i) & 0xf]);
+    }
+  }
+  return digest;
+}
+
+ResultCache::ResultCache(std::string dir, size_t max_bytes)
+    : dir_(std::move(dir)), max_bytes_(max_bytes) {
+  fs::create_directories(dir_);
+}
+
+std::string ResultCache::Path(const std::string& key) const {
+  return (fs::path(dir_) / (key + ".onnx")).string();
+}
+
+std::optional<std::string> ResultCache::Get(const std::string& key) const {
+  const auto path = Path(key);
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  if (!ifs) {
+    return std::nullopt;
+  }
+  std::ostringstream oss;
+  oss << ifs.rdbuf();
+  // mark the entry as recently used, it may have been evicted meanwhile
+  std::error_code ec;
+  fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+  return std::move(oss).str();
+}
+
+void ResultCache::Put(const std::string& key, const std::string& value) const {
+  static std::atomic<size_t> counter{0};
+  // unique among the processes and threads writing the same entry
+  std::ostringstream tmp_name;
+  tmp_name << key << ".tmp."
+           << std::chrono::steady_clock::now().time_since_epoch().count()
+           << "." << std::hash<std::thread::id>{}(std::this_thread::get_id())
+           << "." << counter++;
+  const auto tmp_path = (fs::path(dir_) / tmp_name.str()).string();
+  {
+    std::ofstream ofs(tmp_path,
+                      std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!ofs.write(value.data(), value.size()) || !ofs.flush()) {
+      std::error_code ec;
+      fs::remove(tmp_path, ec);
+      return;
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp_path, Path(key), ec);
+  if (ec) {
+    fs::remove(tmp_path, ec);
+    return;
+  }
+  Evict();
+}
+
+void ResultCache::Evict() const {
+  struct Entry {
+    fs::path path;
+    fs::file_time_type time;
+    size_t size;
+  };
+  std::vector<Entry> entries;
+  size_t total_bytes = 0;
+  const auto now = fs::file_time_type::clock::now();
+  std::error_code ec;
+  for (auto it = fs::directory_iterator(dir_, ec);
+       !ec && it != fs::directory_iterator(); it.increment(ec)) {
+    const auto& x = *it;
+    const bool is_tmp =
+        x.path().filename().string().find(".tmp.") != std::string::npos;
+    if (!is_tmp && x.path().extension() != ".onnx") {
+      continue;
+    }
+    std::error_code entry_ec;
+    const auto size = x.file_size(entry_ec);
+    const auto time = x.last_write_time(entry_ec);
+    if (entry_ec) {
+      // removed by another process
+      continue;
+    }
+    if (is_tmp) {
+      // an entry being written, or left by a writer that died an hour ago
+      if (now - time > std::chrono::hours(1)) {
+        fs::remove(x.path(), entry_ec);
+      } else {
+        total_bytes += size;
+      }
+      continue;
+    }
+    entries.push_back({x.path(), time, size});
+    total_bytes += size;
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const auto& a, const auto& b) { return a.time < b.time; });
+  for (const auto& x : entries) {
+    if (total_bytes <= max_bytes_) {
+      break;
+    }
+    fs::remove(x.path, ec);
+    total_bytes -= x.size;
+  }
+}
+
+OpResultCache::OpResultCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+std::optional<std::vector<onnx::TensorProto>> OpResultCache::Get(
+    const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(key);
+  if (it == index_.end()) {
+    return std::nullopt;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->outputs;
+}
+
+void OpResultCache::Put(const std::string& key,
+                        std::vector<onnx::TensorProto> outputs) {
+  size_t size = key.size();
+  for (const auto& x : outputs) {
+    size += x.ByteSizeLong();
+  }
+  if (size > max_bytes_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (index_.count(key) > 0) {
+    return;
+  }
+  entries_.push_front({key, std::move(outputs), size});
+  index_[key] = entries_.begin();
+  total_bytes_ += size;
+  while (total_bytes_ > max_bytes_) {
+    total_bytes_ -= entries_.back().size;
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+  }
+}
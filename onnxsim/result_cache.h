@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <onnx/onnx_pb.h>
+
+// SHA-256 of a stream of bytes.
+class Sha256 {
+ public:
+  Sha256();
+
+  void Update(std::string_view data);
+
+  // The hex digest, the object must not be updated afterwards.
+  std::string HexDigest();
+
+ private:
+  void Transform(const uint8_t* block);
+
+  uint32_t state_[8];
+  uint8_t buffer_[64];
+  size_t buffer_size_ = 0;
+  uint64_t total_size_ = 0;
+};
+
+// A directory of simplified models keyed by the hash of their inputs. It can
+// be shared by concurrent processes: the entries are written to temporary
+// files and renamed into place, so readers only see complete entries. When
+// the entries exceed `max_bytes` in total, the least recently used ones are
+// removed; the modification time of an entry is its last use. The temporary
+// files count toward the size, and are removed after an hour. Only the
+// constructor throws, when the directory cannot be created.
+class ResultCache {
+ public:
+  ResultCache(std::string dir, size_t max_bytes);
+
+  std::optional<std::string> Get(const std::string& key) const;
+
+  void Put(const std::string& key, const std::string& value) const;
+
+ private:
+  std::string Path(const std::string& key) const;
+
+  void Evict() const;
+
+  std::string dir_;
+  size_t max_bytes_;
+};
+
+// The outputs of folded ops in memory, keyed by the hash of the op and its
+// inputs, so that a caller simplifying many similar models evaluates the
+// repeated ops once. When the outputs exceed `max_bytes` in total, the least
+// recently used entries are removed. Thread safe.
+class OpResultCache {
+ public:
+  explicit OpResultCache(size_t max_bytes);
+
+  std::optional<std::vector<onnx::TensorProto>> Get(const std::string& key);
+
+  void Put(const std::string& key, std::vector<onnx::TensorProto> outputs);
+
+ private:
+  struct Entry {
+    std::string key;
+    std::vector<onnx::TensorProto> outputs;
+    size_t size;
+  };
+
+  std::mutex mutex_;
+  // the most recently used first
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t max_bytes_;
+  size_t total_bytes_ = 0;
+};
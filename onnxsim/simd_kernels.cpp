@@ -0,0 +1,523 @@
+#include "simd_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ONNXSIM_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define ONNXSIM_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+enum class SimdLevel { kScalar, kAvx2, kAvx512, kNeon };
+
+SimdLevel DetectSimdLevel() {
+  SimdLevel level = SimdLevel::kScalar;
+#if defined(ONNXSIM_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+    level = SimdLevel::kAvx2;
+  }
+  if (level == SimdLevel::kAvx2 && __builtin_cpu_supports("avx512f")) {
+    level = SimdLevel::kAvx512;
+  }
+#elif defined(ONNXSIM_NEON)
+  level = SimdLevel::kNeon;
+#endif
+  if (const char* env = std::getenv("ONNXSIM_SIMD"); env != nullptr) {
+    const std::string max_level = env;
+    if (max_level == "scalar") {
+      level = SimdLevel::kScalar;
+    } else if (max_level == "avx2" && level == SimdLevel::kAvx512) {
+      level = SimdLevel::kAvx2;
+    }
+  }
+  return level;
+}
+
+SimdLevel GetSimdLevel() {
+  static const SimdLevel level = DetectSimdLevel();
+  return level;
+}
+
+inline float Apply(BinaryOp op, float a, float b) {
+  switch (op) {
+    case BinaryOp::kAdd:
+      return a + b;
+    case BinaryOp::kSub:
+      return a - b;
+    case BinaryOp::kMul:
+      return a * b;
+    case BinaryOp::kDiv:
+      return a / b;
+  }
+  return 0;
+}
+
+inline float Apply(UnaryOp op, float x) {
+  switch (op) {
+    case UnaryOp::kSqrt:
+      return std::sqrt(x);
+    case UnaryOp::kReciprocal:
+      return 1.0f / x;
+  }
+  return 0;
+}
+
+// Processes the elements from `i` on, used for the tails of the vector loops.
+void BinaryScalar(BinaryOp op, const float* a, bool a_scalar, const float* b,
+                  bool b_scalar, float* out, size_t i, size_t n) {
+  for (; i < n; i++) {
+    out[i] = Apply(op, a[a_scalar ? 0 : i], b[b_scalar ? 0 : i]);
+  }
+}
+
+void UnaryScalar(UnaryOp op, const float* x, float* out, size_t i, size_t n) {
+  for (; i < n; i++) {
+    out[i] = Apply(op, x[i]);
+  }
+}
+
+uint16_t F32ToF16Scalar(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  const uint16_t sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+  if (x >= 0x7f800000) {
+    // inf stays inf, every NaN becomes a quiet NaN
+    return sign | (x > 0x7f800000 ? 0x7e00 : 0x7c00);
+  }
+  if (x >= 0x477ff000) {
+    // rounds to a value beyond the largest half
+    return sign | 0x7c00;
+  }
+  if (x < 0x38800000) {
+    // a subnormal half (or zero): add 0.5 so that the float addition does
+    // the round to nearest even, the half bits end up in the low bits
+    float magic;
+    const uint32_t magic_bits = 0x3f000000;
+    std::memcpy(&magic, &magic_bits, sizeof(magic));
+    float y;
+    std::memcpy(&y, &x, sizeof(y));
+    y += magic;
+    uint32_t bits;
+    std::memcpy(&bits, &y, sizeof(bits));
+    return sign | static_cast<uint16_t>(bits - magic_bits);
+  }
+  // a normal half: rebias the exponent and round the 13 dropped bits
+  const uint32_t odd = (x >> 13) & 1;
+  x += 0xc8000fff + odd;
+  return sign | static_cast<uint16_t>(x >> 13);
+}
+
+float F16ToF32Scalar(uint16_t h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  const uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    // a subnormal half is a normal float
+    uint32_t e = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      e--;
+    }
+    x = sign | (e << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+#if defined(ONNXSIM_X86)
+#define ONNXSIM_VECTOR_BINARY(kWidth, Vec, Load, Store, Set1, Add, Sub, Mul, \
+                              Div)                                           \
+  size_t i = 0;                                                              \
+  const Vec va = Set1(a[0]);                                                 \
+  const Vec vb = Set1(b[0]);                                                 \
+  for (; i + kWidth <= n; i += kWidth) {                                     \
+    const Vec x = a_scalar ? va : Load(a + i);                               \
+    const Vec y = b_scalar ? vb : Load(b + i);                               \
+    Vec z;                                                                   \
+    switch (op) {                                                            \
+      case BinaryOp::kAdd:                                                   \
+        z = Add(x, y);                                                       \
+        break;                                                               \
+      case BinaryOp::kSub:                                                   \
+        z = Sub(x, y);                                                       \
+        break;                                                               \
+      case BinaryOp::kMul:                                                   \
+        z = Mul(x, y);                                                       \
+        break;                                                               \
+      default:                                                               \
+        z = Div(x, y);                                                       \
+        break;                                                               \
+    }                                                                        \
+    Store(out + i, z);                                                       \
+  }                                                                          \
+  BinaryScalar(op, a, a_scalar, b, b_scalar, out, i, n);
+
+__attribute__((target("avx2"))) void BinaryAvx2(BinaryOp op, const float* a,
+                                                bool a_scalar, const float* b,
+                                                bool b_scalar, float* out,
+                                                size_t n) {
+  ONNXSIM_VECTOR_BINARY(8, __m256, _mm256_loadu_ps, _mm256_storeu_ps,
+                        _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps,
+                        _mm256_mul_ps, _mm256_div_ps)
+}
+
+__attribute__((target("avx512f"))) void BinaryAvx512(
+    BinaryOp op, const float* a, bool a_scalar, const float* b, bool b_scalar,
+    float* out, size_t n) {
+  ONNXSIM_VECTOR_BINARY(16, __m512, _mm512_loadu_ps, _mm512_storeu_ps,
+                        _mm512_set1_ps, _mm512_add_ps, _mm512_sub_ps,
+                        _mm512_mul_ps, _mm512_div_ps)
+}
+
+#undef ONNXSIM_VECTOR_BINARY
+
+__attribute__((target("avx2"))) void UnaryAvx2(UnaryOp op, const float* x,
+                                               float* out, size_t n) {
+  size_t i = 0;
+  const __m256 one = _mm256_set1_ps(1.0f);
+  for (; i + 8 <= n; i += 8) {
+    const __m256 v = _mm256_loadu_ps(x + i);
+    _mm256_storeu_ps(out + i, op == UnaryOp::kSqrt ? _mm256_sqrt_ps(v)
+                                                   : _mm256_div_ps(one, v));
+  }
+  UnaryScalar(op, x, out, i, n);
+}
+
+__attribute__((target("avx512f"))) void UnaryAvx512(UnaryOp op,
+                                                    const float* x, float* out,
+                                                    size_t n) {
+  size_t i = 0;
+  const __m512 one = _mm512_set1_ps(1.0f);
+  for (; i + 16 <= n; i += 16) {
+    const __m512 v = _mm512_loadu_ps(x + i);
+    _mm512_storeu_ps(out + i, op == UnaryOp::kSqrt ? _mm512_sqrt_ps(v)
+                                                   : _mm512_div_ps(one, v));
+  }
+  UnaryScalar(op, x, out, i, n);
+}
+
+__attribute__((target("avx2,f16c"))) void F32ToF16F16c(const float* x,
+                                                       uint16_t* out,
+                                                       size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(x + i),
+                                      _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), h);
+  }
+  for (; i < n; i++) {
+    out[i] = F32ToF16Scalar(x[i]);
+  }
+}
+
+__attribute__((target("avx2,f16c"))) void F16ToF32F16c(const uint16_t* x,
+                                                       float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i h =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(h));
+  }
+  for (; i < n; i++) {
+    out[i] = F16ToF32Scalar(x[i]);
+  }
+}
+#endif
+
+#if defined(ONNXSIM_NEON)
+void BinaryNeon(BinaryOp op, const float* a, bool a_scalar, const float* b,
+                bool b_scalar, float* out, size_t n) {
+  size_t i = 0;
+  const float32x4_t va = vdupq_n_f32(a[0]);
+  const float32x4_t vb = vdupq_n_f32(b[0]);
+  for (; i + 4 <= n; i += 4) {
+    const float32x4_t x = a_scalar ? va : vld1q_f32(a + i);
+    const float32x4_t y = b_scalar ? vb : vld1q_f32(b + i);
+    float32x4_t z;
+    switch (op) {
+      case BinaryOp::kAdd:
+        z = vaddq_f32(x, y);
+        break;
+      case BinaryOp::kSub:
+        z = vsubq_f32(x, y);
+        break;
+      case BinaryOp::kMul:
+        z = vmulq_f32(x, y);
+        break;
+      default:
+        z = vdivq_f32(x, y);
+        break;
+    }
+    vst1q_f32(out + i, z);
+  }
+  BinaryScalar(op, a, a_scalar, b, b_scalar, out, i, n);
+}
+
+void UnaryNeon(UnaryOp op, const float* x, float* out, size_t n) {
+  size_t i = 0;
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  for (; i + 4 <= n; i += 4) {
+    const float32x4_t v = vld1q_f32(x + i);
+    vst1q_f32(out + i,
+              op == UnaryOp::kSqrt ? vsqrtq_f32(v) : vdivq_f32(one, v));
+  }
+  UnaryScalar(op, x, out, i, n);
+}
+
+void F32ToF16Neon(const float* x, uint16_t* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    // FPCR is round to nearest even unless changed
+    const float16x4_t h = vcvt_f16_f32(vld1q_f32(x + i));
+    vst1_u16(out + i, vreinterpret_u16_f16(h));
+  }
+  for (; i < n; i++) {
+    out[i] = F32ToF16Scalar(x[i]);
+  }
+}
+
+void F16ToF32Neon(const uint16_t* x, float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(x + i))));
+  }
+  for (; i < n; i++) {
+    out[i] = F16ToF32Scalar(x[i]);
+  }
+}
+#endif
+
+template <typename T>
+void TransposeBlock(const T* x, T* out, size_t rows, size_t cols) {
+  // tiles keep both the reads and the writes within a few cache lines
+  constexpr size_t kTile = 32;
+  for (size_t r0 = 0; r0 < rows; r0 += kTile) {
+    for (size_t c0 = 0; c0 < cols; c0 += kTile) {
+      const size_t r1 = std::min(r0 + kTile, rows);
+      const size_t c1 = std::min(c0 + kTile, cols);
+      for (size_t c = c0; c < c1; c++) {
+        for (size_t r = r0; r < r1; r++) {
+          out[c * rows + r] = x[r * cols + c];
+        }
+      }
+    }
+  }
+}
+
+template <typename T>
+void TransposeGeneric(const T* x, T* out, const std::vector<int64_t>& dims,
+                      const std::vector<int64_t>& perm) {
+  const size_t rank = dims.size();
+  std::vector<size_t> in_strides(rank, 1);
+  for (size_t i = rank; i-- > 1;) {
+    in_strides[i - 1] = in_strides[i] * dims[i];
+  }
+  // the input stride and the size of each output dim
+  std::vector<size_t> strides(rank);
+  std::vector<size_t> out_dims(rank);
+  size_t n = 1;
+  for (size_t i = 0; i < rank; i++) {
+    strides[i] = in_strides[perm[i]];
+    out_dims[i] = dims[perm[i]];
+    n *= out_dims[i];
+  }
+  if (rank == 0) {
+    out[0] = x[0];
+    return;
+  }
+  if (n == 0) {
+    return;
+  }
+  // batches of matrices that are transposed as a whole
+  if (rank >= 2 && strides[rank - 2] == 1 &&
+      strides[rank - 1] == out_dims[rank - 2]) {
+    const size_t rows = out_dims[rank - 1];
+    const size_t cols = out_dims[rank - 2];
+    std::vector<size_t> counter(rank - 2, 0);
+    size_t offset = 0;
+    for (size_t done = 0; done < n; done += rows * cols) {
+      TransposeBlock(x + offset, out + done, rows, cols);
+      for (size_t i = rank - 2; i-- > 0;) {
+        offset += strides[i];
+        if (++counter[i] < out_dims[i]) {
+          break;
+        }
+        offset -= strides[i] * counter[i];
+        counter[i] = 0;
+      }
+    }
+    return;
+  }
+  std::vector<size_t> counter(rank, 0);
+  size_t offset = 0;
+  const size_t inner_dim = out_dims[rank - 1];
+  const size_t inner_stride = strides[rank - 1];
+  for (size_t done = 0; done < n; done += inner_dim) {
+    for (size_t j = 0; j < inner_dim; j++) {
+      out[done + j] = x[offset + j * inner_stride];
+    }
+    for (size_t i = rank - 1; i-- > 0;) {
+      offset += strides[i];
+      if (++counter[i] < out_dims[i]) {
+        break;
+      }
+      offset -= strides[i] * counter[i];
+      counter[i] = 0;
+    }
+  }
+}
+
+// Merges the input dims that stay adjacent and in order in the output and
+// drops the dims of size 1, which turns most transposes into a (batched)
+// matrix transpose.
+void SimplifyPermutation(const std::vector<int64_t>& dims,
+                         const std::vector<int64_t>& perm,
+                         std::vector<int64_t>& new_dims,
+                         std::vector<int64_t>& new_perm) {
+  std::vector<int64_t> kept;
+  for (const auto p : perm) {
+    if (dims[p] != 1) {
+      kept.push_back(p);
+    }
+  }
+  // groups of consecutive input dims, in output order
+  std::vector<std::vector<int64_t>> groups;
+  for (const auto p : kept) {
+    if (!groups.empty() && groups.back().back() + 1 == p) {
+      groups.back().push_back(p);
+    } else {
+      groups.push_back({p});
+    }
+  }
+  std::vector<size_t> order(groups.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  // the groups sorted by their first input dim give the merged input dims
+  std::sort(order.begin(), order.end(), [&groups](size_t a, size_t b) {
+    return groups[a][0] < groups[b][0];
+  });
+  new_dims.assign(groups.size(), 1);
+  new_perm.assign(groups.size(), 0);
+  for (size_t i = 0; i < order.size(); i++) {
+    for (const auto p : groups[order[i]]) {
+      new_dims[i] *= dims[p];
+    }
+    new_perm[order[i]] = i;
+  }
+}
+
+}  // namespace
+
+void BinaryF32(BinaryOp op, const float* a, bool a_scalar, const float* b,
+               bool b_scalar, float* out, size_t n) {
+  if (n == 0) {
+    return;
+  }
+  switch (GetSimdLevel()) {
+#if defined(ONNXSIM_X86)
+    case SimdLevel::kAvx512:
+      return BinaryAvx512(op, a, a_scalar, b, b_scalar, out, n);
+    case SimdLevel::kAvx2:
+      return BinaryAvx2(op, a, a_scalar, b, b_scalar, out, n);
+#elif defined(ONNXSIM_NEON)
+    case SimdLevel::kNeon:
+      return BinaryNeon(op, a, a_scalar, b, b_scalar, out, n);
+#endif
+    default:
+      return BinaryScalar(op, a, a_scalar, b, b_scalar, out, 0, n);
+  }
+}
+
+void UnaryF32(UnaryOp op, const float* x, float* out, size_t n) {
+  switch (GetSimdLevel()) {
+#if defined(ONNXSIM_X86)
+    case SimdLevel::kAvx512:
+      return UnaryAvx512(op, x, out, n);
+    case SimdLevel::kAvx2:
+      return UnaryAvx2(op, x, out, n);
+#elif defined(ONNXSIM_NEON)
+    case SimdLevel::kNeon:
+      return UnaryNeon(op, x, out, n);
+#endif
+    default:
+      return UnaryScalar(op, x, out, 0, n);
+  }
+}
+
+void F32ToF16(const float* x, uint16_t* out, size_t n) {
+  switch (GetSimdLevel()) {
+#if defined(ONNXSIM_X86)
+    case SimdLevel::kAvx512:
+    case SimdLevel::kAvx2:
+      return F32ToF16F16c(x, out, n);
+#elif defined(ONNXSIM_NEON)
+    case SimdLevel::kNeon:
+      return F32ToF16Neon(x, out, n);
+#endif
+    default:
+      for (size_t i = 0; i < n; i++) {
+        out[i] = F32ToF16Scalar(x[i]);
+      }
+  }
+}
+
+void F16ToF32(const uint16_t* x, float* out, size_t n) {
+  switch (GetSimdLevel()) {
+#if defined(ONNXSIM_X86)
+    case SimdLevel::kAvx512:
+    case SimdLevel::kAvx2:
+      return F16ToF32F16c(x, out, n);
+#elif defined(ONNXSIM_NEON)
+    case SimdLevel::kNeon:
+      return F16ToF32Neon(x, out, n);
+#endif
+    default:
+      for (size_t i = 0; i < n; i++) {
+        out[i] = F16ToF32Scalar(x[i]);
+      }
+  }
+}
+
+void Transpose(const void* x, void* out, size_t elem_size,
+               const std::vector<int64_t>& dims,
+               const std::vector<int64_t>& perm) {
+  std::vector<int64_t> new_dims;
+  std::vector<int64_t> new_perm;
+  SimplifyPermutation(dims, perm, new_dims, new_perm);
+  switch (elem_size) {
+    case 1:
+      return TransposeGeneric(static_cast<const uint8_t*>(x),
+                              static_cast<uint8_t*>(out), new_dims, new_perm);
+    case 2:
+      return TransposeGeneric(static_cast<const uint16_t*>(x),
+                              static_cast<uint16_t*>(out), new_dims,
+                              new_perm);
+    case 4:
+      return TransposeGeneric(static_cast<const uint32_t*>(x),
+                              static_cast<uint32_t*>(out), new_dims,
+                              new_perm);
+    case 8:
+      return TransposeGeneric(static_cast<const uint64_t*>(x),
+                              static_cast<uint64_t*>(out), new_dims,
+                              new_perm);
+  }
+}
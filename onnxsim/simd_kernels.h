@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Vectorized loops over the raw buffers of large constant tensors. The
+// instruction set (AVX-512, AVX2/F16C, NEON or plain C++) is selected once at
+// runtime; the environment variable ONNXSIM_SIMD=scalar|avx2|avx512 lowers
+// it, which is useful for benchmarking. All kernels compute exactly the same
+// results on every instruction set.
+
+enum class BinaryOp { kAdd, kSub, kMul, kDiv };
+
+enum class UnaryOp { kSqrt, kReciprocal };
+
+// out[i] = a[i] op b[i] for i in [0, n). A side marked as scalar is
+// broadcast, i.e. its element 0 is used for every i.
+void BinaryF32(BinaryOp op, const float* a, bool a_scalar, const float* b,
+               bool b_scalar, float* out, size_t n);
+
+void UnaryF32(UnaryOp op, const float* x, float* out, size_t n);
+
+// IEEE half precision conversions, rounding to nearest even.
+void F32ToF16(const float* x, uint16_t* out, size_t n);
+
+void F16ToF32(const uint16_t* x, float* out, size_t n);
+
+// Transposes a tensor of `dims` shape with elements of `elem_size` bytes, the
+// output dim i is the input dim perm[i].
+void Transpose(const void* x, void* out, size_t elem_size,
+               const std::vector<int64_t>& dims,
+               const std::vector<int64_t>& perm);
@@ -0,0 +1,550 @@
+#include "symbolic_shape.h"
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+// coeff * product of `symbols`, a plain number if there are no symbols. A
+// symbol is a dim_param, or a name made up for an unknown dim.
+struct SymDim {
+  int64_t coeff = 1;
+  // sorted, may contain duplicates
+  std::vector<std::string> symbols;
+
+  bool IsKnown() const { return symbols.empty(); }
+
+  bool operator==(const SymDim& other) const {
+    return coeff == other.coeff && symbols == other.symbols;
+  }
+};
+
+using OptDim = std::optional<SymDim>;
+
+// The value of a scalar or 1-D int64 tensor, std::nullopt elements are not
+// known at all.
+struct SymTensor {
+  bool scalar = false;
+  std::vector<OptDim> elems;
+
+  bool IsKnown() const {
+    return std::all_of(elems.begin(), elems.end(),
+                       [](const auto& x) { return x && x->IsKnown(); });
+  }
+};
+
+// shape computations only deal with a few elements
+constexpr size_t kMaxElements = 64;
+
+SymDim Known(int64_t value) {
+  SymDim dim;
+  dim.coeff = value;
+  return dim;
+}
+
+SymDim Symbol(std::string name) {
+  SymDim dim;
+  dim.symbols.push_back(std::move(name));
+  return dim;
+}
+
+OptDim Mul(const SymDim& a, const SymDim& b) {
+  SymDim dim;
+  dim.coeff = a.coeff * b.coeff;
+  if (dim.coeff == 0) {
+    return Known(0);
+  }
+  std::merge(a.symbols.begin(), a.symbols.end(), b.symbols.begin(),
+             b.symbols.end(), std::back_inserter(dim.symbols));
+  return dim;
+}
+
+OptDim AddScaled(const SymDim& a, const SymDim& b, int64_t scale) {
+  // only terms of the same symbols can be added
+  if (a.coeff != 0 && b.coeff != 0 && a.symbols != b.symbols) {
+    return std::nullopt;
+  }
+  SymDim dim;
+  dim.coeff = a.coeff + scale * b.coeff;
+  if (dim.coeff != 0) {
+    dim.symbols = a.coeff != 0 ? a.symbols : b.symbols;
+  }
+  return dim;
+}
+
+OptDim Div(const SymDim& a, const SymDim& b) {
+  if (b.coeff == 0) {
+    return std::nullopt;
+  }
+  if (a.IsKnown() && b.IsKnown()) {
+    // integer division truncates, like in the executor
+    return Known(a.coeff / b.coeff);
+  }
+  // exact only if b divides every possible value of a
+  if (a.coeff % b.coeff != 0 ||
+      !std::includes(a.symbols.begin(), a.symbols.end(), b.symbols.begin(),
+                     b.symbols.end())) {
+    return std::nullopt;
+  }
+  SymDim dim;
+  dim.coeff = a.coeff / b.coeff;
+  std::set_difference(a.symbols.begin(), a.symbols.end(), b.symbols.begin(),
+                      b.symbols.end(), std::back_inserter(dim.symbols));
+  return dim;
+}
+
+std::optional<std::vector<int64_t>> ReadInt64s(const onnx::TensorProto& t) {
+  if (t.data_type() != onnx::TensorProto::INT64 || t.dims_size() > 1 ||
+      t.data_location() == onnx::TensorProto::EXTERNAL) {
+    return std::nullopt;
+  }
+  std::vector<int64_t> values;
+  if (t.has_raw_data()) {
+    const auto& raw = t.raw_data();
+    // raw_data is little endian
+    const uint16_t one = 1;
+    if (raw.size() % sizeof(int64_t) != 0 ||
+        *reinterpret_cast<const uint8_t*>(&one) != 1) {
+      return std::nullopt;
+    }
+    values.resize(raw.size() / sizeof(int64_t));
+    std::memcpy(values.data(), raw.data(), raw.size());
+  } else {
+    values.assign(t.int64_data().begin(), t.int64_data().end());
+  }
+  const size_t expected = t.dims_size() == 0 ? 1 : t.dims(0);
+  if (values.size() != expected || values.size() > kMaxElements) {
+    return std::nullopt;
+  }
+  return values;
+}
+
+class SymbolicShapeFolder {
+ public:
+  explicit SymbolicShapeFolder(onnx::ModelProto& model)
+      : graph_(*model.mutable_graph()) {
+    for (const auto& x : graph_.value_info()) {
+      types_.emplace(x.name(), &x.type());
+    }
+    for (const auto& x : graph_.input()) {
+      types_.emplace(x.name(), &x.type());
+    }
+    for (const auto& x : graph_.output()) {
+      types_.emplace(x.name(), &x.type());
+    }
+    for (const auto& x : graph_.initializer()) {
+      names_.insert(x.name());
+      initializers_.emplace(x.name(), &x);
+      if (const auto values = ReadInt64s(x)) {
+        values_[x.name()] = FromInts(*values, x.dims_size() == 0);
+      }
+    }
+    for (const auto& x : graph_.input()) {
+      names_.insert(x.name());
+    }
+    for (const auto& node : graph_.node()) {
+      names_.insert(node.output().begin(), node.output().end());
+    }
+  }
+
+  bool Run() {
+    // node is already topo sorted
+    for (const auto& node : graph_.node()) {
+      Evaluate(node);
+    }
+    std::vector<std::pair<std::string, std::vector<int64_t>>> known;
+    std::vector<std::tuple<int, std::string, std::vector<int64_t>>>
+        reshapes;
+    for (int i = 0; i < graph_.node_size(); i++) {
+      const auto& node = graph_.node(i);
+      if (node.op_type() == "Constant") {
+        continue;
+      }
+      bool all_known = node.output_size() > 0;
+      for (const auto& x : node.output()) {
+        const auto it = values_.find(x);
+        all_known &= it != values_.end() && it->second.IsKnown() &&
+                     initializers_.find(x) == initializers_.end();
+      }
+      if (all_known) {
+        for (const auto& x : node.output()) {
+          known.emplace_back(x, ToInts(values_.at(x)));
+        }
+      } else if (node.op_type() == "Reshape" && node.input_size() == 2) {
+        if (auto shape = GetStaticReshapeShape(node)) {
+          reshapes.emplace_back(i, node.input(1), std::move(*shape));
+        }
+      }
+    }
+    for (const auto& [name, values] : known) {
+      AddInitializer(name, values, values_.at(name).scalar);
+    }
+    for (const auto& [i, shape_name, values] : reshapes) {
+      const auto name = UniqueName(shape_name + "_static");
+      AddInitializer(name, values, false);
+      graph_.mutable_node(i)->set_input(1, name);
+    }
+    // the replaced outputs must not be produced by nodes anymore
+    if (!known.empty()) {
+      std::unordered_set<std::string> replaced;
+      for (const auto& x : known) {
+        replaced.insert(x.first);
+      }
+      auto* nodes = graph_.mutable_node();
+      nodes->erase(std::remove_if(nodes->begin(), nodes->end(),
+                                  [&replaced](const auto& node) {
+                                    return std::any_of(
+                                        node.output().begin(),
+                                        node.output().end(),
+                                        [&replaced](const auto& x) {
+                                          return replaced.count(x) > 0;
+                                        });
+                                  }),
+                   nodes->end());
+    }
+    return !known.empty() || !reshapes.empty();
+  }
+
+ private:
+  static SymTensor FromInts(const std::vector<int64_t>& values, bool scalar) {
+    SymTensor t;
+    t.scalar = scalar;
+    for (const auto x : values) {
+      t.elems.push_back(Known(x));
+    }
+    return t;
+  }
+
+  static std::vector<int64_t> ToInts(const SymTensor& t) {
+    std::vector<int64_t> values;
+    for (const auto& x : t.elems) {
+      values.push_back(x->coeff);
+    }
+    return values;
+  }
+
+  // The dims of `name`, std::nullopt if its rank is not known.
+  std::optional<std::vector<SymDim>> GetDims(const std::string& name) const {
+    if (const auto it = initializers_.find(name); it != initializers_.end()) {
+      std::vector<SymDim> dims;
+      for (const auto dim : it->second->dims()) {
+        dims.push_back(Known(dim));
+      }
+      return dims;
+    }
+    const auto it = types_.find(name);
+    if (it == types_.end() || !it->second->has_tensor_type() ||
+        !it->second->tensor_type().has_shape()) {
+      return std::nullopt;
+    }
+    std::vector<SymDim> dims;
+    const auto& shape = it->second->tensor_type().shape();
+    for (int i = 0; i < shape.dim_size(); i++) {
+      const auto& dim = shape.dim(i);
+      if (dim.has_dim_value()) {
+        dims.push_back(Known(dim.dim_value()));
+      } else if (dim.has_dim_param() && !dim.dim_param().empty()) {
+        dims.push_back(Symbol(dim.dim_param()));
+      } else {
+        // an unknown dim only equals itself
+        dims.push_back(Symbol("?" + name + ":" + std::to_string(i)));
+      }
+    }
+    return dims;
+  }
+
+  const SymTensor* Find(const std::string& name) const {
+    const auto it = values_.find(name);
+    return it == values_.end() ? nullptr : &it->second;
+  }
+
+  std::optional<std::vector<int64_t>> FindInts(const std::string& name) const {
+    const auto* t = Find(name);
+    if (t == nullptr || !t->IsKnown()) {
+      return std::nullopt;
+    }
+    return ToInts(*t);
+  }
+
+  static int64_t GetInt(const onnx::NodeProto& node, const std::string& name,
+                        int64_t default_value) {
+    for (const auto& attr : node.attribute()) {
+      if (attr.name() == name) {
+        return attr.i();
+      }
+    }
+    return default_value;
+  }
+
+  static const onnx::AttributeProto* FindAttribute(
+      const onnx::NodeProto& node, const std::string& name) {
+    for (const auto& attr : node.attribute()) {
+      if (attr.name() == name) {
+        return &attr;
+      }
+    }
+    return nullptr;
+  }
+
+  // axes (or starts, ...) from the attribute of the older opsets or from
+  // the input of the newer ones, empty if neither is given
+  std::optional<std::vector<int64_t>> GetInts(const onnx::NodeProto& node,
+                                              const std::string& name,
+                                              int index) const {
+    if (const auto* attr = FindAttribute(node, name); attr != nullptr) {
+      return std::vector<int64_t>(attr->ints().begin(), attr->ints().end());
+    }
+    if (index >= node.input_size() || node.input(index).empty()) {
+      return std::vector<int64_t>();
+    }
+    return FindInts(node.input(index));
+  }
+
+  void Evaluate(const onnx::NodeProto& node) {
+    if (!node.domain().empty() && node.domain() != "ai.onnx") {
+      return;
+    }
+    if (auto result = EvaluateOp(node);
+        result && result->elems.size() <= kMaxElements &&
+        node.output_size() >= 1) {
+      values_[node.output(0)] = std::move(*result);
+    }
+  }
+
+  std::optional<SymTensor> EvaluateOp(const onnx::NodeProto& node) const {
+    const auto& op = node.op_type();
+    if (op == "Constant") {
+      const auto* value = FindAttribute(node, "value");
+      if (value != nullptr) {
+        if (const auto values = ReadInt64s(value->t())) {
+          return FromInts(*values, value->t().dims_size() == 0);
+        }
+      }
+      if (const auto* x = FindAttribute(node, "value_ints"); x != nullptr) {
+        return FromInts({x->ints().begin(), x->ints().end()}, false);
+      }
+      if (const auto* x = FindAttribute(node, "value_int"); x != nullptr) {
+        return FromInts({x->i()}, true);
+      }
+      return std::nullopt;
+    }
+    if (op == "Shape") {
+      const auto dims = GetDims(node.input(0));
+      if (!dims) {
+        return std::nullopt;
+      }
+      const int64_t rank = dims->size();
+      int64_t start = GetInt(node, "start", 0);
+      int64_t end = GetInt(node, "end", rank);
+      start = std::clamp<int64_t>(start < 0 ? start + rank : start, 0, rank);
+      end = std::clamp<int64_t>(end < 0 ? end + rank : end, 0, rank);
+      SymTensor t;
+      for (int64_t i = start; i < end; i++) {
+        t.elems.push_back((*dims)[i]);
+      }
+      return t;
+    }
+    if (node.input_size() == 0) {
+      return std::nullopt;
+    }
+    const auto* x = Find(node.input(0));
+    if (x == nullptr) {
+      return std::nullopt;
+    }
+    if (op == "Identity" ||
+        (op == "Cast" &&
+         GetInt(node, "to", 0) == onnx::TensorProto::INT64)) {
+      return *x;
+    }
+    if (op == "Gather") {
+      const auto* indices = node.input_size() == 2 ? Find(node.input(1))
+                                                   : nullptr;
+      if (x->scalar || indices == nullptr || !indices->IsKnown() ||
+          (GetInt(node, "axis", 0) != 0 && GetInt(node, "axis", 0) != -1)) {
+        return std::nullopt;
+      }
+      const int64_t n = x->elems.size();
+      SymTensor t;
+      t.scalar = indices->scalar;
+      for (auto i : ToInts(*indices)) {
+        if (i < -n || i >= n) {
+          return std::nullopt;
+        }
+        t.elems.push_back(x->elems[i < 0 ? i + n : i]);
+      }
+      return t;
+    }
+    if (op == "Slice") {
+      const auto starts = GetInts(node, "starts", 1);
+      const auto ends = GetInts(node, "ends", 2);
+      const auto axes = GetInts(node, "axes", 3);
+      auto steps = GetInts(node, "steps", 4);
+      if (x->scalar || !starts || !ends || !axes || !steps ||
+          starts->size() != 1 || ends->size() != 1 ||
+          (!axes->empty() && (*axes)[0] != 0 && (*axes)[0] != -1) ||
+          (!steps->empty() && (*steps)[0] != 1)) {
+        return std::nullopt;
+      }
+      const int64_t n = x->elems.size();
+      int64_t start = (*starts)[0];
+      int64_t end = (*ends)[0];
+      start = std::clamp<int64_t>(start < 0 ? start + n : start, 0, n);
+      end = std::clamp<int64_t>(end < 0 ? end + n : end, 0, n);
+      SymTensor t;
+      for (int64_t i = start; i < end; i++) {
+        t.elems.push_back(x->elems[i]);
+      }
+      return t;
+    }
+    if (op == "Concat") {
+      const int64_t axis = GetInt(node, "axis", 0);
+      if (axis != 0 && axis != -1) {
+        return std::nullopt;
+      }
+      SymTensor t;
+      for (const auto& name : node.input()) {
+        const auto* input = Find(name);
+        if (input == nullptr || input->scalar) {
+          return std::nullopt;
+        }
+        t.elems.insert(t.elems.end(), input->elems.begin(),
+                       input->elems.end());
+      }
+      return t;
+    }
+    if (op == "Unsqueeze") {
+      const auto axes = GetInts(node, "axes", 1);
+      if (!x->scalar || !axes || axes->size() != 1 ||
+          ((*axes)[0] != 0 && (*axes)[0] != -1)) {
+        return std::nullopt;
+      }
+      SymTensor t = *x;
+      t.scalar = false;
+      return t;
+    }
+    if (op == "Squeeze") {
+      const auto axes = GetInts(node, "axes", 1);
+      if (x->scalar || x->elems.size() != 1 || !axes ||
+          !(axes->empty() ||
+            (axes->size() == 1 && ((*axes)[0] == 0 || (*axes)[0] == -1)))) {
+        return std::nullopt;
+      }
+      SymTensor t = *x;
+      t.scalar = true;
+      return t;
+    }
+    if (op == "Add" || op == "Sub" || op == "Mul" || op == "Div") {
+      const auto* y = node.input_size() == 2 ? Find(node.input(1)) : nullptr;
+      if (y == nullptr) {
+        return std::nullopt;
+      }
+      const size_t n = std::max(x->elems.size(), y->elems.size());
+      // a scalar or a single element is broadcast
+      if ((x->elems.size() != n && x->elems.size() != 1) ||
+          (y->elems.size() != n && y->elems.size() != 1)) {
+        return std::nullopt;
+      }
+      SymTensor t;
+      t.scalar = x->scalar && y->scalar;
+      for (size_t i = 0; i < n; i++) {
+        const auto& a = x->elems[x->elems.size() == 1 ? 0 : i];
+        const auto& b = y->elems[y->elems.size() == 1 ? 0 : i];
+        if (!a || !b) {
+          t.elems.emplace_back();
+        } else if (op == "Add") {
+          t.elems.push_back(AddScaled(*a, *b, 1));
+        } else if (op == "Sub") {
+          t.elems.push_back(AddScaled(*a, *b, -1));
+        } else if (op == "Mul") {
+          t.elems.push_back(Mul(*a, *b));
+        } else {
+          t.elems.push_back(Div(*a, *b));
+        }
+      }
+      return t;
+    }
+    return std::nullopt;
+  }
+
+  // The shape input of `node` (a Reshape) as a constant with 0/-1 elements,
+  // or std::nullopt if it cannot be expressed that way.
+  std::optional<std::vector<int64_t>> GetStaticReshapeShape(
+      const onnx::NodeProto& node) const {
+    const auto* shape = Find(node.input(1));
+    if (shape == nullptr || shape->scalar || shape->IsKnown() ||
+        initializers_.find(node.input(1)) != initializers_.end()) {
+      return std::nullopt;
+    }
+    const bool allow_zero = GetInt(node, "allowzero", 0) != 0;
+    const auto data_dims = GetDims(node.input(0));
+    std::vector<int64_t> values;
+    bool has_inferred = false;
+    for (size_t i = 0; i < shape->elems.size(); i++) {
+      const auto& elem = shape->elems[i];
+      if (elem && elem->IsKnown()) {
+        if (elem->coeff == -1) {
+          if (has_inferred) {
+            return std::nullopt;
+          }
+          has_inferred = true;
+        }
+        values.push_back(elem->coeff);
+      } else if (elem && !allow_zero && data_dims &&
+                 i < data_dims->size() && (*data_dims)[i] == *elem) {
+        // the dim of the input at the same position
+        values.push_back(0);
+      } else if (!has_inferred) {
+        has_inferred = true;
+        values.push_back(-1);
+      } else {
+        return std::nullopt;
+      }
+    }
+    // with allowzero, a 0 is a real empty dim and cannot go with a -1
+    if (allow_zero && has_inferred &&
+        std::find(values.begin(), values.end(), 0) != values.end()) {
+      return std::nullopt;
+    }
+    return values;
+  }
+
+  std::string UniqueName(const std::string& base) {
+    std::string name = base;
+    for (int i = 1; names_.find(name) != names_.end(); i++) {
+      name = base + "_" + std::to_string(i);
+    }
+    names_.insert(name);
+    return name;
+  }
+
+  void AddInitializer(const std::string& name,
+                      const std::vector<int64_t>& values, bool scalar) {
+    auto* t = graph_.add_initializer();
+    t->set_name(name);
+    t->set_data_type(onnx::TensorProto::INT64);
+    if (!scalar) {
+      t->add_dims(values.size());
+    }
+    for (const auto x : values) {
+      t->add_int64_data(x);
+    }
+  }
+
+  onnx::GraphProto& graph_;
+  std::unordered_map<std::string, const onnx::TypeProto*> types_;
+  std::unordered_map<std::string, const onnx::TensorProto*> initializers_;
+  std::unordered_map<std::string, SymTensor> values_;
+  // all tensor names, for making up new ones
+  std::unordered_set<std::string> names_;
+};
+
+}  // namespace
+
+bool FoldSymbolicShapes(onnx::ModelProto& model) {
+  return SymbolicShapeFolder(model).Run();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <onnx/onnx_pb.h>
+
+// Propagates the dims of the value infos, including the symbolic ones
+// (dim_param or unknown), through the shape computations of the main graph
+// (Shape, Gather, Slice, Concat, Unsqueeze, Squeeze and integer arithmetic).
+// Each element of a computed shape is tracked as coeff * product of symbols.
+// Then:
+// - tensors whose elements all turn out to be known numbers are replaced by
+//   initializers, so e.g. `Gather(Shape(x), 2)` becomes a constant when the
+//   third dim of x is static, even if the other dims are dynamic;
+// - the shape input of a Reshape whose elements are all known up to at most
+//   one element is replaced by a constant using the 0 (copy the input dim)
+//   and -1 (infer the dim) semantics of Reshape, e.g. [batch, 12, seq, 64]
+//   becomes [0, 12, 0, 64] when batch and seq are dims 0 and 2 of the input.
+// The nodes producing the replaced tensors are removed, the nodes they
+// consumed (e.g. Shape) are left for the dead node elimination. Returns
+// whether the model was changed.
+bool FoldSymbolicShapes(onnx::ModelProto& model);
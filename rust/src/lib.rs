@@ -80,6 +80,31 @@ impl SimplifyOptions {
     }
 }
 
+/// Convert an error code and the last error message of this thread
+fn last_error(code: onnxsim_error_t) -> OnnxSimError {
+    let error_msg = unsafe {
+        let error_ptr = onnxsim_get_last_error();
+        if error_ptr.is_null() {
+            String::from("Unknown error")
+        } else {
+            CStr::from_ptr(error_ptr).to_string_lossy().into_owned()
+        }
+    };
+    to_error(code, error_msg)
+}
+
+fn to_error(code: onnxsim_error_t, error_msg: String) -> OnnxSimError {
+    match code {
+        onnxsim_error_t_ONNXSIM_ERROR_INVALID_ARGUMENT => OnnxSimError::InvalidArgument(error_msg),
+        onnxsim_error_t_ONNXSIM_ERROR_PARSE_FAILED => OnnxSimError::ParseFailed(error_msg),
+        onnxsim_error_t_ONNXSIM_ERROR_SERIALIZE_FAILED => OnnxSimError::SerializeFailed(error_msg),
+        onnxsim_error_t_ONNXSIM_ERROR_SIMPLIFICATION_FAILED => {
+            OnnxSimError::SimplificationFailed(error_msg)
+        }
+        _ => OnnxSimError::Internal(error_msg),
+    }
+}
+
 /// Initialize the ONNX environment
 ///
 /// Must be called before any other onnxsim functions.
@@ -150,28 +175,7 @@ pub fn simplify_bytes(model_bytes: &[u8], options: SimplifyOptions) -> Result<Ve
     };
 
     if result != onnxsim_error_t_ONNXSIM_SUCCESS {
-        let error_msg = unsafe {
-            let error_ptr = onnxsim_get_last_error();
-            if error_ptr.is_null() {
-                String::from("Unknown error")
-            } else {
-                CStr::from_ptr(error_ptr).to_string_lossy().into_owned()
-            }
-        };
-
-        return Err(match result {
-            onnxsim_error_t_ONNXSIM_ERROR_INVALID_ARGUMENT => {
-                OnnxSimError::InvalidArgument(error_msg)
-            }
-            onnxsim_error_t_ONNXSIM_ERROR_PARSE_FAILED => OnnxSimError::ParseFailed(error_msg),
-            onnxsim_error_t_ONNXSIM_ERROR_SERIALIZE_FAILED => {
-                OnnxSimError::SerializeFailed(error_msg)
-            }
-            onnxsim_error_t_ONNXSIM_ERROR_SIMPLIFICATION_FAILED => {
-                OnnxSimError::SimplificationFailed(error_msg)
-            }
-            _ => OnnxSimError::Internal(error_msg),
-        });
+        return Err(last_error(result));
     }
 
     // Copy the output bytes
@@ -257,29 +261,120 @@ pub fn simplify_file<P: AsRef<std::path::Path>>(
     };
 
     if result != onnxsim_error_t_ONNXSIM_SUCCESS {
-        let error_msg = unsafe {
-            let error_ptr = onnxsim_get_last_error();
-            if error_ptr.is_null() {
-                String::from("Unknown error")
-            } else {
-                CStr::from_ptr(error_ptr).to_string_lossy().into_owned()
-            }
-        };
-
-        return Err(match result {
-            onnxsim_error_t_ONNXSIM_ERROR_INVALID_ARGUMENT => {
-                OnnxSimError::InvalidArgument(error_msg)
-            }
-            onnxsim_error_t_ONNXSIM_ERROR_PARSE_FAILED => OnnxSimError::ParseFailed(error_msg),
-            onnxsim_error_t_ONNXSIM_ERROR_SERIALIZE_FAILED => {
-                OnnxSimError::SerializeFailed(error_msg)
-            }
-            onnxsim_error_t_ONNXSIM_ERROR_SIMPLIFICATION_FAILED => {
-                OnnxSimError::SimplificationFailed(error_msg)
-            }
-            _ => OnnxSimError::Internal(error_msg),
-        });
+        return Err(last_error(result));
     }
 
     Ok(())
 }
+
+/// Simplify several ONNX models from bytes concurrently
+///
+/// The models are simplified with the same options on an internal pool of
+/// at most `max_parallel` threads (0 for the number of cores), and share one
+/// cache of folded ops.
+///
+/// # Arguments
+///
+/// * `models` - The serialized model protobuf bytes of every model
+/// * `options` - Simplification options
+/// * `max_parallel` - Maximum number of models simplified at once
+///
+/// # Returns
+///
+/// The simplified model or the error of every model, in the order of `models`
+///
+/// # Example
+///
+/// ```no_run
+/// use onnxsim::{init_env, simplify_many, SimplifyOptions};
+///
+/// init_env();
+/// let shards: Vec<Vec<u8>> = (0..4)
+///     .map(|i| std::fs::read(format!("shard{}.onnx", i)).unwrap())
+///     .collect();
+/// for result in simplify_many(&shards, SimplifyOptions::default(), 0).unwrap() {
+///     let _simplified = result.unwrap();
+/// }
+/// ```
+pub fn simplify_many<M: AsRef<[u8]>>(
+    models: &[M],
+    options: SimplifyOptions,
+    max_parallel: usize,
+) -> Result<Vec<Result<Vec<u8>>>> {
+    init_env();
+
+    // Prepare skip optimizers
+    let skip_optimizers = options.skip_optimizers.unwrap_or_default();
+    let skip_optimizers_cstrings: Result<Vec<CString>> = skip_optimizers
+        .iter()
+        .map(|s| CString::new(s.as_str()).map_err(|e| OnnxSimError::InvalidArgument(e.to_string())))
+        .collect();
+    let skip_optimizers_cstrings = skip_optimizers_cstrings?;
+
+    let skip_optimizers_ptrs: Vec<*const i8> = skip_optimizers_cstrings
+        .iter()
+        .map(|s| s.as_ptr())
+        .collect();
+
+    // Same options as simplify_bytes: no optimizers without a skip list
+    let mut c_options = unsafe {
+        let mut c_options = std::mem::MaybeUninit::<onnxsim_options_t>::uninit();
+        onnxsim_options_init(c_options.as_mut_ptr());
+        c_options.assume_init()
+    };
+    c_options.optimization = !skip_optimizers_ptrs.is_empty() as i32;
+    c_options.skip_optimizers = skip_optimizers_ptrs.as_ptr() as *mut *const i8;
+    c_options.skip_optimizers_len = skip_optimizers_ptrs.len();
+    c_options.constant_folding = options.constant_folding as i32;
+    c_options.shape_inference = options.shape_inference as i32;
+    c_options.tensor_size_threshold = options.tensor_size_threshold;
+
+    let num_models = models.len();
+    let model_ptrs: Vec<*const u8> = models.iter().map(|m| m.as_ref().as_ptr()).collect();
+    let model_lens: Vec<usize> = models.iter().map(|m| m.as_ref().len()).collect();
+    let mut out_bytes: Vec<*mut u8> = vec![ptr::null_mut(); num_models];
+    let mut out_bytes_lens: Vec<usize> = vec![0; num_models];
+    let mut out_errors: Vec<onnxsim_error_t> = vec![onnxsim_error_t_ONNXSIM_SUCCESS; num_models];
+    let mut out_error_messages: Vec<*mut i8> = vec![ptr::null_mut(); num_models];
+
+    let result = unsafe {
+        onnxsim_simplify_many(
+            model_ptrs.as_ptr(),
+            model_lens.as_ptr(),
+            num_models,
+            &c_options,
+            max_parallel,
+            out_bytes.as_mut_ptr(),
+            out_bytes_lens.as_mut_ptr(),
+            out_errors.as_mut_ptr(),
+            out_error_messages.as_mut_ptr(),
+        )
+    };
+
+    // Per-model failures are reported in the results below
+    if result != onnxsim_error_t_ONNXSIM_SUCCESS
+        && result != onnxsim_error_t_ONNXSIM_ERROR_SIMPLIFICATION_FAILED
+    {
+        return Err(last_error(result));
+    }
+
+    let results = (0..num_models)
+        .map(|i| unsafe {
+            if out_errors[i] != onnxsim_error_t_ONNXSIM_SUCCESS {
+                let error_msg = if out_error_messages[i].is_null() {
+                    String::from("Unknown error")
+                } else {
+                    let msg = CStr::from_ptr(out_error_messages[i]).to_string_lossy().into_owned();
+                    onnxsim_free_string(out_error_messages[i] as *mut _);
+                    msg
+                };
+                return Err(to_error(out_errors[i], error_msg));
+            }
+            let output = std::slice::from_raw_parts(out_bytes[i], out_bytes_lens[i]).to_vec();
+            onnxsim_free_string(out_bytes[i] as *mut _);
+            Ok(output)
+        })
+        .collect();
+
+    Ok(results)
+}
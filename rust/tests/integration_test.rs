@@ -1,4 +1,4 @@
-use onnxsim::{simplify_bytes, simplify_file, SimplifyOptions};
+use onnxsim::{simplify_bytes, simplify_file, simplify_many, SimplifyOptions};
 
 #[test]
 fn test_init_env() {
@@ -45,3 +45,30 @@ fn test_simplify_file_with_nonexistent_input() {
     // Should fail with error
     assert!(result.is_err());
 }
+
+#[test]
+fn test_simplify_many_with_invalid_inputs() {
+    let models: Vec<&[u8]> = vec![b"not a valid onnx model", b"neither is this"];
+
+    onnxsim::init_env();
+    let results = simplify_many(&models, SimplifyOptions::default(), 2).unwrap();
+
+    // Every model should fail on its own with a parse error
+    assert_eq!(results.len(), 2);
+    for result in results {
+        match result {
+            Err(onnxsim::OnnxSimError::ParseFailed(_)) => (),
+            _ => panic!("Expected ParseFailed error"),
+        }
+    }
+}
+
+#[test]
+fn test_simplify_many_without_models() {
+    let models: Vec<Vec<u8>> = Vec::new();
+
+    onnxsim::init_env();
+    let results = simplify_many(&models, SimplifyOptions::default(), 0).unwrap();
+
+    assert!(results.is_empty());
+}
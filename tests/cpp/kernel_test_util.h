@@ -0,0 +1,58 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "native_kernels.h"
+#include "test_util.h"
+
+// A single node and its inputs, for comparing the native kernels with the
+// model executor.
+struct Case {
+  onnx::NodeProto node;
+  std::vector<onnx::TensorProto> inputs;
+  int64_t opset = 13;
+};
+
+// A node reading `inputs` in order, with omitted optional inputs given as
+// tensors without a name.
+inline Case MakeCase(const std::string& op_type,
+                     std::vector<onnx::TensorProto> inputs,
+                     int64_t opset = 13) {
+  std::vector<std::string> input_names;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (inputs[i].name().empty() && inputs[i].dims_size() == 0 &&
+        !inputs[i].has_raw_data()) {
+      input_names.emplace_back();
+      continue;
+    }
+    input_names.push_back("x" + std::to_string(i));
+    inputs[i].set_name(input_names.back());
+  }
+  return {MakeNode(op_type, input_names, {"y"}), std::move(inputs), opset};
+}
+
+// Checks that the node is supported natively and gives the same dtype, dims
+// and elements as on the executor.
+inline void ExpectSameAsExecutor(const Case& c) {
+  std::vector<const onnx::TensorProto*> inputs;
+  for (int i = 0; i < c.node.input_size(); i++) {
+    inputs.push_back(c.node.input(i).empty() ? nullptr : &c.inputs[i]);
+  }
+  const auto actual = RunNativeKernel(c.node, inputs);
+  const auto expected = RunOnExecutor(c.node, c.inputs, c.opset);
+  if (!actual) {
+    std::cerr << c.node.name() << " is not supported natively" << std::endl;
+  }
+  CHECK(actual);
+  CHECK(actual->size() == expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    if (!SameTensor((*actual)[i], expected[i])) {
+      std::cerr << c.node.name() << " differs from the executor, "
+                << "native: " << (*actual)[i].DebugString()
+                << "executor: " << expected[i].DebugString() << std::endl;
+    }
+    CHECK(SameTensor((*actual)[i], expected[i]));
+  }
+}
@@ -0,0 +1,123 @@
+// Merges the initializers with the same data, which only happens with
+// ONNXSIM_DEDUPLICATE_INITIALIZERS=1, and checks that the consumers in the
+// subgraphs are renamed unless a subgraph shadows the names.
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "test_util.h"
+
+namespace {
+
+onnx::ModelProto SimplifyOnly(const onnx::ModelProto& model) {
+  return Simplify(model, std::nullopt, /*constant_folding=*/false,
+                  /*shape_inference=*/false, -1);
+}
+
+const onnx::NodeProto& FindNode(const onnx::GraphProto& graph,
+                                const std::string& output) {
+  for (const auto& x : graph.node()) {
+    if (x.output(0) == output) {
+      return x;
+    }
+  }
+  CHECK(false);
+  return graph.node(0);
+}
+
+// x + a + b with a == b
+onnx::ModelProto MakeModelWithDuplicates() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {2});
+  *graph->add_output() = MakeValueInfo("z", onnx::TensorProto::FLOAT, {2});
+  *graph->add_initializer() = MakeFloats("a", {2}, {1, 2});
+  *graph->add_initializer() = MakeFloats("b", {2}, {1, 2});
+  AddNode(model, "Add", {"x", "a"}, {"y"});
+  AddNode(model, "Add", {"y", "b"}, {"z"});
+  return model;
+}
+
+// Adds a Loop running once on `x` whose body computes `body_x` + `c`, with
+// the body input named `body_x`.
+void AddLoop(onnx::ModelProto& model, const std::string& x,
+             const std::string& body_x, const std::string& c,
+             const std::string& y) {
+  auto* graph = model.mutable_graph();
+  *graph->add_initializer() = MakeInts("trip_count", {}, {1});
+  *graph->add_initializer() =
+      MakeTensor("cond", onnx::TensorProto::BOOL, {}, std::vector<uint8_t>{1});
+  auto& loop = AddNode(model, "Loop", {"trip_count", "cond", x}, {y});
+  auto* attr = loop.add_attribute();
+  attr->set_name("body");
+  attr->set_type(onnx::AttributeProto::GRAPH);
+  auto* body = attr->mutable_g();
+  body->set_name("body");
+  *body->add_input() = MakeValueInfo("i", onnx::TensorProto::INT64, {});
+  *body->add_input() = MakeValueInfo("cond_in", onnx::TensorProto::BOOL, {});
+  *body->add_input() = MakeValueInfo(body_x, onnx::TensorProto::FLOAT, {2});
+  *body->add_output() =
+      MakeValueInfo("cond_out", onnx::TensorProto::BOOL, {});
+  *body->add_output() = MakeValueInfo("body_y", onnx::TensorProto::FLOAT, {2});
+  *body->add_node() = MakeNode("Identity", {"cond_in"}, {"cond_out"});
+  *body->add_node() = MakeNode("Add", {body_x, c}, {"body_y"});
+}
+
+void TestDisabledByDefault() {
+  unsetenv("ONNXSIM_DEDUPLICATE_INITIALIZERS");
+  const auto sim_model = SimplifyOnly(MakeModelWithDuplicates());
+  CHECK(sim_model.graph().initializer_size() == 2);
+  CHECK(FindNode(sim_model.graph(), "z").input(1) == "b");
+}
+
+void TestMergesDuplicates() {
+  setenv("ONNXSIM_DEDUPLICATE_INITIALIZERS", "1", 1);
+  const auto sim_model = SimplifyOnly(MakeModelWithDuplicates());
+  CHECK(sim_model.graph().initializer_size() == 1);
+  CHECK(FindNode(sim_model.graph(), "y").input(1) == "a");
+  CHECK(FindNode(sim_model.graph(), "z").input(1) == "a");
+}
+
+void TestShadowedSource() {
+  // the body input `b` shadows the removed initializer `b`, the outer `c`
+  // is renamed in the body
+  setenv("ONNXSIM_DEDUPLICATE_INITIALIZERS", "1", 1);
+  auto model = MakeModelWithDuplicates();
+  *model.mutable_graph()->add_initializer() = MakeFloats("c", {2}, {1, 2});
+  model.mutable_graph()->mutable_output(0)->set_name("w");
+  AddLoop(model, "z", "b", "c", "w");
+  const auto sim_model = SimplifyOnly(model);
+  CHECK(FindInitializer(sim_model, "b") == nullptr);
+  CHECK(FindInitializer(sim_model, "c") == nullptr);
+  const auto& body = FindNode(sim_model.graph(), "w").attribute(0).g();
+  const auto& add = FindNode(body, "body_y");
+  CHECK(add.input(0) == "b");
+  CHECK(add.input(1) == "a");
+}
+
+void TestShadowedTarget() {
+  // the body input `a` shadows the kept initializer, so pointing the body
+  // to it instead of `c` would read the body input
+  setenv("ONNXSIM_DEDUPLICATE_INITIALIZERS", "1", 1);
+  auto model = MakeModelWithDuplicates();
+  *model.mutable_graph()->add_initializer() = MakeFloats("c", {2}, {1, 2});
+  model.mutable_graph()->mutable_output(0)->set_name("w");
+  AddLoop(model, "z", "a", "c", "w");
+  const auto sim_model = SimplifyOnly(model);
+  CHECK(FindInitializer(sim_model, "c") != nullptr);
+  const auto& body = FindNode(sim_model.graph(), "w").attribute(0).g();
+  const auto& add = FindNode(body, "body_y");
+  CHECK(add.input(0) == "a");
+  CHECK(add.input(1) == "c");
+}
+
+}  // namespace
+
+int main() {
+  TestDisabledByDefault();
+  TestMergesDuplicates();
+  TestShadowedSource();
+  TestShadowedTarget();
+  return 0;
+}
@@ -0,0 +1,223 @@
+// Simplifies models whose weights are in external data files, with the data
+// loaded up front and memory-mapped (ONNXSIM_MMAP_EXTERNAL_DATA=1), and
+// checks the data written next to the simplified model.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <onnx/common/file_utils.h>
+
+#include "external_data.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr float kEpsilon = 1e-5f;
+
+// x [1, 2, 2, 2] -> 1x1 Conv -> BatchNormalization -> y
+onnx::ModelProto MakeConvBnModel() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() =
+      MakeValueInfo("x", onnx::TensorProto::FLOAT, {1, 2, 2, 2});
+  *graph->add_output() =
+      MakeValueInfo("y", onnx::TensorProto::FLOAT, {1, 2, 2, 2});
+  *graph->add_initializer() = MakeFloats("w", {2, 2, 1, 1}, {1, 2, -3, 0.5});
+  *graph->add_initializer() = MakeFloats("scale", {2}, {2, 0.5});
+  *graph->add_initializer() = MakeFloats("bias", {2}, {1, -1});
+  *graph->add_initializer() = MakeFloats("mean", {2}, {0.5, 3});
+  *graph->add_initializer() = MakeFloats("var", {2}, {4, 0.25});
+  AddNode(model, "Conv", {"x", "w"}, {"conv"});
+  auto& bn = AddNode(model, "BatchNormalization",
+                     {"conv", "scale", "bias", "mean", "var"}, {"y"});
+  auto* attr = bn.add_attribute();
+  attr->set_name("epsilon");
+  attr->set_type(onnx::AttributeProto::FLOAT);
+  attr->set_f(kEpsilon);
+  return model;
+}
+
+// The model with the data of all its initializers read into memory.
+onnx::ModelProto LoadWithData(const std::filesystem::path& path) {
+  onnx::ModelProto model;
+  onnx::LoadProtoFromPath(path.string(), model);
+  ExternalDataStore store(path.parent_path().string());
+  for (auto& x : *model.mutable_graph()->mutable_initializer()) {
+    store.Load(x);
+  }
+  return model;
+}
+
+size_t NumElements(const onnx::TensorProto& tensor) {
+  size_t n = 1;
+  for (const auto dim : tensor.dims()) {
+    n *= dim;
+  }
+  return n;
+}
+
+// Runs the simplified Conv + BatchNormalization and compares y with the
+// reference computation.
+void ExpectConvBnOutputs(const onnx::ModelProto& model) {
+  for (const auto& x : model.graph().initializer()) {
+    CHECK(x.raw_data().size() == NumElements(x) * sizeof(float));
+  }
+  if (ModelExecutor::instance() == nullptr) {
+    return;
+  }
+  const std::vector<float> x = {1, 2, 3, 4, -1, 0, 0.5, 2};
+  const std::vector<float> w = {1, 2, -3, 0.5};
+  const std::vector<float> scale = {2, 0.5}, bias = {1, -1};
+  const std::vector<float> mean = {0.5, 3}, var = {4, 0.25};
+  const auto input = MakeFloats("x", {1, 2, 2, 2}, x);
+  const auto outputs = ModelExecutor::Run(model, {&input});
+  CHECK(outputs.size() == 1);
+  const auto y = ToVector<float>(outputs[0]);
+  CHECK(y.size() == 8);
+  for (int c = 0; c < 2; c++) {
+    for (int i = 0; i < 4; i++) {
+      const float conv = w[c * 2] * x[i] + w[c * 2 + 1] * x[4 + i];
+      const float expected =
+          scale[c] * (conv - mean[c]) / std::sqrt(var[c] + kEpsilon) +
+          bias[c];
+      CHECK(std::abs(y[c * 4 + i] - expected) < 1e-4f);
+    }
+  }
+}
+
+// x * w1 + w2 with 256 elements each
+onnx::ModelProto MakeAffineModel() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {256});
+  *graph->add_output() = MakeValueInfo("y", onnx::TensorProto::FLOAT, {256});
+  std::vector<float> w1(256), w2(256);
+  for (int i = 0; i < 256; i++) {
+    w1[i] = i * 0.5f;
+    w2[i] = -i;
+  }
+  *graph->add_initializer() = MakeFloats("w1", {256}, w1);
+  *graph->add_initializer() = MakeFloats("w2", {256}, w2);
+  AddNode(model, "Mul", {"x", "w1"}, {"xw"});
+  AddNode(model, "Add", {"xw", "w2"}, {"y"});
+  return model;
+}
+
+void TestSaveOptions(const std::filesystem::path& dir, bool mmap) {
+  const auto model = MakeAffineModel();
+  auto external_model = model;
+  ExternalDataOptions options;
+  options.min_bytes = 0;
+  SaveModel(external_model, (dir / "affine.onnx").string(), options);
+  setenv("ONNXSIM_MMAP_EXTERNAL_DATA", mmap ? "1" : "0", 1);
+
+  // all the data is written to the data file, at aligned offsets
+  options.alignment = 64;
+  SimplifyPath((dir / "affine.onnx").string(),
+               (dir / "affine_external.onnx").string(),
+               std::vector<std::string>{}, true, true, -1, GetDefaultState(),
+               options);
+  onnx::ModelProto sim_model;
+  onnx::LoadProtoFromPath((dir / "affine_external.onnx").string(),
+                          sim_model);
+  for (const auto& x : sim_model.graph().initializer()) {
+    CHECK(x.data_location() == onnx::TensorProto::EXTERNAL);
+    for (const auto& entry : x.external_data()) {
+      CHECK(entry.key() != "offset" || std::stoull(entry.value()) % 64 == 0);
+    }
+  }
+  sim_model = LoadWithData(dir / "affine_external.onnx");
+  CHECK(sim_model.graph().initializer_size() == 2);
+  for (const auto& x : sim_model.graph().initializer()) {
+    CHECK(SameTensor(x, *FindInitializer(model, x.name())));
+  }
+
+  // the data loaded from the input data file is written to the model file;
+  // in mmap mode it is never loaded, so it stays external
+  options = ExternalDataOptions();
+  options.min_bytes = SIZE_MAX;
+  SimplifyPath((dir / "affine.onnx").string(),
+               (dir / "affine_inline.onnx").string(),
+               std::vector<std::string>{}, true, true, -1, GetDefaultState(),
+               options);
+  onnx::LoadProtoFromPath((dir / "affine_inline.onnx").string(), sim_model);
+  for (const auto& x : sim_model.graph().initializer()) {
+    CHECK((x.data_location() == onnx::TensorProto::EXTERNAL) == mmap);
+  }
+  sim_model = LoadWithData(dir / "affine_inline.onnx");
+  CHECK(sim_model.graph().initializer_size() == 2);
+  for (const auto& x : sim_model.graph().initializer()) {
+    CHECK(SameTensor(x, *FindInitializer(model, x.name())));
+  }
+}
+
+// The command line tool reads the data of the input model from its data
+// file and writes it where --save-as-external-data says.
+void TestCli(const std::filesystem::path& dir, const std::string& cli) {
+  const auto model = MakeAffineModel();
+  auto external_model = model;
+  ExternalDataOptions options;
+  options.min_bytes = 0;
+  SaveModel(external_model, (dir / "cli.onnx").string(), options);
+  setenv("ONNXSIM_MMAP_EXTERNAL_DATA", "0", 1);
+  const auto Run = [&](const std::string& output, const std::string& flags) {
+    const auto command = "\"" + cli + "\" -i \"" +
+                         (dir / "cli.onnx").string() + "\" -o \"" +
+                         (dir / output).string() + "\" " + flags;
+    CHECK(std::system(command.c_str()) == 0);
+    onnx::ModelProto sim_model;
+    onnx::LoadProtoFromPath((dir / output).string(), sim_model);
+    return sim_model;
+  };
+  auto sim_model = Run("cli_inline.onnx", "");
+  for (const auto& x : sim_model.graph().initializer()) {
+    CHECK(x.data_location() != onnx::TensorProto::EXTERNAL);
+    CHECK(SameTensor(x, *FindInitializer(model, x.name())));
+  }
+  sim_model = Run("cli_external.onnx", "--save-as-external-data");
+  for (const auto& x : sim_model.graph().initializer()) {
+    CHECK(x.data_location() == onnx::TensorProto::EXTERNAL);
+  }
+  sim_model = LoadWithData(dir / "cli_external.onnx");
+  CHECK(sim_model.graph().initializer_size() == 2);
+  for (const auto& x : sim_model.graph().initializer()) {
+    CHECK(SameTensor(x, *FindInitializer(model, x.name())));
+  }
+}
+
+void TestConvBn(const std::filesystem::path& dir, bool mmap) {
+  auto model = MakeConvBnModel();
+  ExternalDataOptions options;
+  options.min_bytes = 0;
+  SaveModel(model, (dir / "conv_bn.onnx").string(), options);
+  setenv("ONNXSIM_MMAP_EXTERNAL_DATA", mmap ? "1" : "0", 1);
+  const auto out_path = dir / (mmap ? "mmap.onnx" : "loaded.onnx");
+  SimplifyPath((dir / "conv_bn.onnx").string(), out_path.string(),
+               std::vector<std::string>{}, true, true, -1);
+  ExpectConvBnOutputs(LoadWithData(out_path));
+}
+
+}  // namespace
+
+// Tests the command line tool at argv[1] if given, the library otherwise.
+int main(int argc, char** argv) {
+  std::string dir = (std::filesystem::temp_directory_path() /
+                     "onnxsim_test_external_data_XXXXXX")
+                        .string();
+  CHECK(mkdtemp(dir.data()) != nullptr);
+  if (argc > 1) {
+    TestCli(dir, argv[1]);
+  } else {
+    TestSaveOptions(dir, false);
+    TestSaveOptions(dir, true);
+    TestConvBn(dir, false);
+    // the optimizer must not fold the weights it cannot read
+    TestConvBn(dir, true);
+  }
+  std::filesystem::remove_all(dir);
+  return 0;
+}
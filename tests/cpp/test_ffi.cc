@@ -0,0 +1,297 @@
+// The C API: a handle used by several threads at once, results serialized
+// into the buffers of the caller, jobs cancelled and freed while they run,
+// onnxsim_simplify_many with failing models among the others, and the op
+// result cache of a handle. The ops are folded by a slow executor installed
+// as ModelExecutor::instance(), which the handles use.
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "onnxsim_ffi.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr int kChainLength = 40;
+
+// Computes Sin, and 1-D Split into equal parts, taking `delay` per op
+struct SinExecutor : public ModelExecutor {
+  explicit SinExecutor(std::chrono::milliseconds delay) : delay(delay) {}
+
+  std::vector<onnx::TensorProto> _Run(
+      const onnx::ModelProto& model,
+      const std::vector<const onnx::TensorProto*>& inputs) const override {
+    if (model.graph().node_size() != 1) {
+      throw std::runtime_error("only single ops are supported");
+    }
+    const auto& op = model.graph().node(0);
+    if (op.op_type() == "Split") {
+      const auto values = ToVector<float>(*inputs.at(0));
+      const int64_t size = values.size() / op.output_size();
+      std::vector<onnx::TensorProto> outputs;
+      for (int i = 0; i < op.output_size(); i++) {
+        outputs.push_back(
+            MakeFloats(op.output(i), {size},
+                       {values.begin() + i * size,
+                        values.begin() + (i + 1) * size}));
+      }
+      return outputs;
+    }
+    if (op.op_type() != "Sin") {
+      throw std::runtime_error("only Sin and Split are supported");
+    }
+    runs++;
+    std::this_thread::sleep_for(delay);
+    auto output = *inputs.at(0);
+    auto values = ToVector<float>(output);
+    for (auto& x : values) {
+      x = std::sin(x);
+    }
+    output.set_raw_data(values.data(), values.size() * sizeof(float));
+    return {output};
+  }
+
+  const std::chrono::milliseconds delay;
+  mutable std::atomic<int> runs{0};
+};
+
+// x + Sin(Sin(...Sin(c))), with kChainLength Sin ops
+std::string MakeSinChain(float c0) {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {2});
+  *graph->add_output() = MakeValueInfo("y", onnx::TensorProto::FLOAT, {2});
+  *graph->add_initializer() = MakeFloats("s0", {2}, {c0, c0 + 1});
+  for (int i = 0; i < kChainLength; i++) {
+    AddNode(model, "Sin", {"s" + std::to_string(i)},
+            {"s" + std::to_string(i + 1)});
+  }
+  AddNode(model, "Add", {"x", "s" + std::to_string(kChainLength)}, {"y"});
+  return model.SerializeAsString();
+}
+
+// Checks that the chain of MakeSinChain(c0) is folded
+void ExpectFolded(const uint8_t* bytes, size_t size, float c0) {
+  onnx::ModelProto model;
+  CHECK(model.ParseFromArray(bytes, static_cast<int>(size)));
+  CHECK(model.graph().node_size() == 1);
+  CHECK(model.graph().node(0).op_type() == "Add");
+  const auto* folded = FindInitializer(model, model.graph().node(0).input(1));
+  CHECK(folded != nullptr);
+  std::vector<float> expected = {c0, c0 + 1};
+  for (int i = 0; i < kChainLength; i++) {
+    for (auto& x : expected) {
+      x = std::sin(x);
+    }
+  }
+  CHECK(ToVector<float>(*folded) == expected);
+}
+
+onnxsim_handle_t CreateHandle(size_t num_threads) {
+  onnxsim_options_t options;
+  onnxsim_options_init(&options);
+  options.num_threads = num_threads;
+  onnxsim_handle_t handle = nullptr;
+  CHECK(onnxsim_create(&options, &handle) == ONNXSIM_SUCCESS);
+  return handle;
+}
+
+void TestThreads() {
+  auto* handle = CreateHandle(2);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([handle, t]() {
+      // the same model twice goes through the op result cache
+      for (int i = 0; i < 2; i++) {
+        const auto model = MakeSinChain(t * 0.25f);
+        uint8_t* bytes = nullptr;
+        size_t size = 0;
+        CHECK(onnxsim_handle_simplify_bytes(
+                  handle, reinterpret_cast<const uint8_t*>(model.data()),
+                  model.size(), &bytes, &size) == ONNXSIM_SUCCESS);
+        ExpectFolded(bytes, size, t * 0.25f);
+        onnxsim_free_string(bytes);
+      }
+    });
+  }
+  for (auto& x : threads) {
+    x.join();
+  }
+  onnxsim_destroy(handle);
+}
+
+// x + p for every part p of Split(c) into `num_parts` outputs
+std::string MakeSplitModel(int num_parts) {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  const int64_t size = 6 / num_parts;
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {size});
+  *graph->add_initializer() = MakeFloats("c", {6}, {0, 1, 2, 3, 4, 5});
+  std::vector<std::string> parts;
+  for (int i = 0; i < num_parts; i++) {
+    parts.push_back("p" + std::to_string(i));
+  }
+  AddNode(model, "Split", {"c"}, parts);
+  for (int i = 0; i < num_parts; i++) {
+    const auto y = "y" + std::to_string(i);
+    AddNode(model, "Add", {"x", parts[i]}, {y});
+    *graph->add_output() = MakeValueInfo(y, onnx::TensorProto::FLOAT, {size});
+  }
+  return model.SerializeAsString();
+}
+
+// The same Split with 2 and 3 outputs gives different results, so the op
+// result cache must not mix them up.
+void TestSplitOutputs() {
+  auto* handle = CreateHandle(1);
+  for (const int num_parts : {2, 3}) {
+    const auto model = MakeSplitModel(num_parts);
+    uint8_t* bytes = nullptr;
+    size_t size = 0;
+    CHECK(onnxsim_handle_simplify_bytes(
+              handle, reinterpret_cast<const uint8_t*>(model.data()),
+              model.size(), &bytes, &size) == ONNXSIM_SUCCESS);
+    onnx::ModelProto sim_model;
+    CHECK(sim_model.ParseFromArray(bytes, static_cast<int>(size)));
+    onnxsim_free_string(bytes);
+    CHECK(sim_model.graph().node_size() == num_parts);
+    const int64_t part_size = 6 / num_parts;
+    for (const auto& node : sim_model.graph().node()) {
+      const int i = std::stoi(node.output(0).substr(1));
+      const auto* part = FindInitializer(sim_model, node.input(1));
+      CHECK(part != nullptr);
+      std::vector<float> expected;
+      for (int64_t j = 0; j < part_size; j++) {
+        expected.push_back(i * part_size + j);
+      }
+      CHECK(ToVector<float>(*part) == expected);
+    }
+  }
+  onnxsim_destroy(handle);
+}
+
+void TestBufferTooSmall() {
+  auto* handle = CreateHandle(1);
+  const auto model = MakeSinChain(1);
+  onnxsim_result_t result = nullptr;
+  CHECK(onnxsim_handle_simplify(handle,
+                                reinterpret_cast<const uint8_t*>(model.data()),
+                                model.size(), &result) == ONNXSIM_SUCCESS);
+  const size_t size = onnxsim_result_size(result);
+  CHECK(size > 0);
+  std::vector<uint8_t> buffer(size);
+  CHECK(onnxsim_result_write(result, buffer.data(), size - 1) ==
+        ONNXSIM_ERROR_BUFFER_TOO_SMALL);
+  CHECK(onnxsim_get_last_error() != nullptr);
+  CHECK(onnxsim_result_write(result, buffer.data(), size) == ONNXSIM_SUCCESS);
+  ExpectFolded(buffer.data(), size, 1);
+  onnxsim_result_free(result);
+  onnxsim_destroy(handle);
+}
+
+void OnProgress(const onnxsim_progress_t* progress, void* user_data) {
+  static_cast<std::atomic<size_t>*>(user_data)->store(progress->nodes_folded);
+}
+
+onnxsim_job_t StartJob(onnxsim_handle_t handle, const std::string& model,
+                       std::atomic<size_t>* nodes_folded) {
+  onnxsim_job_t job = nullptr;
+  CHECK(onnxsim_handle_simplify_async(
+            handle, reinterpret_cast<const uint8_t*>(model.data()),
+            model.size(), OnProgress, nullptr, nodes_folded,
+            &job) == ONNXSIM_SUCCESS);
+  while (*nodes_folded == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return job;
+}
+
+void TestCancel(const SinExecutor& executor) {
+  auto* handle = CreateHandle(1);
+  int runs = executor.runs;
+  std::atomic<size_t> nodes_folded{0};
+  auto* job = StartJob(handle, MakeSinChain(2), &nodes_folded);
+  // the job does not need the handle
+  onnxsim_destroy(handle);
+  CHECK(onnxsim_job_poll(job) == 0);
+  onnxsim_job_cancel(job);
+  onnxsim_result_t result = nullptr;
+  CHECK(onnxsim_job_wait(job, &result) == ONNXSIM_ERROR_CANCELLED);
+  CHECK(result == nullptr);
+  CHECK(onnxsim_job_poll(job) == 1);
+  onnxsim_job_free(job);
+  CHECK(executor.runs - runs < kChainLength);
+
+  // freed while running, the job is cancelled and waited for
+  handle = CreateHandle(2);
+  runs = executor.runs;
+  nodes_folded = 0;
+  job = StartJob(handle, MakeSinChain(3), &nodes_folded);
+  onnxsim_job_free(job);
+  const int runs_after_free = executor.runs;
+  CHECK(runs_after_free - runs < kChainLength);
+  std::this_thread::sleep_for(executor.delay * 2);
+  CHECK(executor.runs == runs_after_free);
+  onnxsim_destroy(handle);
+}
+
+void TestSimplifyMany() {
+  const std::vector<std::string> models = {
+      MakeSinChain(4), "not a model", MakeSinChain(5), "still not a model",
+      MakeSinChain(6)};
+  const size_t n = models.size();
+  std::vector<const uint8_t*> model_bytes;
+  std::vector<size_t> model_bytes_lens;
+  for (const auto& x : models) {
+    model_bytes.push_back(reinterpret_cast<const uint8_t*>(x.data()));
+    model_bytes_lens.push_back(x.size());
+  }
+  onnxsim_options_t options;
+  onnxsim_options_init(&options);
+  std::vector<uint8_t*> out_bytes(n);
+  std::vector<size_t> out_bytes_lens(n);
+  std::vector<onnxsim_error_t> out_errors(n);
+  std::vector<char*> out_error_messages(n);
+  CHECK(onnxsim_simplify_many(model_bytes.data(), model_bytes_lens.data(), n,
+                              &options, 2, out_bytes.data(),
+                              out_bytes_lens.data(), out_errors.data(),
+                              out_error_messages.data()) ==
+        ONNXSIM_ERROR_SIMPLIFICATION_FAILED);
+  CHECK(std::string(onnxsim_get_last_error()) == "2 of 5 models failed");
+  for (size_t i = 0; i < n; i++) {
+    if (i % 2 == 1) {
+      CHECK(out_errors[i] == ONNXSIM_ERROR_PARSE_FAILED);
+      CHECK(out_bytes[i] == nullptr);
+      CHECK(out_error_messages[i] != nullptr);
+      CHECK(std::string(out_error_messages[i]).find("parse") !=
+            std::string::npos);
+    } else {
+      CHECK(out_errors[i] == ONNXSIM_SUCCESS);
+      CHECK(out_error_messages[i] == nullptr);
+      ExpectFolded(out_bytes[i], out_bytes_lens[i], 4 + i / 2);
+    }
+    onnxsim_free_string(out_bytes[i]);
+    onnxsim_free_string(out_error_messages[i]);
+  }
+}
+
+}  // namespace
+
+int main() {
+  onnxsim_init_env();
+  const auto executor =
+      std::make_shared<SinExecutor>(std::chrono::milliseconds(20));
+  ModelExecutor::set_instance(executor);
+  TestThreads();
+  TestSplitOutputs();
+  TestBufferTooSmall();
+  TestCancel(*executor);
+  TestSimplifyMany();
+  return 0;
+}
@@ -0,0 +1,158 @@
+// Folds models with ONNXSIM_FOLD_CONSTANT_REGIONS=1 and checks that running
+// each constant region as one model gives the same model as folding node by
+// node: with an intermediate tensor that is also a graph output, with a node
+// that fails, and with regions mixing builtin kernel and executor ops.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "test_util.h"
+
+namespace {
+
+// Runs graphs of Sin, Add and Mul over float tensors of the same shape, and
+// fails on anything else, e.g. Cos.
+struct GraphExecutor : public ModelExecutor {
+  std::vector<onnx::TensorProto> _Run(
+      const onnx::ModelProto& model,
+      const std::vector<const onnx::TensorProto*>& inputs) const override {
+    const auto& graph = model.graph();
+    max_nodes = std::max(max_nodes.load(), graph.node_size());
+    std::unordered_map<std::string, std::vector<float>> values;
+    std::vector<int64_t> dims;
+    for (int i = 0; i < graph.input_size(); i++) {
+      values[graph.input(i).name()] = ToVector<float>(*inputs.at(i));
+      dims.assign(inputs[i]->dims().begin(), inputs[i]->dims().end());
+    }
+    for (const auto& node : graph.node()) {
+      auto result = values.at(node.input(0));
+      if (node.op_type() == "Sin") {
+        for (auto& x : result) {
+          x = std::sin(x);
+        }
+      } else if (node.op_type() == "Add" || node.op_type() == "Mul") {
+        const auto& other = values.at(node.input(1));
+        for (size_t i = 0; i < result.size(); i++) {
+          result[i] = node.op_type() == "Add" ? result[i] + other[i]
+                                              : result[i] * other[i];
+        }
+      } else {
+        throw std::runtime_error("unsupported op " + node.op_type());
+      }
+      values[node.output(0)] = std::move(result);
+    }
+    std::vector<onnx::TensorProto> outputs;
+    for (const auto& x : graph.output()) {
+      outputs.push_back(MakeFloats(x.name(), dims, values.at(x.name())));
+    }
+    return outputs;
+  }
+
+  // the most nodes run at once, more than 1 when a region ran as one model
+  mutable std::atomic<int> max_nodes{0};
+};
+
+// Three regions read by x:
+// - Sin(c) + d, whose intermediate Sin(c) is the graph output s1;
+// - Add(Cos(Sin(e)), Sin(e)), where the executor fails on Cos;
+// - d + e, folded by the builtin kernels.
+onnx::ModelProto MakeRegionsModel() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {2});
+  for (const auto* name : {"s1", "y1", "y2", "y3"}) {
+    *graph->add_output() = MakeValueInfo(name, onnx::TensorProto::FLOAT, {2});
+  }
+  *graph->add_initializer() = MakeFloats("c", {2}, {0.5, 1});
+  *graph->add_initializer() = MakeFloats("d", {2}, {2, -3});
+  *graph->add_initializer() = MakeFloats("e", {2}, {-1, 4});
+  AddNode(model, "Sin", {"c"}, {"s1"});
+  AddNode(model, "Add", {"s1", "d"}, {"s2"});
+  AddNode(model, "Mul", {"x", "s2"}, {"y1"});
+  AddNode(model, "Sin", {"e"}, {"g1"});
+  AddNode(model, "Cos", {"g1"}, {"f1"});
+  AddNode(model, "Add", {"f1", "g1"}, {"f2"});
+  AddNode(model, "Mul", {"x", "f2"}, {"y2"});
+  AddNode(model, "Add", {"d", "e"}, {"n1"});
+  AddNode(model, "Mul", {"x", "n1"}, {"y3"});
+  return model;
+}
+
+onnx::ModelProto FoldWith(const onnx::ModelProto& model, bool regions,
+                          const std::shared_ptr<GraphExecutor>& executor,
+                          std::vector<std::string>& warnings) {
+  SimplifyState state;
+  state.executor = executor;
+  state.on_warning = [&warnings](const std::string& x) {
+    warnings.push_back(x);
+  };
+  setenv("ONNXSIM_FOLD_CONSTANT_REGIONS", regions ? "1" : "0", 1);
+  auto sim_model = Simplify(model, std::vector<std::string>{}, true, true,
+                            -1, state);
+  unsetenv("ONNXSIM_FOLD_CONSTANT_REGIONS");
+  return sim_model;
+}
+
+std::vector<std::string> SortedInitializers(const onnx::ModelProto& model) {
+  std::vector<std::string> initializers;
+  for (const auto& x : model.graph().initializer()) {
+    initializers.push_back(x.SerializeAsString());
+  }
+  std::sort(initializers.begin(), initializers.end());
+  return initializers;
+}
+
+void TestSameAsNodes() {
+  const auto model = MakeRegionsModel();
+  const auto node_executor = std::make_shared<GraphExecutor>();
+  std::vector<std::string> node_warnings;
+  const auto by_nodes = FoldWith(model, false, node_executor, node_warnings);
+  CHECK(node_executor->max_nodes == 1);
+  const auto region_executor = std::make_shared<GraphExecutor>();
+  std::vector<std::string> region_warnings;
+  const auto by_regions =
+      FoldWith(model, true, region_executor, region_warnings);
+  CHECK(region_executor->max_nodes > 1);
+
+  // Cos and the Add reading it are kept, everything else is folded
+  std::vector<std::string> op_types;
+  for (const auto& x : by_regions.graph().node()) {
+    op_types.push_back(x.op_type());
+  }
+  CHECK((op_types ==
+         std::vector<std::string>{"Cos", "Add", "Mul", "Mul", "Mul"}));
+  const auto* s1 = FindInitializer(by_regions, "s1");
+  CHECK(s1 != nullptr);
+  CHECK(ToVector<float>(*s1) ==
+        (std::vector<float>{std::sin(0.5f), std::sin(1.0f)}));
+  CHECK(FindInitializer(by_regions, "g1") != nullptr);
+  CHECK(FindInitializer(by_regions, "n1") != nullptr);
+
+  CHECK(by_regions.graph().node_size() == by_nodes.graph().node_size());
+  for (int i = 0; i < by_nodes.graph().node_size(); i++) {
+    CHECK(by_regions.graph().node(i).SerializeAsString() ==
+          by_nodes.graph().node(i).SerializeAsString());
+  }
+  CHECK(SortedInitializers(by_regions) == SortedInitializers(by_nodes));
+  CHECK(by_regions.graph().output_size() == by_nodes.graph().output_size());
+  for (int i = 0; i < by_nodes.graph().output_size(); i++) {
+    CHECK(by_regions.graph().output(i).SerializeAsString() ==
+          by_nodes.graph().output(i).SerializeAsString());
+  }
+  CHECK(region_warnings == node_warnings);
+  CHECK(!node_warnings.empty());
+}
+
+}  // namespace
+
+int main() {
+  TestSameAsNodes();
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Simplifies models over several fixed point iterations with
+// ONNXSIM_INCREMENTAL_SHAPE_INFERENCE=1 and checks that the value_info and
+// the output types are the same as with the full shape inference.
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "test_util.h"
+
+namespace {
+
+// The shape of the Reshape is folded in the first iteration, so that the
+// inference of the second one learns the dims of r and of everything
+// downstream of it. y1 already has its shape, y2 only its rank; the chain
+// on z never changes.
+onnx::ModelProto MakeModelWithLateShape() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {12});
+  *graph->add_input() = MakeValueInfo("z", onnx::TensorProto::FLOAT, {4});
+  *graph->add_output() = MakeValueInfo("y1", onnx::TensorProto::FLOAT, {3, 4});
+  auto y2 = MakeValueInfo("y2", onnx::TensorProto::FLOAT, {0, 0});
+  auto* y2_shape = y2.mutable_type()->mutable_tensor_type()->mutable_shape();
+  for (auto& dim : *y2_shape->mutable_dim()) {
+    dim.clear_dim_value();
+  }
+  *graph->add_output() = y2;
+  *graph->add_output() = MakeValueInfo("w", onnx::TensorProto::FLOAT, {4});
+  *graph->add_initializer() = MakeInts("a", {2}, {1, 4});
+  *graph->add_initializer() = MakeInts("b", {2}, {2, 0});
+  AddNode(model, "Add", {"a", "b"}, {"shape"});
+  AddNode(model, "Reshape", {"x", "shape"}, {"r"});
+  AddNode(model, "Relu", {"r"}, {"t"});
+  AddNode(model, "Abs", {"t"}, {"y1"});
+  AddNode(model, "Neg", {"r"}, {"y2"});
+  const std::vector<std::string> ops = {"Relu", "Neg", "Abs",
+                                        "Relu", "Neg", "Abs"};
+  std::string prev = "z";
+  for (size_t i = 0; i < ops.size(); i++) {
+    const auto next = i + 1 == ops.size() ? "w" : "z" + std::to_string(i + 1);
+    AddNode(model, ops[i], {prev}, {next});
+    prev = next;
+  }
+  return model;
+}
+
+onnx::ModelProto SimplifyWith(const onnx::ModelProto& model,
+                              bool incremental) {
+  setenv("ONNXSIM_INCREMENTAL_SHAPE_INFERENCE", incremental ? "1" : "0", 1);
+  auto sim_model = Simplify(model, std::vector<std::string>{}, true, true, -1);
+  unsetenv("ONNXSIM_INCREMENTAL_SHAPE_INFERENCE");
+  return sim_model;
+}
+
+std::vector<std::string> SortedValueInfo(const onnx::ModelProto& model) {
+  std::vector<std::string> value_infos;
+  for (const auto& x : model.graph().value_info()) {
+    value_infos.push_back(x.SerializeAsString());
+  }
+  std::sort(value_infos.begin(), value_infos.end());
+  return value_infos;
+}
+
+const onnx::ValueInfoProto* FindValueInfo(const onnx::ModelProto& model,
+                                          const std::string& name) {
+  for (const auto& x : model.graph().value_info()) {
+    if (x.name() == name) {
+      return &x;
+    }
+  }
+  return nullptr;
+}
+
+bool HasDims(const onnx::ValueInfoProto& value_info,
+             const std::vector<int64_t>& dims) {
+  const auto& type = value_info.type().tensor_type();
+  if (!type.has_shape() ||
+      type.shape().dim_size() != static_cast<int>(dims.size())) {
+    return false;
+  }
+  for (size_t i = 0; i < dims.size(); i++) {
+    if (type.shape().dim(i).dim_value() != dims[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TestLateShape() {
+  const auto model = MakeModelWithLateShape();
+  const auto full = SimplifyWith(model, false);
+  const auto incremental = SimplifyWith(model, true);
+
+  // the folded shape reached the nodes downstream of the Reshape
+  for (const auto* sim_model : {&full, &incremental}) {
+    CHECK(FindInitializer(*sim_model, "shape") != nullptr);
+    for (const auto* name : {"r", "t"}) {
+      const auto* value_info = FindValueInfo(*sim_model, name);
+      CHECK(value_info != nullptr);
+      CHECK(HasDims(*value_info, {3, 4}));
+    }
+    CHECK(HasDims(sim_model->graph().output(0), {3, 4}));
+    CHECK(HasDims(sim_model->graph().output(1), {3, 4}));
+  }
+
+  CHECK(SortedValueInfo(incremental) == SortedValueInfo(full));
+  CHECK(incremental.graph().output_size() == full.graph().output_size());
+  for (int i = 0; i < full.graph().output_size(); i++) {
+    CHECK(incremental.graph().output(i).SerializeAsString() ==
+          full.graph().output(i).SerializeAsString());
+  }
+}
+
+}  // namespace
+
+int main() {
+  TestLateShape();
+  return 0;
+}
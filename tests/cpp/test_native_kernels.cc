@@ -0,0 +1,144 @@
+// Compares the native kernels with the model executor (onnxruntime in the
+// builtin build): every case must be supported natively and give the same
+// dtype, dims and elements as the executor.
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "kernel_test_util.h"
+#include "test_util.h"
+
+namespace {
+
+onnx::TensorProto Ints(const std::vector<int64_t>& dims,
+                       const std::vector<int64_t>& values) {
+  return MakeInts("", dims, values);
+}
+
+onnx::TensorProto Int32s(const std::vector<int64_t>& dims,
+                         const std::vector<int32_t>& values) {
+  return MakeTensor("", onnx::TensorProto::INT32, dims, values);
+}
+
+onnx::TensorProto Doubles(const std::vector<int64_t>& dims,
+                          const std::vector<double>& values) {
+  return MakeTensor("", onnx::TensorProto::DOUBLE, dims, values);
+}
+
+onnx::TensorProto Bools(const std::vector<int64_t>& dims,
+                        const std::vector<uint8_t>& values) {
+  return MakeTensor("", onnx::TensorProto::BOOL, dims, values);
+}
+
+std::vector<Case> GetCases() {
+  std::vector<Case> cases;
+  // broadcasting
+  cases.push_back(MakeCase(
+      "Add", {Ints({2, 3}, {1, 2, 3, 4, 5, 6}), Ints({3}, {10, 20, 30})}));
+  cases.push_back(
+      MakeCase("Sub", {Ints({2, 1}, {1, 2}), Ints({1, 3}, {10, 20, 30})}));
+  cases.push_back(
+      MakeCase("Mul", {Int32s({3}, {-1, 2, 70000}), Int32s({}, {70000})}));
+  cases.push_back(MakeCase(
+      "Div", {Ints({4}, {-7, 7, -8, 9}), Ints({4}, {2, -2, 3, -4})}));
+  cases.push_back(MakeCase(
+      "Div", {Doubles({2, 2}, {1, -2, 3, 0}), Doubles({2}, {4, -0.5})}));
+  cases.push_back(
+      MakeCase("Equal", {Ints({2, 2}, {1, 2, 3, 4}), Ints({2}, {1, 4})}));
+  cases.push_back(MakeCase(
+      "Less", {Doubles({2, 2}, {1, 2, 3, 4}), Doubles({2, 1}, {2, 3})}));
+  cases.push_back(MakeCase(
+      "Greater", {Int32s({1, 3}, {-1, 0, 1}), Int32s({2, 1}, {0, -2})}));
+  cases.push_back(MakeCase("Where", {Bools({2, 1}, {1, 0}),
+                                     Ints({1, 3}, {1, 2, 3}),
+                                     Ints({2, 3}, {4, 5, 6, 7, 8, 9})}));
+
+  // casts, including the wrap-around of narrowing integer casts and the
+  // truncation of float to int
+  auto cast =
+      MakeCase("Cast", {Ints({3}, {(int64_t{1} << 31) + 5, -1, 1 << 20})});
+  AddAttribute(cast.node, "to", int64_t{onnx::TensorProto::INT32});
+  cases.push_back(cast);
+  cast = MakeCase("Cast", {Doubles({4}, {-2.7, 2.7, -0.5, 1e10})});
+  AddAttribute(cast.node, "to", int64_t{onnx::TensorProto::INT64});
+  cases.push_back(cast);
+  cast = MakeCase("Cast", {Ints({3}, {0, -3, 1 << 30})});
+  AddAttribute(cast.node, "to", int64_t{onnx::TensorProto::FLOAT});
+  cases.push_back(cast);
+  cast = MakeCase("Cast", {Ints({3}, {0, -3, 2})});
+  AddAttribute(cast.node, "to", int64_t{onnx::TensorProto::BOOL});
+  cases.push_back(cast);
+
+  // negative axes and indices
+  auto gather = MakeCase(
+      "Gather", {Ints({2, 3}, {1, 2, 3, 4, 5, 6}), Ints({2}, {-1, 0})});
+  AddAttribute(gather.node, "axis", int64_t{-1});
+  cases.push_back(gather);
+  cases.push_back(MakeCase("Gather", {Ints({3}, {7, 8, 9}), Ints({}, {-2})}));
+  auto concat =
+      MakeCase("Concat", {Ints({2, 1}, {1, 2}), Ints({2, 2}, {3, 4, 5, 6})});
+  AddAttribute(concat.node, "axis", int64_t{-1});
+  cases.push_back(concat);
+  cases.push_back(MakeCase(
+      "Unsqueeze", {Ints({2, 3}, {1, 2, 3, 4, 5, 6}), Ints({2}, {-1, 0})}));
+  auto unsqueeze = MakeCase("Unsqueeze", {Ints({2}, {1, 2})}, 11);
+  AddAttribute(unsqueeze.node, "axes", std::vector<int64_t>{-1});
+  cases.push_back(unsqueeze);
+  cases.push_back(
+      MakeCase("Squeeze", {Ints({2, 1}, {1, 2}), Ints({1}, {-1})}));
+  cases.push_back(MakeCase("Squeeze", {Ints({1, 2, 1}, {1, 2})}));
+  cases.push_back(MakeCase(
+      "Reshape", {Ints({2, 3, 2}, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}),
+                  Ints({2}, {0, -1})}));
+  auto reshape =
+      MakeCase("Reshape", {Ints({0, 3}, {}), Ints({2}, {3, 0})}, 14);
+  AddAttribute(reshape.node, "allowzero", int64_t{1});
+  cases.push_back(reshape);
+  const auto matrix = Ints({3, 4}, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11});
+  cases.push_back(
+      MakeCase("Slice", {matrix, Ints({1}, {-1}), Ints({1}, {-5}),
+                         Ints({1}, {-1}), Ints({1}, {-1})}));
+  cases.push_back(MakeCase(
+      "Slice", {matrix, Ints({2}, {1, -3}),
+                Ints({2}, {std::numeric_limits<int64_t>::max(), 100}),
+                Ints({2}, {0, 1}), Ints({2}, {1, 2})}));
+  cases.push_back(MakeCase("Slice", {matrix, Ints({1}, {1}), Ints({1}, {3}),
+                                     onnx::TensorProto(), Ints({1}, {1})}));
+  cases.push_back(MakeCase(
+      "Range", {Ints({}, {5}), Ints({}, {-3}), Ints({}, {-2})}));
+  cases.push_back(
+      MakeCase("Range", {MakeFloats("", {}, {0}), MakeFloats("", {}, {1}),
+                         MakeFloats("", {}, {0.1f})}));
+
+  // the kernels that only read the dims
+  const auto x = MakeTensor("", onnx::TensorProto::UINT8, {2, 3, 4},
+                            std::vector<uint8_t>(24, 1));
+  auto shape = MakeCase("Shape", {x}, 15);
+  AddAttribute(shape.node, "start", int64_t{-2});
+  cases.push_back(shape);
+  shape = MakeCase("Shape", {x}, 15);
+  AddAttribute(shape.node, "end", int64_t{-1});
+  cases.push_back(shape);
+  cases.push_back(MakeCase("Size", {x}));
+  cases.push_back(MakeCase("Identity", {x}));
+  auto constant = MakeCase("Constant", {});
+  AddAttribute(constant.node, "value_ints", std::vector<int64_t>{3, -1});
+  cases.push_back(constant);
+  return cases;
+}
+
+}  // namespace
+
+int main() {
+  if (ModelExecutor::instance() == nullptr) {
+    std::cerr << "no model executor in this build" << std::endl;
+    return kSkipped;
+  }
+  for (const auto& c : GetCases()) {
+    ExpectSameAsExecutor(c);
+  }
+  return 0;
+}
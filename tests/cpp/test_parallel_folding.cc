@@ -0,0 +1,135 @@
+// Folds independent chains of constant nodes on a thread pool and checks
+// that they run concurrently, that the simplified model is the same as with
+// sequential folding byte for byte, and that a node failing in the middle of
+// a chain keeps it and the nodes depending on it.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test_util.h"
+#include "thread_pool.h"
+
+namespace {
+
+constexpr int kNumChains = 4;
+constexpr int kChainLength = 5;
+// the chain with a Cos in its middle, which the executor fails on
+constexpr int kFailingChain = 2;
+
+// Computes Sin, slowly enough for the chains to overlap, and fails on
+// anything else
+struct SinExecutor : public ModelExecutor {
+  std::vector<onnx::TensorProto> _Run(
+      const onnx::ModelProto& model,
+      const std::vector<const onnx::TensorProto*>& inputs) const override {
+    const auto& op = model.graph().node(0);
+    if (op.op_type() != "Sin") {
+      throw std::runtime_error("unsupported op " + op.op_type());
+    }
+    const int active = ++num_active;
+    max_active = std::max(max_active.load(), active);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    auto output = *inputs.at(0);
+    auto values = ToVector<float>(output);
+    for (auto& x : values) {
+      x = std::sin(x);
+    }
+    output.set_raw_data(values.data(), values.size() * sizeof(float));
+    num_active--;
+    return {output};
+  }
+
+  mutable std::atomic<int> num_active{0};
+  mutable std::atomic<int> max_active{0};
+};
+
+// x + chain(c_k) for every chain k, where a chain is kChainLength ops, all
+// Sin but the middle one of kFailingChain, which is Cos
+onnx::ModelProto MakeChainsModel() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {2});
+  for (int k = 0; k < kNumChains; k++) {
+    const auto prefix = "c" + std::to_string(k) + "_";
+    *graph->add_initializer() =
+        MakeFloats(prefix + "0", {2}, {0.5f * k, 1.0f + k});
+    for (int i = 0; i < kChainLength; i++) {
+      const bool fails = k == kFailingChain && i == kChainLength / 2;
+      AddNode(model, fails ? "Cos" : "Sin", {prefix + std::to_string(i)},
+              {prefix + std::to_string(i + 1)});
+    }
+    const auto y = "y" + std::to_string(k);
+    AddNode(model, "Add", {"x", prefix + std::to_string(kChainLength)}, {y});
+    *graph->add_output() = MakeValueInfo(y, onnx::TensorProto::FLOAT, {2});
+  }
+  return model;
+}
+
+onnx::ModelProto FoldWith(size_t num_threads,
+                          const std::shared_ptr<SinExecutor>& executor,
+                          std::vector<std::string>& warnings) {
+  SimplifyState state;
+  state.executor = executor;
+  if (num_threads > 1) {
+    state.thread_pool = std::make_shared<ThreadPool>(num_threads);
+  }
+  state.on_warning = [&warnings](const std::string& x) {
+    warnings.push_back(x);
+  };
+  return Simplify(MakeChainsModel(), std::vector<std::string>{}, true, true,
+                  -1, state);
+}
+
+void TestSameAsSequential() {
+  const auto sequential_executor = std::make_shared<SinExecutor>();
+  std::vector<std::string> sequential_warnings;
+  const auto sequential = FoldWith(1, sequential_executor, sequential_warnings);
+  CHECK(sequential_executor->max_active == 1);
+
+  // the Cos and the rest of its chain are kept, with the Adds
+  const int num_failed = kChainLength - kChainLength / 2;
+  CHECK(sequential.graph().node_size() == num_failed + kNumChains);
+  CHECK(sequential.graph().node(0).op_type() == "Cos");
+  // in every iteration, in the order of the nodes
+  CHECK(static_cast<int>(sequential_warnings.size()) >= num_failed);
+  for (int i = 0; i < num_failed; i++) {
+    const auto name = "_c" + std::to_string(kFailingChain) + "_" +
+                      std::to_string(kChainLength / 2 + i + 1) + "\"";
+    CHECK(sequential_warnings[i].find(name) != std::string::npos);
+  }
+  const auto last = "c0_" + std::to_string(kChainLength);
+  const auto* folded = FindInitializer(sequential, last);
+  CHECK(folded != nullptr);
+  std::vector<float> expected = {0, 1};
+  for (int i = 0; i < kChainLength; i++) {
+    for (auto& x : expected) {
+      x = std::sin(x);
+    }
+  }
+  CHECK(ToVector<float>(*folded) == expected);
+
+  const auto serialized = sequential.SerializeAsString();
+  for (int run = 0; run < 5; run++) {
+    const auto parallel_executor = std::make_shared<SinExecutor>();
+    std::vector<std::string> parallel_warnings;
+    const auto parallel =
+        FoldWith(kNumChains, parallel_executor, parallel_warnings);
+    CHECK(parallel_executor->max_active > 1);
+    CHECK(parallel.SerializeAsString() == serialized);
+    CHECK(parallel_warnings == sequential_warnings);
+  }
+}
+
+}  // namespace
+
+int main() {
+  TestSameAsSequential();
+  return 0;
+}
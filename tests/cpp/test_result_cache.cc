@@ -0,0 +1,126 @@
+// The cache of the simplified models in ONNXSIM_CACHE_DIR: a cache that
+// cannot be used only disables the caching, the temporary files count
+// toward the size limit, and the models with external data are cached with
+// the data as part of the key.
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <onnx/common/file_utils.h>
+
+#include "external_data.h"
+#include "result_cache.h"
+#include "test_util.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// x + w with 512 elements, never folded
+onnx::ModelProto MakeAddModel(float w0) {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {512});
+  *graph->add_output() = MakeValueInfo("y", onnx::TensorProto::FLOAT, {512});
+  std::vector<float> w(512, 1);
+  w[0] = w0;
+  *graph->add_initializer() = MakeFloats("w", {512}, w);
+  AddNode(model, "Add", {"x", "w"}, {"y"});
+  return model;
+}
+
+onnx::ModelProto SimplifyOnly(const onnx::ModelProto& model) {
+  return Simplify(model, std::nullopt, /*constant_folding=*/false,
+                  /*shape_inference=*/false, -1);
+}
+
+size_t CountEntries(const fs::path& dir) {
+  size_t n = 0;
+  for (const auto& x : fs::directory_iterator(dir)) {
+    n += x.path().extension() == ".onnx";
+  }
+  return n;
+}
+
+void TestUnusableCache(const fs::path& dir) {
+  // the directory cannot be created under a regular file
+  std::ofstream(dir / "file") << "x";
+  setenv("ONNXSIM_CACHE_DIR", (dir / "file" / "cache").c_str(), 1);
+  CHECK(SimplifyOnly(MakeAddModel(0)).graph().node_size() == 1);
+
+  for (const auto* size : {"-1", "abc", "10x"}) {
+    setenv("ONNXSIM_CACHE_DIR", (dir / "cache").c_str(), 1);
+    setenv("ONNXSIM_CACHE_SIZE_MB", size, 1);
+    CHECK(SimplifyOnly(MakeAddModel(0)).graph().node_size() == 1);
+    CHECK(!fs::exists(dir / "cache"));
+  }
+  unsetenv("ONNXSIM_CACHE_SIZE_MB");
+  unsetenv("ONNXSIM_CACHE_DIR");
+}
+
+void TestTemporaryFiles(const fs::path& dir) {
+  const auto cache_dir = dir / "tmp_cache";
+  ResultCache cache(cache_dir.string(), 250);
+  std::ofstream(cache_dir / "old.tmp.1") << std::string(100, 'x');
+  fs::last_write_time(cache_dir / "old.tmp.1",
+                      fs::file_time_type::clock::now() - std::chrono::hours(2));
+  std::ofstream(cache_dir / "new.tmp.1") << std::string(100, 'x');
+  cache.Put("a", std::string(100, 'a'));
+  // the file of a writer that died is removed, the one being written is not
+  CHECK(!fs::exists(cache_dir / "old.tmp.1"));
+  CHECK(fs::exists(cache_dir / "new.tmp.1"));
+  CHECK(cache.Get("a"));
+  fs::last_write_time(cache_dir / "a.onnx",
+                      fs::file_time_type::clock::now() - std::chrono::hours(1));
+  // but it takes room from the entries
+  cache.Put("b", std::string(100, 'b'));
+  CHECK(!cache.Get("a"));
+  CHECK(cache.Get("b"));
+}
+
+void TestExternalData(const fs::path& dir) {
+  const auto cache_dir = dir / "external_cache";
+  setenv("ONNXSIM_CACHE_DIR", cache_dir.c_str(), 1);
+  setenv("ONNXSIM_MMAP_EXTERNAL_DATA", "1", 1);
+  ExternalDataOptions options;
+  options.min_bytes = 0;
+  const auto in_path = (dir / "add.onnx").string();
+  const auto out_path = (dir / "add_sim.onnx").string();
+  const auto Run = [&](float w0) {
+    auto model = MakeAddModel(w0);
+    SaveModel(model, in_path, options);
+    SimplifyPath(in_path, out_path, std::nullopt, false, false, -1);
+  };
+  Run(0);
+  CHECK(CountEntries(cache_dir) == 1);
+  Run(0);
+  CHECK(CountEntries(cache_dir) == 1);
+  // only the data differs, so only the hash of the data tells them apart
+  Run(2);
+  CHECK(CountEntries(cache_dir) == 2);
+  onnx::ModelProto sim_model;
+  onnx::LoadProtoFromPath(out_path, sim_model);
+  ExternalDataStore store(dir.string());
+  store.Load(*sim_model.mutable_graph()->mutable_initializer(0));
+  CHECK(ToVector<float>(sim_model.graph().initializer(0))[0] == 2);
+  unsetenv("ONNXSIM_MMAP_EXTERNAL_DATA");
+  unsetenv("ONNXSIM_CACHE_DIR");
+}
+
+}  // namespace
+
+int main() {
+  std::string dir =
+      (fs::temp_directory_path() / "onnxsim_test_result_cache_XXXXXX")
+          .string();
+  CHECK(mkdtemp(dir.data()) != nullptr);
+  TestUnusableCache(dir);
+  TestTemporaryFiles(dir);
+  TestExternalData(dir);
+  fs::remove_all(dir);
+  return 0;
+}
@@ -0,0 +1,63 @@
+// The sessions of the builtin onnxruntime executor are cached by the op
+// with canonical tensor names, so ops that only differ in their names and
+// input values share one session, which GetFoldingStats reports as a hit.
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "test_util.h"
+
+namespace {
+
+// x + Sin(c1) + Sin(c2), where the two Sin ops only differ in their names
+onnx::ModelProto MakeTwoSinModel() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {2});
+  *graph->add_output() = MakeValueInfo("y", onnx::TensorProto::FLOAT, {2});
+  *graph->add_initializer() = MakeFloats("c1", {2}, {1, 2});
+  *graph->add_initializer() = MakeFloats("c2", {2}, {-3, 0.5});
+  AddNode(model, "Sin", {"c1"}, {"sin1"});
+  AddNode(model, "Sin", {"c2"}, {"sin2"});
+  AddNode(model, "Add", {"x", "sin1"}, {"x1"});
+  AddNode(model, "Add", {"x1", "sin2"}, {"y"});
+  return model;
+}
+
+void TestRenamedOps() {
+  const auto before = GetFoldingStats();
+  const auto sim_model = Simplify(MakeTwoSinModel(),
+                                  std::vector<std::string>{}, true, true, -1);
+  const auto after = GetFoldingStats();
+  CHECK(after.executor_folds >= before.executor_folds + 2);
+  // the second Sin reused the session of the first one
+  CHECK(after.session_cache_hits > before.session_cache_hits);
+
+  // the shared session still ran each op on its own inputs
+  const std::pair<const char*, std::vector<float>> expected[] = {
+      {"sin1", {1, 2}}, {"sin2", {-3, 0.5}}};
+  for (auto [name, values] : expected) {
+    const auto* folded = FindInitializer(sim_model, name);
+    CHECK(folded != nullptr);
+    const auto actual = ToVector<float>(*folded);
+    CHECK(actual.size() == values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+      CHECK(std::abs(actual[i] - std::sin(values[i])) < 1e-6f);
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+#ifdef NO_BUILTIN_ORT
+  // the sessions are only cached by the builtin onnxruntime executor
+  std::cerr << "no builtin onnxruntime in this build" << std::endl;
+  return kSkipped;
+#endif
+  TestRenamedOps();
+  return 0;
+}
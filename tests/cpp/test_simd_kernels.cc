@@ -0,0 +1,140 @@
+// Compares the kernels that work on whole float buffers (the SIMD loops of
+// simd_kernels.cpp) with the model executor. ctest runs this a second time
+// with ONNXSIM_SIMD=scalar to cover the plain C++ loops too.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "kernel_test_util.h"
+#include "test_util.h"
+
+namespace {
+
+// Deterministic values of all magnitudes and signs, with the special values
+// mixed in.
+std::vector<float> MakeValues(size_t n, uint32_t seed) {
+  const float specials[] = {0.0f,
+                            -0.0f,
+                            1.0f,
+                            -1.0f,
+                            std::numeric_limits<float>::infinity(),
+                            -std::numeric_limits<float>::infinity(),
+                            std::numeric_limits<float>::quiet_NaN(),
+                            std::numeric_limits<float>::denorm_min(),
+                            std::numeric_limits<float>::min(),
+                            std::numeric_limits<float>::max()};
+  std::vector<float> values(n);
+  uint32_t state = seed;
+  for (size_t i = 0; i < n; i++) {
+    state = state * 1664525u + 1013904223u;
+    if (state % 17 == 0) {
+      values[i] = specials[(state >> 8) % std::size(specials)];
+    } else {
+      values[i] = std::ldexp(static_cast<float>(state >> 8) / (1 << 24) - 0.5f,
+                             static_cast<int>(state % 40) - 20);
+    }
+  }
+  return values;
+}
+
+onnx::TensorProto Floats(const std::vector<int64_t>& dims, uint32_t seed) {
+  size_t n = 1;
+  for (const auto dim : dims) {
+    n *= dim;
+  }
+  return MakeFloats("", dims, MakeValues(n, seed));
+}
+
+template <typename T>
+std::vector<T> Iota(size_t n) {
+  std::vector<T> values(n);
+  for (size_t i = 0; i < n; i++) {
+    values[i] = static_cast<T>(i);
+  }
+  return values;
+}
+
+onnx::TensorProto Halves(const std::vector<int64_t>& dims,
+                         const std::vector<uint16_t>& values) {
+  return MakeTensor("", onnx::TensorProto::FLOAT16, dims, values);
+}
+
+std::vector<Case> GetCases() {
+  std::vector<Case> cases;
+  // sizes that are not a multiple of any vector width, and broadcasting
+  // that splits the output into runs of every kind
+  for (const char* op : {"Add", "Sub", "Mul", "Div"}) {
+    cases.push_back(MakeCase(op, {Floats({1031}, 1), Floats({1031}, 2)}));
+    cases.push_back(MakeCase(op, {Floats({1031}, 3), Floats({}, 4)}));
+    cases.push_back(MakeCase(op, {Floats({1}, 5), Floats({3, 37}, 6)}));
+    cases.push_back(
+        MakeCase(op, {Floats({2, 3, 5, 7}, 7), Floats({1, 3, 1, 1}, 8)}));
+    cases.push_back(MakeCase(op, {Floats({4, 1}, 9), Floats({1, 37}, 10)}));
+    cases.push_back(
+        MakeCase(op, {Floats({3, 1, 19}, 11), Floats({2, 1}, 12)}));
+  }
+  for (const char* op : {"Sqrt", "Reciprocal"}) {
+    cases.push_back(MakeCase(op, {Floats({3, 345}, 13)}));
+  }
+
+  // the conversions around the f16 range and precision: the largest half,
+  // the overflow to inf, subnormals, the underflow to zero and ties
+  std::vector<float> edges = {65504.0f,
+                              65519.0f,
+                              65520.0f,
+                              -65520.0f,
+                              1e6f,
+                              6.1035156e-5f,
+                              6.0975552e-5f,
+                              5.9604645e-8f,
+                              2.9802322e-8f,
+                              2.9802326e-8f,
+                              1e-9f,
+                              -1e-9f,
+                              1.0f + 1.0f / 2048,
+                              1.0f + 3.0f / 2048,
+                              2049.0f,
+                              2051.0f};
+  const auto more = MakeValues(1000, 14);
+  edges.insert(edges.end(), more.begin(), more.end());
+  auto cast = MakeCase(
+      "Cast", {MakeFloats("", {static_cast<int64_t>(edges.size())}, edges)});
+  AddAttribute(cast.node, "to", int64_t{onnx::TensorProto::FLOAT16});
+  cases.push_back(cast);
+  // every half, including the subnormals, infs and NaNs
+  cast = MakeCase("Cast", {Halves({1 << 16}, Iota<uint16_t>(1 << 16))});
+  AddAttribute(cast.node, "to", int64_t{onnx::TensorProto::FLOAT});
+  cases.push_back(cast);
+
+  auto transpose = MakeCase("Transpose", {Floats({2, 3, 4, 5}, 15)});
+  AddAttribute(transpose.node, "perm", std::vector<int64_t>{3, 1, 0, 2});
+  cases.push_back(transpose);
+  cases.push_back(MakeCase(
+      "Transpose", {MakeTensor("", onnx::TensorProto::UINT8, {17, 33},
+                               Iota<uint8_t>(17 * 33))}));
+  transpose =
+      MakeCase("Transpose", {Halves({4, 8, 9}, Iota<uint16_t>(4 * 8 * 9))});
+  AddAttribute(transpose.node, "perm", std::vector<int64_t>{2, 0, 1});
+  cases.push_back(transpose);
+  transpose =
+      MakeCase("Transpose", {MakeInts("", {3, 5, 2}, Iota<int64_t>(30))});
+  AddAttribute(transpose.node, "perm", std::vector<int64_t>{1, 2, 0});
+  cases.push_back(transpose);
+  return cases;
+}
+
+}  // namespace
+
+int main() {
+  if (ModelExecutor::instance() == nullptr) {
+    std::cerr << "no model executor in this build" << std::endl;
+    return kSkipped;
+  }
+  for (const auto& c : GetCases()) {
+    ExpectSameAsExecutor(c);
+  }
+  return 0;
+}
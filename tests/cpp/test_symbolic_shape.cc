@@ -0,0 +1,121 @@
+// Folds the Shape -> Gather -> Concat -> Reshape patterns of exported models
+// with symbolic dims and checks the constant shapes given to Reshape.
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "symbolic_shape.h"
+#include "test_util.h"
+
+namespace {
+
+// x -> Shape -> Gather(i) for each of `gathered` -> Unsqueeze -> Concat with
+// `tail` -> Reshape(x). The dims of x with a non-empty param are symbolic.
+onnx::ModelProto MakeReshapeModel(const std::vector<int64_t>& dims,
+                                  const std::vector<std::string>& params,
+                                  const std::vector<int64_t>& gathered,
+                                  const std::vector<int64_t>& tail,
+                                  int64_t allow_zero = 0) {
+  auto model = MakeModel(14);
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, dims,
+                                      params);
+  graph->add_output()->set_name("y");
+  *graph->add_initializer() = MakeInts("axes", {1}, {0});
+  *graph->add_initializer() =
+      MakeInts("tail", {static_cast<int64_t>(tail.size())}, tail);
+  AddNode(model, "Shape", {"x"}, {"shape"});
+  std::vector<std::string> parts;
+  for (const auto i : gathered) {
+    const auto index = "index" + std::to_string(i);
+    const auto dim = "dim" + std::to_string(i);
+    *graph->add_initializer() = MakeInts(index, {}, {i});
+    AddNode(model, "Gather", {"shape", index}, {dim});
+    AddNode(model, "Unsqueeze", {dim, "axes"}, {dim + "_1d"});
+    parts.push_back(dim + "_1d");
+  }
+  parts.push_back("tail");
+  AddAttribute(AddNode(model, "Concat", parts, {"new_shape"}), "axis",
+               int64_t{0});
+  auto& reshape = AddNode(model, "Reshape", {"x", "new_shape"}, {"y"});
+  if (allow_zero != 0) {
+    AddAttribute(reshape, "allowzero", allow_zero);
+  }
+  return model;
+}
+
+// The constant shape input of the Reshape after folding, if it has one.
+std::optional<std::vector<int64_t>> GetReshapeShape(
+    const onnx::ModelProto& model) {
+  for (const auto& node : model.graph().node()) {
+    if (node.op_type() != "Reshape") {
+      continue;
+    }
+    const auto* shape = FindInitializer(model, node.input(1));
+    if (shape == nullptr) {
+      return std::nullopt;
+    }
+    return ToVector<int64_t>(*shape);
+  }
+  CHECK(false);
+  return std::nullopt;
+}
+
+void TestCopiedDims() {
+  // [batch, seq, 768] -> [batch, seq, 12, 64]
+  auto model =
+      MakeReshapeModel({0, 0, 768}, {"batch", "seq"}, {0, 1}, {12, 64});
+  CHECK(FoldSymbolicShapes(model));
+  CHECK((GetReshapeShape(model) == std::vector<int64_t>{0, 0, 12, 64}));
+}
+
+void TestInferredDim() {
+  // [batch, seq, 768] -> [seq, 768]: seq is not at the same position
+  auto model = MakeReshapeModel({0, 0, 768}, {"batch", "seq"}, {1}, {768});
+  CHECK(FoldSymbolicShapes(model));
+  CHECK((GetReshapeShape(model) == std::vector<int64_t>{-1, 768}));
+}
+
+void TestStaticDims() {
+  // the gathered dims are static, so the whole shape is known
+  auto model = MakeReshapeModel({0, 16, 768}, {"batch"}, {1, 2}, {1});
+  CHECK(FoldSymbolicShapes(model));
+  CHECK((GetReshapeShape(model) == std::vector<int64_t>{16, 768, 1}));
+}
+
+void TestTwoUnknownDims() {
+  // two dims that can be neither copied nor inferred
+  auto model = MakeReshapeModel({0, 0, 8}, {"batch", "seq"}, {1, 0}, {8});
+  FoldSymbolicShapes(model);
+  CHECK(!GetReshapeShape(model));
+}
+
+void TestAllowZero() {
+  // with allowzero, 0 means an empty dim, so the dims are not copied
+  auto model =
+      MakeReshapeModel({0, 4, 768}, {"batch"}, {0}, {4, 768}, /*allow_zero=*/1);
+  CHECK(FoldSymbolicShapes(model));
+  CHECK((GetReshapeShape(model) == std::vector<int64_t>{-1, 4, 768}));
+
+  // a known 0 and an inferred dim are invalid together with allowzero
+  model = MakeReshapeModel({0, 0, 4}, {"batch"}, {0, 1}, {4}, 1);
+  FoldSymbolicShapes(model);
+  CHECK(!GetReshapeShape(model));
+
+  // without allowzero, the 0 copies the input dim, which is 0 too
+  model = MakeReshapeModel({0, 0, 4}, {"batch"}, {0, 1}, {4});
+  CHECK(FoldSymbolicShapes(model));
+  CHECK((GetReshapeShape(model) == std::vector<int64_t>{0, 0, 4}));
+}
+
+}  // namespace
+
+int main() {
+  TestCopiedDims();
+  TestInferredDim();
+  TestStaticDims();
+  TestTwoUnknownDims();
+  TestAllowZero();
+  return 0;
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <onnx/onnx_pb.h>
+
+#include "onnxsim.h"
+
+// The C++ tests are plain executables run by ctest. A failed CHECK prints
+// the condition and exits with 1; a test that cannot run in this build, e.g.
+// without a model executor, exits with kSkipped.
+
+#define CHECK(cond)                                                        \
+  do {                                                                     \
+    if (!(cond)) {                                                         \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond \
+                << std::endl;                                              \
+      std::exit(1);                                                        \
+    }                                                                      \
+  } while (false)
+
+constexpr int kSkipped = 77;
+
+template <typename T>
+onnx::TensorProto MakeTensor(const std::string& name, int32_t dtype,
+                             const std::vector<int64_t>& dims,
+                             const std::vector<T>& values) {
+  onnx::TensorProto tensor;
+  tensor.set_name(name);
+  tensor.set_data_type(dtype);
+  for (const auto dim : dims) {
+    tensor.add_dims(dim);
+  }
+  tensor.set_raw_data(std::string(reinterpret_cast<const char*>(values.data()),
+                                  values.size() * sizeof(T)));
+  return tensor;
+}
+
+inline onnx::TensorProto MakeFloats(const std::string& name,
+                                    const std::vector<int64_t>& dims,
+                                    const std::vector<float>& values) {
+  return MakeTensor(name, onnx::TensorProto::FLOAT, dims, values);
+}
+
+inline onnx::TensorProto MakeInts(const std::string& name,
+                                  const std::vector<int64_t>& dims,
+                                  const std::vector<int64_t>& values) {
+  return MakeTensor(name, onnx::TensorProto::INT64, dims, values);
+}
+
+// The elements of a raw or typed tensor of a type with a typed field of the
+// same width (float, double, int64).
+template <typename T>
+std::vector<T> ToVector(const onnx::TensorProto& tensor) {
+  if (tensor.has_raw_data()) {
+    std::vector<T> values(tensor.raw_data().size() / sizeof(T));
+    std::memcpy(values.data(), tensor.raw_data().data(),
+                values.size() * sizeof(T));
+    return values;
+  }
+  if constexpr (std::is_same_v<T, float>) {
+    return {tensor.float_data().begin(), tensor.float_data().end()};
+  } else if constexpr (std::is_same_v<T, double>) {
+    return {tensor.double_data().begin(), tensor.double_data().end()};
+  } else {
+    return {tensor.int64_data().begin(), tensor.int64_data().end()};
+  }
+}
+
+// A tensor value info; the dims with a non-empty param are symbolic.
+inline onnx::ValueInfoProto MakeValueInfo(
+    const std::string& name, int32_t dtype, const std::vector<int64_t>& dims,
+    const std::vector<std::string>& params = {}) {
+  onnx::ValueInfoProto value_info;
+  value_info.set_name(name);
+  auto* type = value_info.mutable_type()->mutable_tensor_type();
+  type->set_elem_type(dtype);
+  auto* shape = type->mutable_shape();
+  for (size_t i = 0; i < dims.size(); i++) {
+    auto* dim = shape->add_dim();
+    if (i < params.size() && !params[i].empty()) {
+      dim->set_dim_param(params[i]);
+    } else {
+      dim->set_dim_value(dims[i]);
+    }
+  }
+  return value_info;
+}
+
+inline onnx::ModelProto MakeModel(int64_t opset = 13) {
+  onnx::ModelProto model;
+  model.set_ir_version(8);
+  auto* opset_import = model.add_opset_import();
+  opset_import->set_domain("");
+  opset_import->set_version(opset);
+  model.mutable_graph()->set_name("test");
+  return model;
+}
+
+inline onnx::NodeProto MakeNode(const std::string& op_type,
+                                const std::vector<std::string>& inputs,
+                                const std::vector<std::string>& outputs) {
+  onnx::NodeProto node;
+  node.set_op_type(op_type);
+  node.set_name(op_type + "_" + outputs.at(0));
+  for (const auto& x : inputs) {
+    node.add_input(x);
+  }
+  for (const auto& x : outputs) {
+    node.add_output(x);
+  }
+  return node;
+}
+
+inline onnx::NodeProto& AddNode(onnx::ModelProto& model,
+                                const std::string& op_type,
+                                const std::vector<std::string>& inputs,
+                                const std::vector<std::string>& outputs) {
+  auto* node = model.mutable_graph()->add_node();
+  *node = MakeNode(op_type, inputs, outputs);
+  return *node;
+}
+
+inline void AddAttribute(onnx::NodeProto& node, const std::string& name,
+                         int64_t value) {
+  auto* attr = node.add_attribute();
+  attr->set_name(name);
+  attr->set_type(onnx::AttributeProto::INT);
+  attr->set_i(value);
+}
+
+inline void AddAttribute(onnx::NodeProto& node, const std::string& name,
+                         const std::vector<int64_t>& values) {
+  auto* attr = node.add_attribute();
+  attr->set_name(name);
+  attr->set_type(onnx::AttributeProto::INTS);
+  for (const auto x : values) {
+    attr->add_ints(x);
+  }
+}
+
+inline const onnx::TensorProto* FindInitializer(const onnx::ModelProto& model,
+                                                const std::string& name) {
+  for (const auto& x : model.graph().initializer()) {
+    if (x.name() == name) {
+      return &x;
+    }
+  }
+  return nullptr;
+}
+
+// Runs `node` alone on the model executor, with an input per non-empty node
+// input.
+inline std::vector<onnx::TensorProto> RunOnExecutor(
+    const onnx::NodeProto& node, const std::vector<onnx::TensorProto>& inputs,
+    int64_t opset = 13) {
+  auto model = MakeModel(opset);
+  auto* graph = model.mutable_graph();
+  *graph->add_node() = node;
+  std::vector<const onnx::TensorProto*> input_ptrs;
+  for (int i = 0; i < node.input_size(); i++) {
+    if (node.input(i).empty()) {
+      continue;
+    }
+    const auto& x = inputs.at(i);
+    *graph->add_input() = MakeValueInfo(
+        node.input(i), x.data_type(), {x.dims().begin(), x.dims().end()});
+    input_ptrs.push_back(&x);
+  }
+  for (const auto& x : node.output()) {
+    graph->add_output()->set_name(x);
+  }
+  return ModelExecutor::Run(model, input_ptrs);
+}
+
+// The elements of a tensor as little endian bytes, from raw_data or from the
+// typed field holding them.
+inline std::string ElementBytes(const onnx::TensorProto& tensor) {
+  if (tensor.has_raw_data()) {
+    return tensor.raw_data();
+  }
+  std::string bytes;
+  const auto Append = [&bytes](const auto& field, size_t elem_size) {
+    for (const auto x : field) {
+      bytes.append(reinterpret_cast<const char*>(&x), elem_size);
+    }
+  };
+  switch (tensor.data_type()) {
+    case onnx::TensorProto::FLOAT:
+      Append(tensor.float_data(), 4);
+      break;
+    case onnx::TensorProto::DOUBLE:
+      Append(tensor.double_data(), 8);
+      break;
+    case onnx::TensorProto::INT64:
+      Append(tensor.int64_data(), 8);
+      break;
+    case onnx::TensorProto::UINT64:
+      Append(tensor.uint64_data(), 8);
+      break;
+    case onnx::TensorProto::UINT32:
+      Append(tensor.uint64_data(), 4);
+      break;
+    case onnx::TensorProto::INT32:
+      Append(tensor.int32_data(), 4);
+      break;
+    case onnx::TensorProto::INT16:
+    case onnx::TensorProto::UINT16:
+    case onnx::TensorProto::FLOAT16:
+    case onnx::TensorProto::BFLOAT16:
+      Append(tensor.int32_data(), 2);
+      break;
+    default:
+      Append(tensor.int32_data(), 1);
+      break;
+  }
+  return bytes;
+}
+
+// Whether two tensors have the same dtype, dims and elements, bit for bit
+// except that all NaNs are equal.
+inline bool SameTensor(const onnx::TensorProto& a, const onnx::TensorProto& b) {
+  if (a.data_type() != b.data_type() ||
+      !std::equal(a.dims().begin(), a.dims().end(), b.dims().begin(),
+                  b.dims().end())) {
+    return false;
+  }
+  const auto a_bytes = ElementBytes(a);
+  const auto b_bytes = ElementBytes(b);
+  if (a_bytes == b_bytes) {
+    return true;
+  }
+  if (a_bytes.size() != b_bytes.size()) {
+    return false;
+  }
+  const auto SameElements = [&](auto zero, auto is_nan) {
+    using T = decltype(zero);
+    for (size_t i = 0; i < a_bytes.size(); i += sizeof(T)) {
+      T x, y;
+      std::memcpy(&x, a_bytes.data() + i, sizeof(T));
+      std::memcpy(&y, b_bytes.data() + i, sizeof(T));
+      if (std::memcmp(&x, &y, sizeof(T)) != 0 && !(is_nan(x) && is_nan(y))) {
+        return false;
+      }
+    }
+    return true;
+  };
+  switch (a.data_type()) {
+    case onnx::TensorProto::FLOAT:
+      return SameElements(0.0f, [](float x) { return x != x; });
+    case onnx::TensorProto::DOUBLE:
+      return SameElements(0.0, [](double x) { return x != x; });
+    case onnx::TensorProto::FLOAT16:
+      return SameElements(uint16_t{0}, [](uint16_t x) {
+        return (x & 0x7c00) == 0x7c00 && (x & 0x03ff) != 0;
+      });
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,73 @@
+// The warnings of a simplification go to SimplifyState::on_warning when it
+// is set, e.g. to be printed together with the other output of the model.
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "test_util.h"
+
+namespace {
+
+struct FailingExecutor : public ModelExecutor {
+  std::vector<onnx::TensorProto> _Run(
+      const onnx::ModelProto&,
+      const std::vector<const onnx::TensorProto*>&) const override {
+    throw std::runtime_error("failing executor");
+  }
+};
+
+// x + Sin(c), where Sin is left to the executor
+onnx::ModelProto MakeSinModel() {
+  auto model = MakeModel();
+  auto* graph = model.mutable_graph();
+  *graph->add_input() = MakeValueInfo("x", onnx::TensorProto::FLOAT, {2});
+  *graph->add_output() = MakeValueInfo("y", onnx::TensorProto::FLOAT, {2});
+  *graph->add_initializer() = MakeFloats("c", {2}, {1, 2});
+  AddNode(model, "Sin", {"c"}, {"sin"});
+  AddNode(model, "Add", {"x", "sin"}, {"y"});
+  return model;
+}
+
+bool Contains(const std::vector<std::string>& warnings,
+              const std::string& text) {
+  return std::any_of(warnings.begin(), warnings.end(), [&](const auto& x) {
+    return x.find(text) != std::string::npos;
+  });
+}
+
+void TestFailedOp() {
+  std::vector<std::string> warnings;
+  SimplifyState state;
+  state.executor = std::make_shared<FailingExecutor>();
+  state.on_warning = [&warnings](const std::string& x) {
+    warnings.push_back(x);
+  };
+  const auto sim_model =
+      Simplify(MakeSinModel(), std::nullopt, true, true, -1, state);
+  CHECK(sim_model.graph().node_size() == 2);
+  CHECK(warnings.size() == 1);
+  CHECK(Contains(warnings, "\"Sin\""));
+}
+
+void TestTimeout() {
+  std::vector<std::string> warnings;
+  SimplifyState state;
+  state.executor = std::make_shared<FailingExecutor>();
+  state.on_warning = [&warnings](const std::string& x) {
+    warnings.push_back(x);
+  };
+  setenv("ONNXSIM_FIXED_POINT_ITERS", "0", 1);
+  Simplify(MakeSinModel(), std::nullopt, true, true, -1, state);
+  unsetenv("ONNXSIM_FIXED_POINT_ITERS");
+  CHECK(Contains(warnings, "ONNXSIM_FIXED_POINT_ITERS"));
+}
+
+}  // namespace
+
+int main() {
+  TestFailedOp();
+  TestTimeout();
+  return 0;
+}